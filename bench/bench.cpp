@@ -0,0 +1,949 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stack>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "shush-stack.hpp"
+
+using namespace shush::stack;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - ELEMENTS- - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * Element of the given size. Never equal to poison.
+ */
+template <size_t Size>
+struct Blob {
+  Blob() = default;
+  explicit Blob(size_t seed) {
+    std::fill(bytes, bytes + Size, static_cast<char>('a' + seed % 26));
+  }
+
+  char bytes[Size];
+};
+
+template <size_t Size>
+std::string to_string(const Blob<Size>& blob) {
+  return std::string(blob.bytes, Size);
+}
+
+/**
+ * Element that wants to start on a boundary of its size, like a SIMD
+ * vector or a record padded to a cache line.
+ */
+template <size_t Size>
+struct alignas(Size) AlignedBlob : Blob<Size> {
+  using Blob<Size>::Blob;
+  AlignedBlob() = default;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - CONTAINERS- - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * Gives all the benchmarked containers the same Push/Pop interface.
+ */
+template <class T>
+struct VectorAdapter {
+  static constexpr size_t MAX_DEPTH = 1000000;
+
+  void Push(const T& item) { vec_.push_back(item); }
+  T Pop() {
+    T res = vec_.back();
+    vec_.pop_back();
+    return res;
+  }
+
+  std::vector<T> vec_;
+};
+
+template <class T>
+struct StdStackAdapter {
+  static constexpr size_t MAX_DEPTH = 1000000;
+
+  void Push(const T& item) { stack_.push(item); }
+  T Pop() {
+    T res = stack_.top();
+    stack_.pop();
+    return res;
+  }
+
+  std::stack<T> stack_;
+};
+
+template <class T, class... Policies>
+struct SafeStackAdapter {
+  static constexpr size_t MAX_DEPTH = 1000000;
+
+  void Push(const T& item) { stack_.Push(item); }
+  T Pop() { return stack_.Pop(); }
+
+  SafeStack<T, Policies...> stack_;
+};
+
+/**
+ * Stacks with O(N) Push/Pop. Deep ones take forever to fill.
+ */
+template <class T, class... Policies>
+struct SlowSafeStackAdapter : SafeStackAdapter<T, Policies...> {
+  static constexpr size_t MAX_DEPTH = 10000;
+};
+
+template <class T, class... Policies>
+struct SafeStackStaticAdapter {
+  static constexpr size_t MAX_DEPTH = (1 << 17) - 1;
+
+  void Push(const T& item) { stack_.Push(item); }
+  T Pop() { return stack_.Pop(); }
+
+  SafeStackStatic<T, MAX_DEPTH + 1, Policies...> stack_;
+};
+
+template <class T, size_t ChunkSize, class... Policies>
+struct SegmentedSafeStackAdapter {
+  static constexpr size_t MAX_DEPTH = 1000000;
+
+  void Push(const T& item) { stack_.Push(item); }
+  T Pop() { return stack_.Pop(); }
+
+  SegmentedSafeStack<T, ChunkSize, Policies...> stack_;
+};
+
+/**
+ * The production setup: every layer is on, but none of them is O(N).
+ */
+template <class T>
+using Production = SafeStackAdapter<
+    T, IncrementalHash, VerifySampled<>, LogNone>;
+
+template <class T>
+using ProductionStatic = SafeStackStaticAdapter<
+    T, IncrementalHash, VerifySampled<>, LogNone>;
+
+template <class T>
+using Segmented = SegmentedSafeStackAdapter<
+    T, DEFAULT_CHUNK_BYTES / sizeof(T), Wyhash, LogNone>;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - BENCHMARKS- - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * Container is heap allocated and filled with depth elements, since static
+ * stacks do not fit on the stack.
+ */
+template <class Container, class T>
+static std::unique_ptr<Container> MakeFilled(benchmark::State& state) {
+  const size_t depth = state.range(0);
+  if (depth > Container::MAX_DEPTH) {
+    state.SkipWithError("depth is too big for this container");
+    return nullptr;
+  }
+
+  auto container = std::make_unique<Container>();
+  for (size_t i = 0; i < depth; ++i) {
+    container->Push(T(i));
+  }
+
+  return container;
+}
+
+/**
+ * One Push and one Pop on top of a stack filled to state.range(0).
+ */
+template <class Container, class T>
+static void BM_Throughput(benchmark::State& state) {
+  auto container = MakeFilled<Container, T>(state);
+  if (!container) {
+    return;
+  }
+
+  const T item(42);
+  for (auto _ : state) {
+    container->Push(item);
+    benchmark::DoNotOptimize(container->Pop());
+  }
+
+  state.SetItemsProcessed(state.iterations() * 2);
+  state.SetBytesProcessed(state.iterations() * 2 * sizeof(T));
+}
+
+/**
+ * Same as BM_Throughput, but every Push and Pop is timed on its own, and
+ * their 50th, 99th and 99.9th percentiles are reported in nanoseconds.
+ */
+template <class Container, class T>
+static void BM_Latency(benchmark::State& state) {
+  using Clock = std::chrono::steady_clock;
+  static const size_t MAX_SAMPLES = 1 << 20;
+
+  auto container = MakeFilled<Container, T>(state);
+  if (!container) {
+    return;
+  }
+
+  std::vector<int64_t> push_ns;
+  std::vector<int64_t> pop_ns;
+  push_ns.reserve(MAX_SAMPLES);
+  pop_ns.reserve(MAX_SAMPLES);
+
+  const T item(42);
+  for (auto _ : state) {
+    const auto start = Clock::now();
+    container->Push(item);
+    const auto pushed = Clock::now();
+    benchmark::DoNotOptimize(container->Pop());
+    const auto popped = Clock::now();
+
+    if (push_ns.size() < MAX_SAMPLES) {
+      push_ns.push_back((pushed - start).count());
+      pop_ns.push_back((popped - pushed).count());
+    }
+  }
+
+  auto percentile = [](std::vector<int64_t>& samples, double p) {
+    const size_t ind = static_cast<size_t>(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + ind, samples.end());
+    return static_cast<double>(samples[ind]);
+  };
+
+  state.counters["push_p50_ns"]  = percentile(push_ns, 0.5);
+  state.counters["push_p99_ns"]  = percentile(push_ns, 0.99);
+  state.counters["push_p999_ns"] = percentile(push_ns, 0.999);
+  state.counters["pop_p50_ns"]   = percentile(pop_ns, 0.5);
+  state.counters["pop_p99_ns"]   = percentile(pop_ns, 0.99);
+  state.counters["pop_p999_ns"]  = percentile(pop_ns, 0.999);
+}
+
+#define BENCH_DEPTHS(max_depth) \
+  ->RangeMultiplier(10)->Range(10, max_depth)
+
+#define BENCH_CONTAINER(Container, T, max_depth)                           \
+  BENCHMARK_TEMPLATE(BM_Throughput, Container, T) BENCH_DEPTHS(max_depth); \
+  BENCHMARK_TEMPLATE(BM_Latency, Container, T) BENCH_DEPTHS(max_depth)
+
+/**
+ * Element sizes and depths for the production setup against the standard
+ * containers.
+ */
+#define BENCH_ELEMENT(T)                                     \
+  BENCH_CONTAINER(VectorAdapter<T>, T, 1000000);             \
+  BENCH_CONTAINER(StdStackAdapter<T>, T, 1000000);           \
+  BENCH_CONTAINER(Production<T>, T, 1000000);                \
+  BENCH_CONTAINER(ProductionStatic<T>, T, 100000);           \
+  BENCH_CONTAINER(Segmented<T>, T, 1000000)
+
+/**
+ * Fills a new container to state.range(0) elements, timing every Push, and
+ * reports the percentiles and the maximum in nanoseconds. The tail is where
+ * reallocations of a growing stack show up.
+ */
+template <class Container, class T>
+static void BM_GrowthLatency(benchmark::State& state) {
+  using Clock = std::chrono::steady_clock;
+
+  const size_t         depth = state.range(0);
+  std::vector<int64_t> push_ns(depth);
+
+  int64_t max_ns = 0;
+  const T item(42);
+  for (auto _ : state) {
+    auto container = std::make_unique<Container>();
+    for (size_t i = 0; i < depth; ++i) {
+      const auto start = Clock::now();
+      container->Push(item);
+      push_ns[i] = (Clock::now() - start).count();
+    }
+    max_ns = std::max(max_ns, *std::max_element(push_ns.begin(),
+                                                push_ns.end()));
+  }
+
+  auto percentile = [&push_ns](double p) {
+    const size_t ind = static_cast<size_t>(p * (push_ns.size() - 1));
+    std::nth_element(push_ns.begin(), push_ns.begin() + ind, push_ns.end());
+    return static_cast<double>(push_ns[ind]);
+  };
+
+  state.counters["push_max_ns"]   = static_cast<double>(max_ns);
+  state.counters["push_p9999_ns"] = percentile(0.9999);
+  state.counters["push_p999_ns"]  = percentile(0.999);
+  state.counters["push_p50_ns"]   = percentile(0.5);
+  state.SetItemsProcessed(state.iterations() * depth);
+}
+
+#define BENCH_GROWTH(Container, T)                   \
+  BENCHMARK_TEMPLATE(BM_GrowthLatency, Container, T) \
+      ->RangeMultiplier(10)->Range(10000, 1000000)   \
+      ->Unit(benchmark::kMillisecond)
+
+BENCH_GROWTH(VectorAdapter<Blob<32>>, Blob<32>);
+BENCH_GROWTH(Production<Blob<32>>, Blob<32>);
+BENCH_GROWTH(Segmented<Blob<32>>, Blob<32>);
+
+BENCH_ELEMENT(Blob<1>);
+BENCH_ELEMENT(Blob<8>);
+BENCH_ELEMENT(Blob<32>);
+BENCH_ELEMENT(Blob<256>);
+BENCH_ELEMENT(AlignedBlob<64>);
+
+/**
+ * Layer breakdown: each setup differs from Production in one layer.
+ */
+using Elem = Blob<8>;
+
+using WithFullHash =
+    SlowSafeStackAdapter<Elem, FullHash, VerifySampled<>, LogNone>;
+using WithVerifyCanaries =
+    SafeStackAdapter<Elem, IncrementalHash, VerifyCanaries, LogNone>;
+using WithVerifyHeader =
+    SafeStackAdapter<Elem, IncrementalHash, VerifyHeader, LogNone>;
+using WithVerifyParanoid =
+    SlowSafeStackAdapter<Elem, IncrementalHash, VerifyParanoid, LogNone>;
+using WithLogErrors =
+    SafeStackAdapter<Elem, IncrementalHash, VerifySampled<>, LogErrors>;
+using WithLogAll =
+    SafeStackAdapter<Elem, IncrementalHash, VerifySampled<>, LogAll>;
+using WithNoHash =
+    SafeStackAdapter<Elem, NoHash, VerifySampled<>, LogNone>;
+using WithNoCanaries =
+    SafeStackAdapter<Elem, IncrementalHash, VerifySampled<>, LogNone,
+                     HeapAllocator, NoCanaries>;
+using WithNoPoison =
+    SafeStackAdapter<Elem, IncrementalHash, VerifySampled<>, LogNone,
+                     HeapAllocator, WithCanaries, NoPoison>;
+/**
+ * Every layer off, to compare with std::vector.
+ */
+using Bare =
+    SafeStackAdapter<Elem, NoHash, VerifyNone, LogNone, HeapAllocator,
+                     NoCanaries, NoPoison>;
+
+BENCH_CONTAINER(WithFullHash, Elem, 10000);
+BENCH_CONTAINER(WithVerifyCanaries, Elem, 1000000);
+BENCH_CONTAINER(WithVerifyHeader, Elem, 1000000);
+BENCH_CONTAINER(WithVerifyParanoid, Elem, 10000);
+BENCH_CONTAINER(WithLogErrors, Elem, 1000000);
+BENCH_CONTAINER(WithLogAll, Elem, 10000);
+BENCH_CONTAINER(WithNoHash, Elem, 1000000);
+BENCH_CONTAINER(WithNoCanaries, Elem, 1000000);
+BENCH_CONTAINER(WithNoPoison, Elem, 1000000);
+BENCH_CONTAINER(Bare, Elem, 1000000);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - ALLOCATION- - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * A short-lived stack: created, given state.range(0) elements, destroyed.
+ */
+template <class Stack>
+static void BM_ShortLived(benchmark::State& state) {
+  const size_t count = state.range(0);
+  for (auto _ : state) {
+    Stack stack;
+    for (size_t i = 0; i < count; ++i) {
+      stack.Push(i);
+    }
+    benchmark::DoNotOptimize(stack.Pop());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <class Allocator>
+using ShortLived =
+    SafeStack<uint64_t, IncrementalHash, VerifySampled<>, LogNone, Allocator>;
+
+using ShortLivedSmall =
+    SafeStackSmall<uint64_t, 16, IncrementalHash, VerifySampled<>, LogNone>;
+
+#define BENCH_SHORT_LIVED(Stack) \
+  BENCHMARK_TEMPLATE(BM_ShortLived, Stack)->Arg(1)->Arg(10)->Arg(100)
+
+BENCH_SHORT_LIVED(ShortLived<HeapAllocator>);
+BENCH_SHORT_LIVED(ShortLived<PoolAllocator>);
+BENCH_SHORT_LIVED(ShortLived<PmrAllocator>);
+BENCH_SHORT_LIVED(ShortLivedSmall);
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - LOGGING - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * A push and a pop per iteration, with every event logged. The binary sink
+ * writes to /dev/null, so only the cost on the stack's thread is measured.
+ */
+template <class LogPolicy>
+static void BM_LoggedPushPop(benchmark::State& state) {
+  if (LogPolicy::BINARY && state.thread_index() == 0) {
+    binlog::Sink::Get().Start("/dev/null");
+  }
+  {
+    SafeStack<uint64_t, IncrementalHash, VerifySampled<>, LogPolicy> stack;
+    for (auto _ : state) {
+      stack.Push(1);
+      benchmark::DoNotOptimize(stack.Pop());
+    }
+  }
+  if (LogPolicy::BINARY && state.thread_index() == 0) {
+    binlog::Sink::Get().Stop();
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK_TEMPLATE(BM_LoggedPushPop, LogNone);
+BENCHMARK_TEMPLATE(BM_LoggedPushPop, LogAll);
+BENCHMARK_TEMPLATE(BM_LoggedPushPop, LogBinary);
+BENCHMARK_TEMPLATE(BM_LoggedPushPop, LogBinary)->Threads(4);
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - CHECKPOINTS - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * Pushes state.range(0) elements over a checkpoint and undoes them, with
+ * Rollback() or with a Drop() per element.
+ */
+template <bool UseRollback>
+static void BM_Undo(benchmark::State& state) {
+  const size_t count = state.range(0);
+  SafeStack<uint64_t, IncrementalHash, VerifySampled<>, LogNone> stack;
+  stack.Reserve(2 * count);
+  for (size_t i = 0; i < count; ++i) {
+    stack.Push(i);
+  }
+
+  for (auto _ : state) {
+    const auto checkpoint = stack.Checkpoint();
+    for (size_t i = 0; i < count; ++i) {
+      stack.Push(i);
+    }
+    if constexpr (UseRollback) {
+      stack.Rollback(checkpoint);
+    } else {
+      for (size_t i = 0; i < count; ++i) {
+        stack.Drop();
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK_TEMPLATE(BM_Undo, true)->Arg(10)->Arg(1000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_Undo, false)->Arg(10)->Arg(1000)->Arg(100000);
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - VERIFICATION- - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * Push and Pop on a paranoid stack with 16 elements left after a burst of
+ * state.range(0). The watermark keeps them from scanning the empty tail;
+ * shrinking is off, so the tail stays.
+ */
+template <class HashPolicy>
+static void BM_VerifyAfterBurst(benchmark::State& state) {
+  SafeStack<uint64_t, HashPolicy, VerifyParanoid, LogNone> stack;
+  stack.SetGrowthPolicy(GrowthPolicy::Factor(2, 0));
+  stack.Reserve(state.range(0));
+  for (size_t i = 0; i < 16; ++i) {
+    stack.Push(i);
+  }
+
+  for (auto _ : state) {
+    stack.Push(0);
+    benchmark::DoNotOptimize(stack.Pop());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_VerifyAfterBurst, IncrementalHash)
+    ->RangeMultiplier(32)->Range(1 << 5, 1 << 20);
+BENCHMARK_TEMPLATE(BM_VerifyAfterBurst, FullHash)
+    ->RangeMultiplier(32)->Range(1 << 5, 1 << 20);
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - ALIGNMENT - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * Reads whole 64-byte elements at random from a 64 MiB buffer, with the
+ * elements starting Offset bytes past a cache line. 0 is where stacks put
+ * over-aligned elements; 16 and 32 are where they could start behind an
+ * unpadded header in a malloc'ed buffer, so that every element spans two
+ * lines.
+ */
+template <size_t Offset>
+static void BM_RandomElementReads(benchmark::State& state) {
+  using Element = AlignedBlob<CACHE_LINE_SIZE>;
+  const size_t count = (1 << 26) / sizeof(Element);
+  char*        buf   = static_cast<char*>(aligned_alloc(
+      CACHE_LINE_SIZE, (count + 1) * sizeof(Element)));
+  memset(buf, 1, (count + 1) * sizeof(Element));
+
+  std::vector<uint32_t> order(count);
+  std::mt19937          random(42);
+  for (uint32_t& ind : order) {
+    ind = random() % count;
+  }
+
+  for (auto _ : state) {
+    uint64_t sum = 0;
+    for (uint32_t ind : order) {
+      const char* element = buf + Offset + ind * sizeof(Element);
+      for (size_t i = 0; i < sizeof(Element); i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, element + i, sizeof(word));
+        sum += word;
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  free(buf);
+}
+BENCHMARK_TEMPLATE(BM_RandomElementReads, 0)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_RandomElementReads, 16)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_RandomElementReads, 32)->Unit(benchmark::kMillisecond);
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - HASHING - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * Gives benchmarks access to the protected internals of the stack.
+ */
+template <class HashPolicy>
+class Probe : public SafeStack<uint64_t, HashPolicy> {
+  public:
+  /**
+   * Makes the stack hold depth elements without paying for a verified Push
+   * per element.
+   */
+  void Fill(size_t depth) {
+    while (this->GetBufSize() < depth) {
+      this->SetCurSizeVal(this->GetBufSize());
+      this->CalculateAndPlaceHash();
+      this->Grow();
+    }
+    for (size_t i = 0; i < depth; ++i) {
+      new(this->buf_ + BUF_POS + i * sizeof(uint64_t)) uint64_t(i);
+    }
+    this->SetCurSizeVal(depth);
+    if constexpr (HashPolicy::INCREMENTAL) {
+      this->slots_hash_ = this->CalculateSlotsHash(0, this->GetBufSize());
+    }
+    this->CalculateAndPlaceHash();
+  }
+
+  /**
+   * Does the hash maintenance a single Push or Pop does.
+   */
+  void RehashTop() {
+    if constexpr (HashPolicy::INCREMENTAL) {
+      const size_t top = this->GetCurSize() - 1;
+      this->slots_hash_ += this->CalculateSlotHash(top) -
+                           this->CalculatePoisonSlotHash(top);
+      this->slots_hash_ -= this->CalculateSlotHash(top) -
+                           this->CalculatePoisonSlotHash(top);
+    }
+    this->CalculateAndPlaceHash();
+  }
+};
+
+
+template <class HashPolicy>
+static void BM_HashPerOp(benchmark::State& state) {
+  Probe<HashPolicy> stack;
+  stack.Fill(state.range(0));
+
+  for (auto _ : state) {
+    stack.RehashTop();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_HashPerOp, FullHash) BENCH_DEPTHS(1000000);
+BENCHMARK_TEMPLATE(BM_HashPerOp, IncrementalHash) BENCH_DEPTHS(1000000);
+BENCHMARK_TEMPLATE(BM_HashPerOp, FullHashWith<StdHash>) BENCH_DEPTHS(1000000);
+BENCHMARK_TEMPLATE(BM_HashPerOp, FullHashWith<Crc32c>) BENCH_DEPTHS(1000000);
+BENCHMARK_TEMPLATE(BM_HashPerOp, FullHashWith<SipHash>) BENCH_DEPTHS(1000000);
+
+/**
+ * Raw speed of the hash functions over a buffer, which is what a full
+ * rehash in Ok() or on reallocation costs.
+ */
+template <class HashFunction>
+static void BM_HashFunction(benchmark::State& state) {
+  std::vector<char> buf(state.range(0));
+  for (size_t i = 0; i < buf.size(); ++i) {
+    buf[i] = static_cast<char>(i);
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(HashFunction::Hash(buf.data(), buf.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+
+#define BENCH_HASH_FUNCTION(HashFunction)          \
+  BENCHMARK_TEMPLATE(BM_HashFunction, HashFunction) \
+      ->RangeMultiplier(16)->Range(16, 1 << 24)
+
+BENCH_HASH_FUNCTION(StdHash);
+BENCH_HASH_FUNCTION(Wyhash);
+BENCH_HASH_FUNCTION(Crc32c);
+BENCH_HASH_FUNCTION(SipHash);
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - POISON- - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void BM_PoisonFill(benchmark::State& state) {
+  std::vector<char> buf(state.range(0));
+  for (auto _ : state) {
+    poison::Fill(buf.data(), buf.data() + buf.size());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_PoisonFill)->RangeMultiplier(16)->Range(1 << 10, 1 << 24);
+
+static void BM_PoisonScan(benchmark::State& state) {
+  std::vector<char> buf(state.range(0));
+  poison::Fill(buf.data(), buf.data() + buf.size());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        poison::FindNonPoison(buf.data(), buf.data() + buf.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_PoisonScan)->RangeMultiplier(16)->Range(1 << 10, 1 << 24);
+
+/**
+ * The byte-by-byte check SafeStack used to do, for comparison.
+ */
+static void BM_PoisonScanBytewise(benchmark::State& state) {
+  std::vector<char> buf(state.range(0));
+  poison::Fill(buf.data(), buf.data() + buf.size());
+  for (auto _ : state) {
+    const char* bad = buf.data() + buf.size();
+    for (const char* i = buf.data(); i != buf.data() + buf.size(); ++i) {
+      if (*i != POISON_VALUE) {
+        bad = i;
+        break;
+      }
+    }
+    benchmark::DoNotOptimize(bad);
+  }
+  state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_PoisonScanBytewise)->RangeMultiplier(16)->Range(1 << 10, 1 << 24);
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - CONCURRENT- - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * What we did before ConcurrentSafeStack: the production stack behind a
+ * mutex.
+ */
+template <class T>
+struct LockedAdapter {
+  void Push(const T& item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stack_.Push(item);
+  }
+  bool TryPop(T& item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stack_.stack_.GetCurSize() == 0) {
+      return false;
+    }
+    item = stack_.Pop();
+    return true;
+  }
+
+  std::mutex mutex_;
+  Production<T> stack_;
+};
+
+template <class T>
+struct ConcurrentAdapter {
+  void Push(const T& item) { stack_.Push(item); }
+  bool TryPop(T& item) { return stack_.TryPop(item); }
+
+  ConcurrentSafeStack<T, LogNone> stack_;
+};
+
+/**
+ * One Push and one Pop per iteration from every thread, all on one shared
+ * stack. items_per_second is the total over all threads.
+ */
+template <class Container, class T>
+static void BM_ConcurrentThroughput(benchmark::State& state) {
+  static Container* container = nullptr;
+  if (state.thread_index() == 0) {
+    container = new Container();
+  }
+
+  T item(state.thread_index());
+  for (auto _ : state) {
+    container->Push(item);
+    container->TryPop(item);
+    benchmark::DoNotOptimize(item);
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+
+  if (state.thread_index() == 0) {
+    delete container;
+  }
+}
+
+#define BENCH_CONCURRENT(Container, T)                      \
+  BENCHMARK_TEMPLATE(BM_ConcurrentThroughput, Container, T) \
+      ->ThreadRange(1, 16)->UseRealTime()
+
+BENCH_CONCURRENT(LockedAdapter<Elem>, Elem);
+BENCH_CONCURRENT(ConcurrentAdapter<Elem>, Elem);
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - SHARED- - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/**
+ * How work items went to other processes before SharedSafeStack: written
+ * to a pipe one by one.
+ */
+template <class T>
+struct PipeChannel {
+  PipeChannel() {
+    if (pipe(fds_) != 0) {
+      abort();
+    }
+  }
+  ~PipeChannel() {
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+
+  void Send(const T& item) {
+    const char* bytes = reinterpret_cast<const char*>(&item);
+    for (size_t sent = 0; sent < sizeof(T);) {
+      const ssize_t count = write(fds_[1], bytes + sent, sizeof(T) - sent);
+      sent += count > 0 ? count : 0;
+    }
+  }
+  void Receive(T& item) {
+    char* bytes = reinterpret_cast<char*>(&item);
+    for (size_t received = 0; received < sizeof(T);) {
+      const ssize_t count =
+          read(fds_[0], bytes + received, sizeof(T) - received);
+      received += count > 0 ? count : 0;
+    }
+  }
+
+  int fds_[2];
+};
+
+template <class T>
+struct SharedChannel {
+  static constexpr const char* NAME     = "/shush-stack-bench";
+  static constexpr size_t      CAPACITY = 1024;
+
+  SharedChannel() {
+    SharedSafeStack<T, LogNone>::Remove(NAME);
+    stack_ = std::make_unique<SharedSafeStack<T, LogNone>>(NAME, CAPACITY);
+  }
+  ~SharedChannel() {
+    SharedSafeStack<T, LogNone>::Remove(NAME);
+  }
+
+  void Send(const T& item) {
+    while (!stack_->TryPush(item)) {
+      std::this_thread::yield();
+    }
+  }
+  void Receive(T& item) {
+    while (!stack_->TryPop(item)) {
+      std::this_thread::yield();
+    }
+  }
+
+  std::unique_ptr<SharedSafeStack<T, LogNone>> stack_;
+};
+
+/**
+ * A forked producer sends items as fast as it can, and every iteration
+ * receives one of them.
+ */
+template <class Channel, class T>
+static void BM_CrossProcess(benchmark::State& state) {
+  Channel     channel;
+  const pid_t producer = fork();
+  if (producer == 0) {
+    const T item(42);
+    while (true) {
+      channel.Send(item);
+    }
+  }
+
+  T item;
+  for (auto _ : state) {
+    channel.Receive(item);
+    benchmark::DoNotOptimize(item);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * sizeof(T));
+
+  kill(producer, SIGKILL);
+  waitpid(producer, nullptr, 0);
+}
+
+BENCHMARK_TEMPLATE(BM_CrossProcess, PipeChannel<Elem>, Elem)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CrossProcess, SharedChannel<Elem>, Elem)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CrossProcess, PipeChannel<Blob<256>>, Blob<256>)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_CrossProcess, SharedChannel<Blob<256>>, Blob<256>)
+    ->UseRealTime();
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - RING- - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+const size_t RING_CAPACITY = 1024;
+
+/**
+ * SafeRing<T, Spsc> without the protection: same layout of the indices,
+ * no canaries, hashes or poison.
+ */
+template <class T>
+class PlainRing {
+  public:
+  bool TryPush(const T& item) {
+    const size_t tail = tail_.value.load(std::memory_order_relaxed);
+    if (tail - tail_.cached == RING_CAPACITY) {
+      tail_.cached = head_.value.load(std::memory_order_acquire);
+      if (tail - tail_.cached == RING_CAPACITY) {
+        return false;
+      }
+    }
+    items_[tail % RING_CAPACITY] = item;
+    tail_.value.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+  bool TryPop(T& item) {
+    const size_t head = head_.value.load(std::memory_order_relaxed);
+    if (head == head_.cached) {
+      head_.cached = tail_.value.load(std::memory_order_acquire);
+      if (head == head_.cached) {
+        return false;
+      }
+    }
+    item = items_[head % RING_CAPACITY];
+    head_.value.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  private:
+  struct alignas(shush::stack::CACHE_LINE_SIZE) Index {
+    std::atomic<size_t> value{0};
+    size_t              cached = 0;
+  };
+
+  Index          head_;
+  Index          tail_;
+  std::vector<T> items_ = std::vector<T>(RING_CAPACITY);
+};
+
+/**
+ * The plain ring shared by many threads the usual way, behind a mutex.
+ */
+template <class T>
+class LockedPlainRing {
+  public:
+  bool TryPush(const T& item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ring_.TryPush(item);
+  }
+  bool TryPop(T& item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ring_.TryPop(item);
+  }
+
+  private:
+  std::mutex   mutex_;
+  PlainRing<T> ring_;
+};
+
+template <class T, class ConcurrencyPolicy>
+struct SafeRingAdapter : SafeRing<T, ConcurrencyPolicy, LogNone> {
+  SafeRingAdapter()
+    : SafeRing<T, ConcurrencyPolicy, LogNone>(RING_CAPACITY) {}
+};
+
+template <class T>
+using SpscAdapter = SafeRingAdapter<T, Spsc>;
+template <class T>
+using MpmcAdapter = SafeRingAdapter<T, Mpmc>;
+
+/**
+ * Threads with even indices push and the odd ones pop, one element per
+ * iteration, waiting while the ring is full or empty. items_per_second is
+ * the number of elements that went through the ring.
+ */
+template <class Ring, class T>
+static void BM_RingThroughput(benchmark::State& state) {
+  static Ring* ring = nullptr;
+  if (state.thread_index() == 0) {
+    ring = new Ring();
+  }
+
+  const bool producer = state.thread_index() % 2 == 0;
+  T          item(state.thread_index());
+  for (auto _ : state) {
+    if (producer) {
+      while (!ring->TryPush(item)) {
+        std::this_thread::yield();
+      }
+    } else {
+      while (!ring->TryPop(item)) {
+        std::this_thread::yield();
+      }
+      benchmark::DoNotOptimize(item);
+    }
+  }
+  if (!producer) {
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * sizeof(T));
+  }
+
+  if (state.thread_index() == 0) {
+    delete ring;
+  }
+}
+
+#define BENCH_RING(Ring, T, threads)             \
+  BENCHMARK_TEMPLATE(BM_RingThroughput, Ring, T) \
+      ->Threads(threads)->UseRealTime()
+
+BENCH_RING(PlainRing<Elem>, Elem, 2);
+BENCH_RING(SpscAdapter<Elem>, Elem, 2);
+BENCH_RING(PlainRing<Blob<256>>, Blob<256>, 2);
+BENCH_RING(SpscAdapter<Blob<256>>, Blob<256>, 2);
+BENCH_RING(LockedPlainRing<Elem>, Elem, 8);
+BENCH_RING(MpmcAdapter<Elem>, Elem, 8);
+
+
+BENCHMARK_MAIN();
@@ -1,5 +1,39 @@
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#if defined(__unix__)
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "shush-logs.hpp"
 #include "shush-dump.hpp"
 
@@ -9,6 +43,8 @@ namespace stack {
 // In T elements
 inline static const size_t DEFAULT_RESERVED_SIZE = 2048;
 inline static const size_t DEFAULT_INITIAL_SIZE  = 10;
+// In bytes
+inline static const size_t DEFAULT_CHUNK_BYTES   = 1 << 16;
 
 inline static const size_t   CANARY_SIZE         = sizeof(uint64_t);
 inline static const uint64_t CANARY_VALUE        = 0xDEDDA1C0FFEE;
@@ -24,621 +60,6839 @@ inline static const size_t BUF_SIZE_POS          = CUR_SIZE_POS + CUR_SIZE_SIZE;
 
 inline static const size_t BUF_POS               = BUF_SIZE_POS + BUF_SIZE_SIZE;
 
+inline static const size_t CACHE_LINE_SIZE       = 64;
+// What malloc gives. Allocators hand out smaller alignments for free.
+inline static const size_t DEFAULT_ALIGNMENT     = alignof(std::max_align_t);
+// The smallest page size around, and so the most mmap always gives.
+inline static const size_t MIN_PAGE_SIZE         = 4096;
+
+constexpr size_t AlignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * Alignment of the buffer of a stack of T and of its elements. Over-aligned
+ * T (SIMD vectors, padded records) start on a cache line at least, which
+ * leaves the header a line of its own. Others only need what T and the
+ * header need, so their buffers cost no more than malloc.
+ */
+template <class T>
+constexpr size_t GetBufAlignment() {
+  return alignof(T) > DEFAULT_ALIGNMENT
+             ? std::max(alignof(T), CACHE_LINE_SIZE)
+             : std::max(alignof(T), alignof(uint64_t));
+}
+
 inline static const char POISON_VALUE            = '#';
 
-inline static const size_t DUMP_MESSAGE_MAX_CHAR_COUNT = 5000;
-inline static const size_t DUMP_ERR_NAME_MAX_CHAR_COUNT = 150;
-static char dump_msg_buffer[DUMP_MESSAGE_MAX_CHAR_COUNT];
-static char dump_error_name_buffer[DUMP_ERR_NAME_MAX_CHAR_COUNT];
+inline static const uint64_t SLOT_INDEX_MULTIPLIER = 0x9E3779B97F4A7C15;
+
+inline static const size_t DUMP_MESSAGE_MAX_CHAR_COUNT = 5000;
+// The first and the last that many elements are shown in the dump.
+inline static const size_t DUMP_ELEMENTS_SHOWN         = 8;
+// That many unused cells that are not poison are shown in the dump.
+inline static const size_t DUMP_VIOLATIONS_SHOWN       = 8;
+// Bytes of an element shown in the dump, if it is not a number.
+inline static const size_t DUMP_ELEMENT_MAX_BYTES      = 16;
+inline thread_local char dump_msg_buffer[DUMP_MESSAGE_MAX_CHAR_COUNT];
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - ERROR CODES - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+enum Errc {
+  ASSERT_FAILED                    = -1,
+  THIS_PTR_IS_NULLPTR              = 0,
+  CORRUPTED_FIRST_CANARY           = 1,
+  CORRUPTED_SECOND_CANARY          = 2,
+  HASH_NOT_THE_SAME                = 3,
+  CUR_SIZE_IS_BIGGER_THAN_BUF      = 4,
+  UNINITIALIZED_CELL_IS_NOT_POISON = 5,
+  POP_ON_0_SIZE                    = 6,
+  REALLOCATION_IN_STATIC_STACK     = 7,
+  POP_MORE_THAN_CUR_SIZE           = 8,
+  GUARD_PAGE_HIT                   = 9,
+  ELEMENT_OUT_OF_RANGE             = 10,
+  MAPPED_FILE_MISMATCH             = 11,
+  CHECKPOINT_MISMATCH              = 12,
+  BUF_SIZE_EXCEEDS_ALLOCATION      = 13,
+  SIZE_OVERFLOW                    = 14
+};
+
+inline const char* GetErrorName(int error_code) {
+  switch (error_code) {
+  case ASSERT_FAILED:
+    return "assertion failed";
+  case THIS_PTR_IS_NULLPTR:
+    return "[this] pointer points to nullptr. Have you forgot to initialize the object?";
+  case CORRUPTED_FIRST_CANARY:
+    return "first [CANARY] was corrupted. Perhaps, someone tried to overwrite it";
+  case CORRUPTED_SECOND_CANARY:
+    return "second [CANARY] was corrupted. Perhaps, someone tried to overwrite it";
+  case CUR_SIZE_IS_BIGGER_THAN_BUF:
+    return "current size value of stack is bigger than buffer size value";
+  case HASH_NOT_THE_SAME:
+    return "calculated hash is not equal to what is stored";
+  case UNINITIALIZED_CELL_IS_NOT_POISON:
+    return "one of the uninitialized cells is not equal to poison value. Perhaps, someone tried to overwrite it";
+  case POP_ON_0_SIZE:
+    return "the size of the stack was 0, and a Pop() method has been called.";
+  case REALLOCATION_IN_STATIC_STACK:
+    return "static stack overflow. Consider increasing its capacity or switching to dynamic stack.";
+  case POP_MORE_THAN_CUR_SIZE:
+    return "more elements were requested from PopN() than the stack holds.";
+  case GUARD_PAGE_HIT:
+    return "a guard page around the buffer was hit. Someone wrote past the buffer";
+  case ELEMENT_OUT_OF_RANGE:
+    return "an element deeper than the size of the stack was requested.";
+  case MAPPED_FILE_MISMATCH:
+    return "the mapped file does not hold a stack of this type, or was cut short";
+  case CHECKPOINT_MISMATCH:
+    return "the elements under a checkpoint were popped or changed before Rollback().";
+  case BUF_SIZE_EXCEEDS_ALLOCATION:
+    return "buffer size value of stack is bigger than the buffer that was allocated";
+  case SIZE_OVERFLOW:
+    return "more elements were pushed than the size of the stack can count.";
+  default:
+    return "UNKNOWN ERROR CODE";
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - DUMPING - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Formats a dump into a fixed buffer. Never allocates, so dumps can be made
+ * from a signal handler or when the heap is broken. Whatever does not fit is
+ * cut off, and the result is always NUL-terminated.
+ */
+class DumpWriter {
+  public:
+  DumpWriter(char* buffer, size_t size);
+
+  DumpWriter& Write(const char* str);
+  DumpWriter& WriteUnsigned(uint64_t value);
+  DumpWriter& WriteSigned(int64_t value);
+  /**
+   * Hex bytes separated by spaces.
+   */
+  DumpWriter& WriteBytes(const void* bytes, size_t count);
+  DumpWriter& WriteGoodBad(bool good);
+  /**
+   * Numbers as they are, anything else as its first DUMP_ELEMENT_MAX_BYTES
+   * bytes.
+   */
+  template <class T>
+  DumpWriter& WriteValue(const T& value);
+
+  /**
+   * The NUL-terminated message.
+   */
+  char* GetMessage();
+
+  private:
+  DumpWriter& Put(char symbol);
+
+  char*  buffer_;
+  size_t size_;
+  size_t length_;
+};
+
+
+inline DumpWriter::DumpWriter(char* buffer, size_t size)
+  : buffer_(buffer)
+  , size_(size)
+  , length_(0) {
+  if (size_ != 0) {
+    buffer_[0] = '\0';
+  }
+}
+
+
+inline DumpWriter& DumpWriter::Put(char symbol) {
+  if (length_ + 1 < size_) {
+    buffer_[length_++] = symbol;
+    buffer_[length_]   = '\0';
+  }
+
+  return *this;
+}
+
+
+inline DumpWriter& DumpWriter::Write(const char* str) {
+  for (; *str != '\0'; ++str) {
+    Put(*str);
+  }
+
+  return *this;
+}
+
+
+inline DumpWriter& DumpWriter::WriteUnsigned(uint64_t value) {
+  char   digits[20];
+  size_t count = 0;
+  do {
+    digits[count++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  while (count != 0) {
+    Put(digits[--count]);
+  }
+
+  return *this;
+}
+
+
+inline DumpWriter& DumpWriter::WriteSigned(int64_t value) {
+  if (value < 0) {
+    Put('-');
+    return WriteUnsigned(-static_cast<uint64_t>(value));
+  }
+
+  return WriteUnsigned(value);
+}
+
+
+inline DumpWriter& DumpWriter::WriteBytes(const void* bytes, size_t count) {
+  static const char hex_digits[] = "0123456789abcdef";
+
+  const unsigned char* byte = static_cast<const unsigned char*>(bytes);
+  for (size_t i = 0; i < count; ++i) {
+    if (i != 0) {
+      Put(' ');
+    }
+    Put(hex_digits[byte[i] >> 4]);
+    Put(hex_digits[byte[i] & 0xF]);
+  }
+
+  return *this;
+}
+
+
+inline DumpWriter& DumpWriter::WriteGoodBad(bool good) {
+  return Write(good ? "(GOOD) " : "(BAD) ");
+}
+
+
+template <class T>
+DumpWriter& DumpWriter::WriteValue(const T& value) {
+  if constexpr (std::is_same_v<T, bool>) {
+    return Write(value ? "true" : "false");
+  } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+    return WriteSigned(value);
+  } else if constexpr (std::is_integral_v<T>) {
+    return WriteUnsigned(value);
+  } else if constexpr (std::is_floating_point_v<T>) {
+    char number[32];
+    snprintf(number, sizeof(number), "%g", static_cast<double>(value));
+    return Write(number);
+  } else {
+    WriteBytes(&value, std::min(sizeof(T), DUMP_ELEMENT_MAX_BYTES));
+    return Write(sizeof(T) > DUMP_ELEMENT_MAX_BYTES ? " ..." : "");
+  }
+}
+
+
+inline char* DumpWriter::GetMessage() {
+  return buffer_;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - CANARIES- - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * A canary on both sides of the buffer.
+ */
+struct WithCanaries {
+  static constexpr bool        ENABLED = true;
+  static constexpr const char* NAME    = "on";
+};
+
+/**
+ * No canaries, and no bytes for them in the buffer.
+ */
+struct NoCanaries {
+  static constexpr bool        ENABLED = false;
+  static constexpr const char* NAME    = "off";
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - POISON KERNELS- - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Wide kernels for filling and checking poison. AVX2 or SSE2 is picked at
+ * compile time (build with -mavx2 or -march=native to get AVX2), with a
+ * word-at-a-time scalar fallback.
+ */
+namespace poison {
+
+inline static const uint64_t POISON_WORD = 0x0101010101010101ULL *
+                                           static_cast<uint8_t>(POISON_VALUE);
+
+/**
+ * Fills [from, to) with poison.
+ */
+inline void Fill(char* from, char* to) {
+#if defined(__AVX2__)
+  const __m256i poison = _mm256_set1_epi8(POISON_VALUE);
+  for (; to - from >= 32; from += 32) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(from), poison);
+  }
+#elif defined(__SSE2__)
+  const __m128i poison = _mm_set1_epi8(POISON_VALUE);
+  for (; to - from >= 16; from += 16) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(from), poison);
+  }
+#else
+  for (; to - from >= 8; from += 8) {
+    memcpy(from, &POISON_WORD, 8);
+  }
+#endif
+  for (; from != to; ++from) {
+    *from = POISON_VALUE;
+  }
+}
+
+/**
+ * Returns the first byte in [from, to) that is not poison, or to if there
+ * is none.
+ */
+inline const char* FindNonPoison(const char* from, const char* to) {
+#if defined(__AVX2__)
+  const __m256i poison = _mm256_set1_epi8(POISON_VALUE);
+  for (; to - from >= 32; from += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(from));
+    const uint32_t mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, poison)));
+    if (mask != 0xFFFFFFFFu) {
+      return from + __builtin_ctz(~mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i poison = _mm_set1_epi8(POISON_VALUE);
+  for (; to - from >= 16; from += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(from));
+    const uint32_t mask = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, poison)));
+    if (mask != 0xFFFFu) {
+      return from + __builtin_ctz(~mask);
+    }
+  }
+#else
+  for (; to - from >= 8; from += 8) {
+    uint64_t word = 0;
+    memcpy(&word, from, 8);
+    if (word != POISON_WORD) {
+      break;
+    }
+  }
+#endif
+  for (; from != to; ++from) {
+    if (*from != POISON_VALUE) {
+      return from;
+    }
+  }
+  return to;
+}
+
+}
+
+/**
+ * Unused cells are filled with poison, which Ok() checks as deep as the
+ * VerifyPolicy says.
+ */
+struct WithPoison {
+  static constexpr bool        ENABLED = true;
+  static constexpr const char* NAME    = "on";
+};
+
+/**
+ * Unused cells are left as they are and never checked.
+ */
+struct NoPoison {
+  static constexpr bool        ENABLED = false;
+  static constexpr const char* NAME    = "off";
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - HASHING - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Finalizer of splitmix64. Spreads bits of a slot hash before it is summed.
+ */
+inline uint64_t MixHash(uint64_t value) {
+  value ^= value >> 30;
+  value *= 0xBF58476D1CE4E5B9;
+  value ^= value >> 27;
+  value *= 0x94D049BB133111EB;
+  value ^= value >> 31;
+  return value;
+}
+
+/**
+ * Hash functions the hash policies are parametrized with. Each one maps
+ * (data, size) to a 64-bit value and exposes its name for dumps.
+ */
+
+/**
+ * std::hash of a string_view. On libstdc++ that is a byte-serial murmur
+ * variant, so it is the slowest option; kept for reproducing old dumps.
+ */
+struct StdHash {
+  static constexpr const char* NAME = "std";
+
+  static uint64_t Hash(const char* data, size_t size) {
+    return std::hash<std::string_view>()(std::string_view(data, size));
+  }
+};
+
+namespace hashing {
+
+inline uint64_t Read64(const char* data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+inline uint64_t Read32(const char* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+inline uint64_t Rotl64(uint64_t value, int shift) {
+  return (value << shift) | (value >> (64 - shift));
+}
+
+/**
+ * 64x64 -> 128 multiplication folded into 64 bits, the core of wyhash.
+ */
+inline void MultiplyWide(uint64_t& lo, uint64_t& hi) {
+#if defined(__SIZEOF_INT128__)
+  const __uint128_t product = static_cast<__uint128_t>(lo) * hi;
+  lo = static_cast<uint64_t>(product);
+  hi = static_cast<uint64_t>(product >> 64);
+#else
+  const uint64_t ha = lo >> 32, hb = hi >> 32;
+  const uint64_t la = static_cast<uint32_t>(lo), lb = static_cast<uint32_t>(hi);
+  const uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  const uint64_t t  = rl + (rm0 << 32);
+  uint64_t       c  = t < rl;
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+inline uint64_t Mix(uint64_t a, uint64_t b) {
+  MultiplyWide(a, b);
+  return a ^ b;
+}
+
+/**
+ * Reflected CRC32C (Castagnoli) lookup table for the portable path.
+ */
+struct Crc32cTable {
+  uint32_t values[256];
+
+  constexpr Crc32cTable() : values() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+      }
+      values[i] = crc;
+    }
+  }
+};
+
+inline constexpr Crc32cTable CRC32C_TABLE{};
+
+}
+
+/**
+ * wyhash: 48 bytes per round through three independent 128-bit
+ * multiplications. The fastest software option for large buffers.
+ */
+struct Wyhash {
+  static constexpr const char* NAME = "wyhash";
+
+  static constexpr uint64_t SECRET[4] = {
+      0x2d358dccaa6c78a5, 0x8bb84b93962eacc9,
+      0x4b33a62ed433d4a3, 0x4d5a2da51de1aa47
+  };
+
+  static uint64_t Hash(const char* data, size_t size, uint64_t seed = 0) {
+    using hashing::Mix;
+    using hashing::Read32;
+    using hashing::Read64;
+
+    seed ^= Mix(seed ^ SECRET[0], SECRET[1]);
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (size <= 16) {
+      if (size >= 4) {
+        const size_t shift = (size >> 3) << 2;
+        a = (Read32(data) << 32) | Read32(data + shift);
+        b = (Read32(data + size - 4) << 32) | Read32(data + size - 4 - shift);
+      } else if (size > 0) {
+        const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+        a = (static_cast<uint64_t>(bytes[0]) << 16) |
+            (static_cast<uint64_t>(bytes[size >> 1]) << 8) |
+            bytes[size - 1];
+      }
+    } else {
+      size_t left = size;
+      if (left >= 48) {
+        uint64_t seed1 = seed;
+        uint64_t seed2 = seed;
+        do {
+          seed  = Mix(Read64(data) ^ SECRET[1], Read64(data + 8) ^ seed);
+          seed1 = Mix(Read64(data + 16) ^ SECRET[2], Read64(data + 24) ^ seed1);
+          seed2 = Mix(Read64(data + 32) ^ SECRET[3], Read64(data + 40) ^ seed2);
+          data += 48;
+          left -= 48;
+        } while (left >= 48);
+        seed ^= seed1 ^ seed2;
+      }
+      while (left > 16) {
+        seed = Mix(Read64(data) ^ SECRET[1], Read64(data + 8) ^ seed);
+        data += 16;
+        left -= 16;
+      }
+      a = Read64(data + left - 16);
+      b = Read64(data + left - 8);
+    }
+
+    a ^= SECRET[1];
+    b ^= seed;
+    hashing::MultiplyWide(a, b);
+    return Mix(a ^ SECRET[0] ^ size, b ^ SECRET[1]);
+  }
+};
+
+/**
+ * CRC32C. Uses the SSE4.2 crc32 instruction (8 bytes per cycle) when the
+ * header is compiled with it, a table otherwise. Detects every burst error
+ * up to 32 bits, but has only 32 bits of output.
+ */
+struct Crc32c {
+  static constexpr const char* NAME = "crc32c";
+
+  static uint64_t Hash(const char* data, size_t size) {
+    return ~Update(~0u, data, size);
+  }
+
+  static uint32_t Update(uint32_t crc, const char* data, size_t size) {
+#if defined(__SSE4_2__)
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, data += 8) {
+      crc64 = _mm_crc32_u64(crc64, hashing::Read64(data));
+    }
+    crc = static_cast<uint32_t>(crc64);
+    for (; size > 0; --size, ++data) {
+      crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+    }
+#else
+    for (; size > 0; --size, ++data) {
+      crc = hashing::CRC32C_TABLE.values[
+                (crc ^ static_cast<unsigned char>(*data)) & 0xFF] ^
+            (crc >> 8);
+    }
+#endif
+    return crc;
+  }
+};
+
+/**
+ * Keyed SipHash-2-4. Slower than the others, but with a secret key an
+ * attacker who controls the elements cannot forge a matching hash after
+ * corrupting the buffer. The key is random per process; SetKey() must be
+ * called before any stack using it is created, since it changes every hash.
+ */
+struct SipHash {
+  static constexpr const char* NAME = "siphash-2-4";
+
+  static uint64_t Hash(const char* data, size_t size) {
+    return Hash(data, size, GetKey()[0], GetKey()[1]);
+  }
+
+  static uint64_t Hash(const char* data, size_t size,
+                       uint64_t key0, uint64_t key1) {
+    using hashing::Read64;
+    using hashing::Rotl64;
+
+    uint64_t v0 = 0x736f6d6570736575 ^ key0;
+    uint64_t v1 = 0x646f72616e646f6d ^ key1;
+    uint64_t v2 = 0x6c7967656e657261 ^ key0;
+    uint64_t v3 = 0x7465646279746573 ^ key1;
+
+    auto round = [&]() {
+      v0 += v1; v1 = Rotl64(v1, 13); v1 ^= v0; v0 = Rotl64(v0, 32);
+      v2 += v3; v3 = Rotl64(v3, 16); v3 ^= v2;
+      v0 += v3; v3 = Rotl64(v3, 21); v3 ^= v0;
+      v2 += v1; v1 = Rotl64(v1, 17); v1 ^= v2; v2 = Rotl64(v2, 32);
+    };
+
+    const size_t tail = size & 7;
+    const char*  end  = data + size - tail;
+    for (; data != end; data += 8) {
+      const uint64_t m = Read64(data);
+      v3 ^= m;
+      round();
+      round();
+      v0 ^= m;
+    }
+
+    uint64_t last = static_cast<uint64_t>(size) << 56;
+    for (size_t i = 0; i < tail; ++i) {
+      last |= static_cast<uint64_t>(static_cast<unsigned char>(data[i]))
+              << (8 * i);
+    }
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+
+    v2 ^= 0xFF;
+    round();
+    round();
+    round();
+    round();
+    return v0 ^ v1 ^ v2 ^ v3;
+  }
+
+  static void SetKey(uint64_t key0, uint64_t key1) {
+    GetKey()[0] = key0;
+    GetKey()[1] = key1;
+  }
+
+private:
+  static uint64_t* GetKey() {
+    static uint64_t key[2] = {RandomKeyHalf(), RandomKeyHalf()};
+    return key;
+  }
+
+  static uint64_t RandomKeyHalf() {
+    std::random_device device;
+    return (static_cast<uint64_t>(device()) << 32) ^ device();
+  }
+};
+
+/**
+ * Rehashes the whole allocation after every mutation. O(N) per operation,
+ * but every Ok() call checks every byte of the buffer.
+ */
+template <class HashFunction>
+struct FullHashWith {
+  static constexpr bool        ENABLED     = true;
+  static constexpr bool        INCREMENTAL = false;
+  static constexpr const char* NAME        = "full";
+
+  using Function = HashFunction;
+};
+
+/**
+ * Keeps the sum of per-slot hashes of (index, bytes) and updates it in
+ * O(sizeof(T)) per mutation. Ok() checks the header part of the hash. A
+ * paranoid Ok() also rehashes the slots up to the dirty watermark and takes
+ * the ones above it from the sum kept at the last paranoid check. Ok(true)
+ * recomputes everything.
+ */
+template <class HashFunction>
+struct IncrementalHashWith {
+  static constexpr bool        ENABLED     = true;
+  static constexpr bool        INCREMENTAL = true;
+  static constexpr const char* NAME        = "incremental";
+
+  using Function = HashFunction;
+};
+
+using FullHash        = FullHashWith<Wyhash>;
+using IncrementalHash = IncrementalHashWith<Wyhash>;
+
+/**
+ * No hash, and no bytes for it in the buffer.
+ */
+struct NoHash {
+  static constexpr bool        ENABLED     = false;
+  static constexpr bool        INCREMENTAL = false;
+  static constexpr const char* NAME        = "none";
+
+  struct Function {
+    static constexpr const char* NAME = "none";
+
+    static uint64_t Hash(const char*, size_t) { return 0; }
+  };
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - VERIFICATION- - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+enum class VerifyLevel {
+  NONE,
+  CANARIES,
+  HEADER,
+  SAMPLED,
+  PARANOID
+};
+
+/**
+ * Ok() checks nothing, only Ok(true) does.
+ */
+struct VerifyNone {
+  static constexpr VerifyLevel LEVEL = VerifyLevel::NONE;
+  static constexpr const char* NAME  = "none";
+};
+
+/**
+ * Ok() checks only the canaries.
+ */
+struct VerifyCanaries {
+  static constexpr VerifyLevel LEVEL = VerifyLevel::CANARIES;
+  static constexpr const char* NAME  = "canaries";
+};
+
+/**
+ * Ok() checks the canaries, the hash and the sizes. The hash check is O(1)
+ * only with IncrementalHash.
+ */
+struct VerifyHeader {
+  static constexpr VerifyLevel LEVEL = VerifyLevel::HEADER;
+  static constexpr const char* NAME  = "canaries+header";
+};
+
+/**
+ * Same as VerifyHeader, plus every Period-th Ok() checks a rolling window of
+ * Window unused cells for poison.
+ */
+template <size_t Period = 16, size_t Window = 64>
+struct VerifySampled {
+  static_assert(Period > 0 && Window > 0, "Period and Window must be positive");
+
+  static constexpr VerifyLevel LEVEL  = VerifyLevel::SAMPLED;
+  static constexpr const char* NAME   = "sampled";
+  static constexpr size_t      PERIOD = Period;
+  static constexpr size_t      WINDOW = Window;
+};
+
+/**
+ * Ok() checks everything the stack may have written since the last paranoid
+ * check: the hash, and the poison of the unused cells up to the dirty
+ * watermark. Only Ok(true) checks every cell of the buffer.
+ */
+struct VerifyParanoid {
+  static constexpr VerifyLevel LEVEL = VerifyLevel::PARANOID;
+  static constexpr const char* NAME  = "paranoid";
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - ALLOCATION- - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Allocates buffers with malloc, or with mmap when they are at least
+ * MMAP_THRESHOLD bytes, so that big buffers grow with mremap instead of
+ * being copied. Alignments above DEFAULT_ALIGNMENT take aligned_alloc, and
+ * such buffers are copied when they grow.
+ */
+class HeapAllocator {
+  public:
+  static constexpr bool        HARDWARE_GUARDED = false;
+  static constexpr bool        POISONED         = false;
+  static constexpr bool        PERSISTENT       = false;
+  static constexpr size_t      MAX_BYTES        = SIZE_MAX;
+  static constexpr size_t      MAX_ALIGNMENT    = MIN_PAGE_SIZE;
+  static constexpr const char* NAME             = "heap";
+  static constexpr size_t      MMAP_THRESHOLD   = 1 << 20;
+
+  char* Allocate(size_t bytes, size_t alignment = DEFAULT_ALIGNMENT);
+  /**
+   * Resizes the allocation keeping its contents. Never returns nullptr.
+   */
+  char* Reallocate(char* buf, size_t old_bytes, size_t new_bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+  void  Deallocate(char* buf, size_t bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+
+  private:
+  static bool   IsMapped(size_t bytes);
+  static size_t RoundToPages(size_t bytes);
+};
+
+
+inline bool HeapAllocator::IsMapped(size_t bytes) {
+#if defined(__unix__)
+  return bytes >= MMAP_THRESHOLD;
+#else
+  return false;
+#endif
+}
+
+
+inline size_t HeapAllocator::RoundToPages(size_t bytes) {
+#if defined(__unix__)
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return (bytes + page_size - 1) / page_size * page_size;
+#else
+  return bytes;
+#endif
+}
+
+
+inline char* HeapAllocator::Allocate(size_t bytes, size_t alignment) {
+  void* buf = nullptr;
+#if defined(__unix__)
+  if (IsMapped(bytes)) {
+    buf = mmap(nullptr, RoundToPages(bytes), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    return static_cast<char*>(buf);
+  }
+#endif
+  buf = alignment <= DEFAULT_ALIGNMENT
+            ? malloc(bytes)
+            : aligned_alloc(alignment, AlignUp(bytes, alignment));
+  if (buf == nullptr) {
+    throw std::bad_alloc();
+  }
+  return static_cast<char*>(buf);
+}
+
+
+inline char* HeapAllocator::Reallocate(
+    char* buf, size_t old_bytes, size_t new_bytes, size_t alignment) {
+  // realloc knows nothing of the alignment, so over-aligned buffers are
+  // copied.
+  if (!IsMapped(old_bytes) && !IsMapped(new_bytes) &&
+      alignment <= DEFAULT_ALIGNMENT) {
+    void* new_buf = realloc(buf, new_bytes);
+    if (new_buf == nullptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<char*>(new_buf);
+  }
+
+#if defined(__linux__)
+  if (IsMapped(old_bytes) && IsMapped(new_bytes)) {
+    void* new_buf = mremap(buf, RoundToPages(old_bytes),
+                           RoundToPages(new_bytes), MREMAP_MAYMOVE);
+    if (new_buf == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    return static_cast<char*>(new_buf);
+  }
+#endif
+
+  char* new_buf = Allocate(new_bytes, alignment);
+  memcpy(new_buf, buf, std::min(old_bytes, new_bytes));
+  Deallocate(buf, old_bytes, alignment);
+  return new_buf;
+}
+
+
+inline void HeapAllocator::Deallocate(
+    char* buf, size_t bytes, size_t) {
+#if defined(__unix__)
+  if (IsMapped(bytes)) {
+    munmap(buf, RoundToPages(bytes));
+    return;
+  }
+#endif
+  free(buf);
+}
+
+
+#if defined(__unix__)
+
+/**
+ * Registry of guarded allocations, read from the SIGSEGV handler. It is a
+ * fixed array of slots published with atomics, so the handler never locks
+ * or allocates while looking up the faulting address. It is also where the
+ * allocator finds the mapping of a buffer when freeing it.
+ */
+namespace guard {
+
+/**
+ * Called from the signal handler with the owner that registered the region
+ * the faulting address belongs to.
+ */
+using FaultHandler = void (*)(void* owner, const void* address);
+
+inline static const size_t MAX_REGIONS = 1024;
+
+struct Region {
+  std::atomic<bool>        taken;
+  // The whole mapping, guard pages included.
+  std::atomic<const char*> begin;
+  const char*              end;
+  // The buffer handed out from it. Atomic, since other threads look it up
+  // while the slot is taken again.
+  std::atomic<const char*> buf;
+  // Faults are not reported if there is no handler.
+  void*                    owner;
+  FaultHandler             handler;
+};
+
+inline Region           regions[MAX_REGIONS];
+inline struct sigaction previous_action;
+
+inline void HandleFault(int, siginfo_t* info, void*) {
+  const char* address = static_cast<const char*>(info->si_addr);
+  for (Region& region : regions) {
+    const char* begin = region.begin.load(std::memory_order_acquire);
+    if (begin != nullptr && begin <= address && address < region.end &&
+        region.handler != nullptr) {
+      region.handler(region.owner, address);
+      // Let the fault happen again, now with the default action.
+      signal(SIGSEGV, SIG_DFL);
+      return;
+    }
+  }
+
+  // Not ours, so hand it to whoever was there before us.
+  sigaction(SIGSEGV, &previous_action, nullptr);
+}
+
+/**
+ * Installs the SIGSEGV handler. Done once, on the first registration.
+ */
+inline void InstallHandler() {
+  static const bool installed = [] {
+    struct sigaction action = {};
+    action.sa_sigaction = HandleFault;
+    action.sa_flags     = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_action);
+    return true;
+  }();
+  (void) installed;
+}
+
+/**
+ * Remembers that buf was handed out from the mapping [begin, end), and
+ * makes faults in it be reported to handler(owner, address) if there is a
+ * handler. Returns false if there is no free slot.
+ */
+inline bool Register(const char* begin, const char* end, const char* buf,
+                     void* owner, FaultHandler handler) {
+  if (handler != nullptr) {
+    InstallHandler();
+  }
+  for (Region& region : regions) {
+    if (!region.taken.exchange(true, std::memory_order_acquire)) {
+      region.end     = end;
+      region.buf.store(buf, std::memory_order_relaxed);
+      region.owner   = owner;
+      region.handler = handler;
+      region.begin.store(begin, std::memory_order_release);
+      return true;
+    }
+  }
+  // No free slot: the region is still guarded, only the dump is lost.
+  return false;
+}
+
+/**
+ * The region buf was handed out from, or nullptr if it was not registered.
+ */
+inline Region* Find(const char* buf) {
+  for (Region& region : regions) {
+    if (region.begin.load(std::memory_order_acquire) != nullptr &&
+        region.buf.load(std::memory_order_relaxed) == buf) {
+      return &region;
+    }
+  }
+  return nullptr;
+}
+
+inline void Unregister(Region& region) {
+  region.begin.store(nullptr, std::memory_order_release);
+  region.taken.store(false, std::memory_order_release);
+}
+
+}
+
+
+/**
+ * Places every buffer between two PROT_NONE pages, with its end right at the
+ * upper one. Writing past the end of the buffer faults at once instead of
+ * waiting for the next Ok() to find a broken canary, so stacks using it do
+ * not check canaries in Ok() unless it is Ok(true). Faults are reported with
+ * the usual dump if the allocator is bound to its owner.
+ *
+ * The mapping of every buffer is kept in guard::regions, and freeing a
+ * buffer unmaps what was mapped for it, whatever size the caller passes.
+ *
+ * Buffers are aligned to at least alignof(uint64_t), so up to that (or the
+ * bigger alignment asked for) minus one bytes are left between the end of
+ * the buffer and the guard page.
+ *
+ * Costs a system call per (re)allocation and at least three pages per stack.
+ */
+class GuardPageAllocator {
+  public:
+  static constexpr bool        HARDWARE_GUARDED = true;
+  static constexpr bool        POISONED         = false;
+  static constexpr bool        PERSISTENT       = false;
+  static constexpr size_t      MAX_BYTES        = SIZE_MAX;
+  static constexpr size_t      MAX_ALIGNMENT    = MIN_PAGE_SIZE;
+  static constexpr const char* NAME             = "guard pages";
+
+  /**
+   * Report faults in the buffers allocated from now on to
+   * handler(owner, address).
+   */
+  void Bind(void* owner, guard::FaultHandler handler);
+
+  char* Allocate(size_t bytes, size_t alignment = DEFAULT_ALIGNMENT);
+  char* Reallocate(char* buf, size_t old_bytes, size_t new_bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+  void  Deallocate(char* buf, size_t bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+
+  private:
+  static size_t GetPageSize();
+  static size_t RoundToPages(size_t bytes);
+  /**
+   * Bytes the buffer takes before the guard page.
+   */
+  static size_t GetPlacedSize(size_t bytes, size_t alignment);
+  /**
+   * Start of the mapping (the lower guard page) of a buffer.
+   */
+  static char* GetMappingBegin(char* buf, size_t placed_size);
+
+  void*               owner_   = nullptr;
+  guard::FaultHandler handler_ = nullptr;
+};
+
+
+inline void GuardPageAllocator::Bind(
+    void* owner, guard::FaultHandler handler) {
+  owner_   = owner;
+  handler_ = handler;
+}
+
+
+inline size_t GuardPageAllocator::GetPageSize() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+
+inline size_t GuardPageAllocator::RoundToPages(size_t bytes) {
+  return (bytes + GetPageSize() - 1) / GetPageSize() * GetPageSize();
+}
+
+
+inline size_t GuardPageAllocator::GetPlacedSize(
+    size_t bytes, size_t alignment) {
+  return AlignUp(bytes, std::max(alignment, alignof(uint64_t)));
+}
+
+
+inline char* GuardPageAllocator::GetMappingBegin(
+    char* buf, size_t placed_size) {
+  return buf + placed_size - RoundToPages(placed_size) - GetPageSize();
+}
+
+
+inline char* GuardPageAllocator::Allocate(size_t bytes, size_t alignment) {
+  const size_t page_size   = GetPageSize();
+  const size_t placed_size = GetPlacedSize(bytes, alignment);
+  const size_t usable_size = RoundToPages(placed_size);
+  const size_t map_size    = usable_size + 2 * page_size;
+
+  void* map = mmap(nullptr, map_size, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+
+  char* begin = static_cast<char*>(map);
+  if (mprotect(begin + page_size, usable_size,
+               PROT_READ | PROT_WRITE) != 0) {
+    munmap(map, map_size);
+    throw std::bad_alloc();
+  }
+
+  char* buf = begin + page_size + usable_size - placed_size;
+  guard::Register(begin, begin + map_size, buf, owner_, handler_);
+
+  return buf;
+}
+
+
+inline char* GuardPageAllocator::Reallocate(
+    char* buf, size_t old_bytes, size_t new_bytes, size_t alignment) {
+  // The end of the buffer has to stay at the guard page, so the contents
+  // move anyway.
+  char* new_buf = Allocate(new_bytes, alignment);
+  memcpy(new_buf, buf, std::min(old_bytes, new_bytes));
+  Deallocate(buf, old_bytes, alignment);
+  return new_buf;
+}
+
+
+inline void GuardPageAllocator::Deallocate(
+    char* buf, size_t bytes, size_t alignment) {
+  if (guard::Region* region = guard::Find(buf)) {
+    char* begin = const_cast<char*>(
+        region->begin.load(std::memory_order_acquire));
+    const size_t map_size = region->end - begin;
+    guard::Unregister(*region);
+    munmap(begin, map_size);
+    return;
+  }
+
+  // The registry was full, so there is only the size to go by.
+  const size_t placed_size = GetPlacedSize(bytes, alignment);
+  munmap(GetMappingBegin(buf, placed_size),
+         RoundToPages(placed_size) + 2 * GetPageSize());
+}
+
+#endif
+
+
+/**
+ * Recycles buffers of up to MAX_POOLED_BYTES through per-thread free lists
+ * of power-of-two size classes, so creating and destroying a stack is a
+ * pointer pop and push instead of malloc and free.
+ *
+ * Every buffer it hands out is filled with poison, and stacks skip
+ * poisoning new buffers (see POISONED). Deallocate poisons the bytes the
+ * caller used before putting the buffer on the free list; the rest of the
+ * size class was poisoned when the buffer was first allocated. Bigger
+ * buffers go to HeapAllocator and are poisoned on allocation, and so do
+ * buffers aligned to more than a cache line.
+ *
+ * Buffers may be freed by another thread than the one that allocated them.
+ */
+class PoolAllocator {
+  public:
+  static constexpr bool        HARDWARE_GUARDED = false;
+  static constexpr bool        POISONED         = true;
+  static constexpr bool        PERSISTENT       = false;
+  static constexpr size_t      MAX_BYTES        = SIZE_MAX;
+  static constexpr size_t      MAX_ALIGNMENT    = HeapAllocator::MAX_ALIGNMENT;
+  static constexpr const char* NAME             = "pool";
+  static constexpr size_t      MIN_CLASS_BYTES  = 64;
+  static constexpr size_t      MAX_POOLED_BYTES = 1 << 20;
+  // Free buffers kept per thread and size class.
+  static constexpr size_t      MAX_CACHED_BYTES = 1 << 20;
+
+  char* Allocate(size_t bytes, size_t alignment = DEFAULT_ALIGNMENT);
+  char* Reallocate(char* buf, size_t old_bytes, size_t new_bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+  void  Deallocate(char* buf, size_t bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+
+  private:
+  static constexpr size_t CLASSES_COUNT = 15;
+
+  /**
+   * The next free buffer is stored in the first bytes of a free one. They
+   * are the header of a stack, which it overwrites anyway.
+   */
+  struct FreeList {
+    char*  head  = nullptr;
+    size_t count = 0;
+  };
+
+  struct Cache {
+    ~Cache();
+
+    FreeList lists[CLASSES_COUNT];
+  };
+
+  static bool   IsPooled(size_t bytes, size_t alignment);
+  static size_t GetClass(size_t bytes);
+  static size_t GetClassBytes(size_t size_class);
+  /**
+   * Cache of the calling thread, nullptr once it is destroyed at thread
+   * exit.
+   */
+  static Cache* GetCache();
+  /**
+   * Buffers of a class are aligned to a cache line, so stacks of any T
+   * share them.
+   */
+  static char*  AllocateClass(size_t size_class);
+
+  static inline thread_local bool cache_destroyed = false;
+};
+
+
+inline PoolAllocator::Cache::~Cache() {
+  for (FreeList& list : lists) {
+    while (list.head != nullptr) {
+      char* next = nullptr;
+      memcpy(&next, list.head, sizeof(next));
+      free(list.head);
+      list.head = next;
+    }
+  }
+  cache_destroyed = true;
+}
+
+
+inline bool PoolAllocator::IsPooled(size_t bytes, size_t alignment) {
+  return bytes <= MAX_POOLED_BYTES && alignment <= CACHE_LINE_SIZE;
+}
+
+
+inline size_t PoolAllocator::GetClass(size_t bytes) {
+  if (bytes <= MIN_CLASS_BYTES) {
+    return 0;
+  }
+
+  return 64 - __builtin_clzll(bytes - 1) - __builtin_ctzll(MIN_CLASS_BYTES);
+}
+
+
+inline size_t PoolAllocator::GetClassBytes(size_t size_class) {
+  return MIN_CLASS_BYTES << size_class;
+}
+
+
+inline PoolAllocator::Cache* PoolAllocator::GetCache() {
+  thread_local Cache cache;
+  return cache_destroyed ? nullptr : &cache;
+}
+
+
+inline char* PoolAllocator::AllocateClass(size_t size_class) {
+  const size_t bytes = GetClassBytes(size_class);
+  char*        buf   =
+      static_cast<char*>(aligned_alloc(CACHE_LINE_SIZE, bytes));
+  if (buf == nullptr) {
+    throw std::bad_alloc();
+  }
+  poison::Fill(buf, buf + bytes);
+  return buf;
+}
+
+
+inline char* PoolAllocator::Allocate(size_t bytes, size_t alignment) {
+  if (!IsPooled(bytes, alignment)) {
+    char* buf = HeapAllocator().Allocate(bytes, alignment);
+    poison::Fill(buf, buf + bytes);
+    return buf;
+  }
+
+  const size_t size_class = GetClass(bytes);
+  Cache*       cache      = GetCache();
+  if (cache == nullptr || cache->lists[size_class].head == nullptr) {
+    return AllocateClass(size_class);
+  }
+
+  FreeList& list = cache->lists[size_class];
+  char*     buf  = list.head;
+  memcpy(&list.head, buf, sizeof(list.head));
+  --list.count;
+  poison::Fill(buf, buf + sizeof(list.head));
+  return buf;
+}
+
+
+inline char* PoolAllocator::Reallocate(
+    char* buf, size_t old_bytes, size_t new_bytes, size_t alignment) {
+  const bool old_pooled = IsPooled(old_bytes, alignment);
+  const bool new_pooled = IsPooled(new_bytes, alignment);
+  if (old_pooled && new_pooled &&
+      GetClass(old_bytes) == GetClass(new_bytes)) {
+    return buf;
+  }
+  if (!old_pooled && !new_pooled) {
+    char* new_buf =
+        HeapAllocator().Reallocate(buf, old_bytes, new_bytes, alignment);
+    if (new_bytes > old_bytes) {
+      poison::Fill(new_buf + old_bytes, new_buf + new_bytes);
+    }
+    return new_buf;
+  }
+
+  char* new_buf = Allocate(new_bytes, alignment);
+  memcpy(new_buf, buf, std::min(old_bytes, new_bytes));
+  Deallocate(buf, old_bytes, alignment);
+  return new_buf;
+}
+
+
+inline void PoolAllocator::Deallocate(
+    char* buf, size_t bytes, size_t alignment) {
+  if (!IsPooled(bytes, alignment)) {
+    HeapAllocator().Deallocate(buf, bytes, alignment);
+    return;
+  }
+
+  const size_t size_class = GetClass(bytes);
+  Cache*       cache      = GetCache();
+  if (cache == nullptr ||
+      (cache->lists[size_class].count + 1) * GetClassBytes(size_class) >
+          MAX_CACHED_BYTES) {
+    free(buf);
+    return;
+  }
+
+  FreeList& list = cache->lists[size_class];
+  poison::Fill(buf, buf + bytes);
+  memcpy(buf, &list.head, sizeof(list.head));
+  list.head = buf;
+  ++list.count;
+}
+
+
+/**
+ * Takes buffers from a std::pmr::memory_resource, e.g. an arena of the
+ * application. Pass it to the constructor of the stack; the resource must
+ * outlive the stack.
+ */
+class PmrAllocator {
+  public:
+  static constexpr bool        HARDWARE_GUARDED = false;
+  static constexpr bool        POISONED         = false;
+  static constexpr bool        PERSISTENT       = false;
+  static constexpr size_t      MAX_BYTES        = SIZE_MAX;
+  static constexpr size_t      MAX_ALIGNMENT    = MIN_PAGE_SIZE;
+  static constexpr const char* NAME             = "memory resource";
+
+  explicit PmrAllocator(
+      std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+  char* Allocate(size_t bytes, size_t alignment = DEFAULT_ALIGNMENT);
+  char* Reallocate(char* buf, size_t old_bytes, size_t new_bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+  void  Deallocate(char* buf, size_t bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+
+  private:
+  std::pmr::memory_resource* resource_;
+};
+
+
+inline PmrAllocator::PmrAllocator(std::pmr::memory_resource* resource)
+  : resource_(resource) {}
+
+
+inline char* PmrAllocator::Allocate(size_t bytes, size_t alignment) {
+  return static_cast<char*>(resource_->allocate(
+      bytes, std::max(alignment, DEFAULT_ALIGNMENT)));
+}
+
+
+inline char* PmrAllocator::Reallocate(
+    char* buf, size_t old_bytes, size_t new_bytes, size_t alignment) {
+  char* new_buf = Allocate(new_bytes, alignment);
+  memcpy(new_buf, buf, std::min(old_bytes, new_bytes));
+  Deallocate(buf, old_bytes, alignment);
+  return new_buf;
+}
+
+
+inline void PmrAllocator::Deallocate(
+    char* buf, size_t bytes, size_t alignment) {
+  resource_->deallocate(buf, bytes, std::max(alignment, DEFAULT_ALIGNMENT));
+}
+
+
+/**
+ * Serves the first buffer that fits into InlineBytes from storage inside
+ * the allocator, and so inside the stack that owns it. Bigger buffers, and
+ * the buffer an inline one grows into, come from Fallback. With Fallback
+ * void the stack cannot grow past InlineBytes (see MAX_BYTES). The storage
+ * is aligned to Alignment; buffers asking for more come from Fallback too.
+ */
+template <size_t InlineBytes, class Fallback = HeapAllocator,
+          size_t Alignment = alignof(uint64_t)>
+class InlineAllocator {
+  public:
+  static constexpr bool        HARDWARE_GUARDED = false;
+  static constexpr bool        POISONED         = false;
+  static constexpr bool        PERSISTENT       = false;
+  static constexpr bool        FIXED            = std::is_void_v<Fallback>;
+  static constexpr size_t      MAX_BYTES        =
+      FIXED ? InlineBytes : SIZE_MAX;
+  static constexpr size_t      MAX_ALIGNMENT    = FIXED
+      ? Alignment
+      : std::conditional_t<FIXED, HeapAllocator, Fallback>::MAX_ALIGNMENT;
+  static constexpr const char* NAME             = FIXED ? "static" : "inline";
+
+  /**
+   * Leaves the storage uninitialized, the stack poisons it anyway.
+   */
+  InlineAllocator() {}
+  /**
+   * Copies only the fallback. The storage belongs to the stack.
+   */
+  InlineAllocator(const InlineAllocator& other);
+
+  char* Allocate(size_t bytes, size_t alignment = DEFAULT_ALIGNMENT);
+  char* Reallocate(char* buf, size_t old_bytes, size_t new_bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+  void  Deallocate(char* buf, size_t bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+
+  private:
+  using FallbackAllocator =
+      std::conditional_t<FIXED, HeapAllocator, Fallback>;
+
+  bool FitsInline(size_t bytes, size_t alignment) const;
+
+  alignas(Alignment) char storage_[InlineBytes];
+  bool                    inline_used_ = false;
+  FallbackAllocator       fallback_;
+};
+
+
+template <size_t InlineBytes, class Fallback, size_t Alignment>
+InlineAllocator<InlineBytes, Fallback, Alignment>::
+InlineAllocator(const InlineAllocator& other)
+  : fallback_(other.fallback_) {}
+
+
+template <size_t InlineBytes, class Fallback, size_t Alignment>
+bool InlineAllocator<InlineBytes, Fallback, Alignment>::
+FitsInline(size_t bytes, size_t alignment) const {
+  return bytes <= InlineBytes && alignment <= Alignment;
+}
+
+
+template <size_t InlineBytes, class Fallback, size_t Alignment>
+char* InlineAllocator<InlineBytes, Fallback, Alignment>::
+Allocate(size_t bytes, size_t alignment) {
+  if (!inline_used_ && FitsInline(bytes, alignment)) {
+    inline_used_ = true;
+    return storage_;
+  }
+  if constexpr (FIXED) {
+    throw std::bad_alloc();
+  }
+
+  return fallback_.Allocate(bytes, alignment);
+}
+
+
+template <size_t InlineBytes, class Fallback, size_t Alignment>
+char* InlineAllocator<InlineBytes, Fallback, Alignment>::
+Reallocate(char* buf, size_t old_bytes, size_t new_bytes, size_t alignment) {
+  if (buf != storage_) {
+    return fallback_.Reallocate(buf, old_bytes, new_bytes, alignment);
+  }
+  if (FitsInline(new_bytes, alignment)) {
+    return buf;
+  }
+  if constexpr (FIXED) {
+    throw std::bad_alloc();
+  }
+
+  char* new_buf = fallback_.Allocate(new_bytes, alignment);
+  memcpy(new_buf, buf, std::min(old_bytes, new_bytes));
+  inline_used_ = false;
+  return new_buf;
+}
+
+
+template <size_t InlineBytes, class Fallback, size_t Alignment>
+void InlineAllocator<InlineBytes, Fallback, Alignment>::
+Deallocate(char* buf, size_t bytes, size_t alignment) {
+  if (buf == storage_) {
+    inline_used_ = false;
+    return;
+  }
+
+  fallback_.Deallocate(buf, bytes, alignment);
+}
+
+
+#if defined(__unix__)
+
+/**
+ * Mapped buffers are never synced explicitly. They survive the process
+ * (the page cache has them), but not a crash of the machine.
+ */
+struct FlushNever {
+  static constexpr int         MSYNC_FLAGS = 0;
+  static constexpr const char* NAME        = "never";
+};
+
+/**
+ * Every mutation schedules a writeback of the buffer (MS_ASYNC).
+ */
+struct FlushAsync {
+  static constexpr int         MSYNC_FLAGS = MS_ASYNC;
+  static constexpr const char* NAME        = "async";
+};
+
+/**
+ * Every mutation waits until the buffer is on disk (MS_SYNC). Costs a
+ * system call and a disk write per operation.
+ */
+struct FlushSync {
+  static constexpr int         MSYNC_FLAGS = MS_SYNC;
+  static constexpr const char* NAME        = "sync";
+};
+
+/**
+ * Keeps the buffer in a file mapped with MAP_SHARED, so it outlives the
+ * stack and the process. Growing is ftruncate and mremap, freeing only
+ * unmaps the file. FlushPolicy says when the buffer is msync'ed.
+ */
+template <class FlushPolicy = FlushNever>
+class MappedAllocator {
+  public:
+  static constexpr bool        HARDWARE_GUARDED = false;
+  static constexpr bool        POISONED         = false;
+  static constexpr bool        PERSISTENT       = true;
+  static constexpr size_t      MAX_BYTES        = SIZE_MAX;
+  static constexpr size_t      MAX_ALIGNMENT    = MIN_PAGE_SIZE;
+  static constexpr const char* NAME             = "mapped file";
+
+  /**
+   * Opens or creates the file. Throws std::system_error if it cannot.
+   */
+  explicit MappedAllocator(const char* path);
+  ~MappedAllocator();
+
+  MappedAllocator(const MappedAllocator& allocator)            = delete;
+  MappedAllocator& operator=(const MappedAllocator& allocator) = delete;
+
+  /**
+   * Maps what the file already holds. Returns nullptr if it is empty.
+   */
+  char* Open(size_t& bytes);
+
+  /**
+   * Buffers are mapped, so they are aligned to pages whatever alignment
+   * says.
+   */
+  char* Allocate(size_t bytes, size_t alignment = DEFAULT_ALIGNMENT);
+  char* Reallocate(char* buf, size_t old_bytes, size_t new_bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+  void  Deallocate(char* buf, size_t bytes,
+                   size_t alignment = DEFAULT_ALIGNMENT);
+
+  /**
+   * Called after every mutation of the buffer.
+   */
+  void Commit(char* buf, size_t bytes);
+  /**
+   * Writes the buffer to disk and waits for it.
+   */
+  void Flush(char* buf, size_t bytes);
+
+  private:
+  void Resize(size_t bytes);
+
+  int fd_;
+};
+
+
+template <class FlushPolicy>
+MappedAllocator<FlushPolicy>::MappedAllocator(const char* path)
+  : fd_(open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) {
+  if (fd_ == -1) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+}
+
+
+template <class FlushPolicy>
+MappedAllocator<FlushPolicy>::~MappedAllocator() {
+  close(fd_);
+}
+
+
+template <class FlushPolicy>
+char* MappedAllocator<FlushPolicy>::Open(size_t& bytes) {
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) == -1) {
+    throw std::system_error(errno, std::generic_category(), "fstat");
+  }
+
+  bytes = file_stat.st_size;
+  if (bytes == 0) {
+    return nullptr;
+  }
+
+  void* buf =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (buf == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  return static_cast<char*>(buf);
+}
+
+
+template <class FlushPolicy>
+void MappedAllocator<FlushPolicy>::Resize(size_t bytes) {
+  if (ftruncate(fd_, bytes) == -1) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+}
+
+
+template <class FlushPolicy>
+char* MappedAllocator<FlushPolicy>::Allocate(size_t bytes, size_t) {
+  Resize(bytes);
+  void* buf =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (buf == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  return static_cast<char*>(buf);
+}
+
+
+template <class FlushPolicy>
+char* MappedAllocator<FlushPolicy>::
+Reallocate(char* buf, size_t old_bytes, size_t new_bytes, size_t) {
+  // The file grows first, so that the new pages are backed by it.
+  if (new_bytes > old_bytes) {
+    Resize(new_bytes);
+  }
+
+  void* new_buf = MAP_FAILED;
+#if defined(__linux__)
+  new_buf = mremap(buf, old_bytes, new_bytes, MREMAP_MAYMOVE);
+#else
+  munmap(buf, old_bytes);
+  new_buf = mmap(nullptr, new_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd_, 0);
+#endif
+  if (new_buf == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+
+  if (new_bytes < old_bytes) {
+    Resize(new_bytes);
+  }
+  return static_cast<char*>(new_buf);
+}
+
+
+template <class FlushPolicy>
+void MappedAllocator<FlushPolicy>::
+Deallocate(char* buf, size_t bytes, size_t) {
+  munmap(buf, bytes);
+}
+
+
+template <class FlushPolicy>
+void MappedAllocator<FlushPolicy>::Commit(char* buf, size_t bytes) {
+  if constexpr (FlushPolicy::MSYNC_FLAGS != 0) {
+    msync(buf, bytes, FlushPolicy::MSYNC_FLAGS);
+  }
+}
+
+
+template <class FlushPolicy>
+void MappedAllocator<FlushPolicy>::Flush(char* buf, size_t bytes) {
+  msync(buf, bytes, MS_SYNC);
+}
+
+#endif
+
+
+/**
+ * The capacity is halved when less than 1/DEFAULT_SHRINK_RATIO of it is
+ * used. Growing doubles it, so the gap between the two keeps a stack that
+ * goes back and forth over a boundary from reallocating every time.
+ */
+inline static const size_t DEFAULT_SHRINK_RATIO = 4;
+
+/**
+ * How much the capacity grows when the stack is full: either by a factor,
+ * or by a fixed number of elements. Also when it shrinks after pops; a
+ * shrink_ratio of 0 means never.
+ */
+struct GrowthPolicy {
+  static GrowthPolicy Factor(
+      double factor, size_t shrink_ratio = DEFAULT_SHRINK_RATIO);
+  static GrowthPolicy Chunk(
+      size_t chunk_size, size_t shrink_ratio = DEFAULT_SHRINK_RATIO);
+
+  /**
+   * The next capacity after buf_size that fits at least min_size elements.
+   */
+  size_t GetNextSize(size_t buf_size, size_t min_size) const;
+  /**
+   * The capacity to shrink to when cur_size elements are left, or buf_size
+   * if the stack should not shrink. Halves buf_size until at least
+   * 1/shrink_ratio of it is used, but never below DEFAULT_INITIAL_SIZE.
+   */
+  size_t GetShrunkSize(size_t buf_size, size_t cur_size) const;
+
+  double factor;
+  size_t chunk_size;
+  size_t shrink_ratio;
+};
+
+
+inline GrowthPolicy GrowthPolicy::Factor(double factor, size_t shrink_ratio) {
+  return {factor, 0, shrink_ratio};
+}
+
+
+inline GrowthPolicy GrowthPolicy::Chunk(
+    size_t chunk_size, size_t shrink_ratio) {
+  return {0, chunk_size, shrink_ratio};
+}
+
+
+inline size_t GrowthPolicy::GetNextSize(
+    size_t buf_size, size_t min_size) const {
+  if (min_size <= buf_size) {
+    min_size = buf_size + 1;
+  }
+
+  if (chunk_size != 0) {
+    const size_t chunks = (min_size - buf_size + chunk_size - 1) / chunk_size;
+    return buf_size + chunks * chunk_size;
+  }
+
+  size_t new_size = buf_size;
+  while (new_size < min_size) {
+    new_size = std::max(
+        new_size + 1, static_cast<size_t>(new_size * factor));
+  }
+  return new_size;
+}
+
+
+inline size_t GrowthPolicy::GetShrunkSize(
+    size_t buf_size, size_t cur_size) const {
+  if (shrink_ratio == 0) {
+    return buf_size;
+  }
+
+  size_t new_size = buf_size;
+  while (new_size / 2 >= DEFAULT_INITIAL_SIZE &&
+         cur_size * shrink_ratio < new_size) {
+    new_size /= 2;
+  }
+  return new_size;
+}
+
+inline static const GrowthPolicy DEFAULT_GROWTH = GrowthPolicy::Factor(2);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - LOGGING - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Logs both debug messages and errors.
+ */
+struct LogAll {
+  static constexpr bool        DBG    = true;
+  static constexpr bool        LOG    = true;
+  static constexpr bool        BINARY = false;
+  static constexpr const char* NAME   = "all";
+};
+
+/**
+ * Logs only errors. Debug messages are not even formatted.
+ */
+struct LogErrors {
+  static constexpr bool        DBG    = false;
+  static constexpr bool        LOG    = true;
+  static constexpr bool        BINARY = false;
+  static constexpr const char* NAME   = "errors";
+};
+
+/**
+ * Logs nothing.
+ */
+struct LogNone {
+  static constexpr bool        DBG    = false;
+  static constexpr bool        LOG    = false;
+  static constexpr bool        BINARY = false;
+  static constexpr const char* NAME   = "none";
+};
+
+#ifndef SHUSH_STACK_DBG_LOGS
+#ifdef NDEBUG
+#define SHUSH_STACK_DBG_LOGS 0
+#else
+#define SHUSH_STACK_DBG_LOGS 1
+#endif
+#endif
+
+/**
+ * LogAll in debug builds, LogErrors in release ones. Define
+ * SHUSH_STACK_DBG_LOGS to 0 or 1 to override.
+ */
+using LogDefault =
+    std::conditional_t<SHUSH_STACK_DBG_LOGS, LogAll, LogErrors>;
+
+/**
+ * The message expression is evaluated only if LogPolicy enables the level,
+ * so disabled logs cost nothing, not even a std::string.
+ */
+#define SHUSH_STACK_DBG(message)           \
+  do {                                     \
+    if constexpr (LogPolicy::DBG) {        \
+      this->logger_.Dbg(message);          \
+    }                                      \
+  } while (false)
+
+#define SHUSH_STACK_LOG(message)           \
+  do {                                     \
+    if constexpr (LogPolicy::LOG) {        \
+      this->logger_.Log(message);          \
+    }                                      \
+  } while (false)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - BINARY LOG- - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+namespace binlog {
+
+enum class Event : uint16_t {
+  CONSTRUCTED,
+  DESTROYED,
+  PUSHED,
+  POPPED,
+  REALLOCATED,
+  ERROR,
+  /**
+   * Written by the sink: the ring of a thread was full and cur_size
+   * records of it were lost.
+   */
+  DROPPED
+};
+
+/**
+ * What a stack with LogBinary writes instead of a text message. Fixed
+ * size, so the file is just an array of them after the FileHeader.
+ */
+struct Record {
+  /**
+   * Nanoseconds since the epoch.
+   */
+  uint64_t time;
+  uint64_t stack_id;
+  uint64_t cur_size;
+  uint64_t buf_size;
+  uint32_t thread_id;
+  Event    event;
+  /**
+   * Errc of ERROR records.
+   */
+  int16_t  error_code;
+};
+
+struct FileHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+inline static const char     FILE_MAGIC[8]       = {'S', 'H', 'U', 'S',
+                                                    'H', 'B', 'I', 'N'};
+inline static const uint32_t FILE_VERSION        = 1;
+// Records each thread can have in flight before they are dropped.
+inline static const size_t   RING_CAPACITY       = 1 << 12;
+// How often the sink drains the rings, in milliseconds.
+inline static const size_t   DRAIN_PERIOD_MS     = 10;
+
+/**
+ * Nanoseconds since the epoch.
+ */
+inline uint64_t GetTime() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * The message the text logger would have written for the record.
+ */
+inline std::string Format(const Record& record) {
+  std::string message =
+      std::to_string(record.time) + " [thread " +
+      std::to_string(record.thread_id) + "] [shush-stack-" +
+      std::to_string(record.stack_id) + "] ";
+
+  switch (record.event) {
+  case Event::CONSTRUCTED:
+    return message + "Construction of the stack completed. Its capacity is " +
+           std::to_string(record.buf_size) + ".";
+  case Event::DESTROYED:
+    return message + "Destruction is complete. Bye-bye!";
+  case Event::PUSHED:
+    return message + "Pushing is complete. The new cur size is " +
+           std::to_string(record.cur_size) + ".";
+  case Event::POPPED:
+    return message + "Popping is complete. The new size is " +
+           std::to_string(record.cur_size) + ".";
+  case Event::REALLOCATED:
+    return message + "Reallocation completed. The new capacity is " +
+           std::to_string(record.buf_size) + ".";
+  case Event::ERROR:
+    return message + "Error " + std::to_string(record.error_code) + ": " +
+           GetErrorName(record.error_code);
+  case Event::DROPPED:
+    return message + std::to_string(record.cur_size) +
+           " records were dropped, the ring of the thread was full.";
+  default:
+    return message + "Unknown event.";
+  }
+}
+
+/**
+ * Records of one thread on their way to the sink. The thread is the only
+ * producer and the sink the only consumer, so pushing is wait-free.
+ */
+class Ring {
+  public:
+  explicit Ring(uint32_t thread_id);
+
+  /**
+   * Drops the record if the ring is full.
+   */
+  void Push(const Record& record);
+  /**
+   * Writes out everything pushed so far. Called by the sink only.
+   */
+  void Drain(FILE* file);
+
+  uint32_t GetThreadId() const;
+
+  private:
+  alignas(64) std::atomic<uint64_t> head_;
+  alignas(64) std::atomic<uint64_t> tail_;
+  std::atomic<uint64_t>             dropped_;
+  uint32_t                          thread_id_;
+  Record                            records_[RING_CAPACITY];
+};
+
+
+inline Ring::Ring(uint32_t thread_id)
+  : head_(0)
+  , tail_(0)
+  , dropped_(0)
+  , thread_id_(thread_id) {}
+
+
+inline void Ring::Push(const Record& record) {
+  const uint64_t tail = tail_.load(std::memory_order_relaxed);
+  if (tail - head_.load(std::memory_order_acquire) == RING_CAPACITY) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  records_[tail % RING_CAPACITY] = record;
+  tail_.store(tail + 1, std::memory_order_release);
+}
+
+
+inline void Ring::Drain(FILE* file) {
+  const uint64_t head = head_.load(std::memory_order_relaxed);
+  const uint64_t tail = tail_.load(std::memory_order_acquire);
+  if (head != tail) {
+    const size_t begin = head % RING_CAPACITY;
+    const size_t count = tail - head;
+    const size_t first = std::min(count, RING_CAPACITY - begin);
+    fwrite(records_ + begin, sizeof(Record), first, file);
+    fwrite(records_, sizeof(Record), count - first, file);
+    head_.store(tail, std::memory_order_release);
+  }
+
+  if (const uint64_t dropped =
+          dropped_.exchange(0, std::memory_order_relaxed)) {
+    Record record = {};
+    record.time      = GetTime();
+    record.cur_size  = dropped;
+    record.thread_id = thread_id_;
+    record.event     = Event::DROPPED;
+    fwrite(&record, sizeof(record), 1, file);
+  }
+}
+
+
+inline uint32_t Ring::GetThreadId() const {
+  return thread_id_;
+}
+
+/**
+ * The process-wide background thread that drains the rings of all threads
+ * into a file. Records are taken only while it runs.
+ */
+class Sink {
+  public:
+  static Sink& Get();
+
+  ~Sink();
+
+  /**
+   * Opens the file and starts the thread. Throws std::system_error if the
+   * file cannot be opened.
+   */
+  void Start(const char* path);
+  /**
+   * Drains what is left, stops the thread and closes the file.
+   */
+  void Stop();
+
+  bool IsRunning() const;
+  /**
+   * The ring of the calling thread, created on the first call.
+   */
+  Ring& GetThreadRing();
+
+  private:
+  Sink() = default;
+
+  void Run();
+  void DrainAll();
+
+  std::atomic<bool>                  running_{false};
+  std::mutex                         mutex_;
+  std::condition_variable            stop_requested_;
+  std::vector<std::shared_ptr<Ring>> rings_;
+  uint32_t                           next_thread_id_ = 0;
+  std::thread                        thread_;
+  FILE*                              file_ = nullptr;
+};
+
+
+inline Sink& Sink::Get() {
+  static Sink sink;
+  return sink;
+}
+
+
+inline Sink::~Sink() {
+  Stop();
+}
+
+
+inline void Sink::Start(const char* path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_.load()) {
+    return;
+  }
+
+  file_ = fopen(path, "wb");
+  if (file_ == nullptr) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+  FileHeader header = {};
+  memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+  header.version     = FILE_VERSION;
+  header.record_size = sizeof(Record);
+  fwrite(&header, sizeof(header), 1, file_);
+
+  running_.store(true);
+  thread_ = std::thread(&Sink::Run, this);
+}
+
+
+inline void Sink::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_.load()) {
+      return;
+    }
+    running_.store(false);
+  }
+  stop_requested_.notify_one();
+  thread_.join();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  DrainAll();
+  fclose(file_);
+  file_ = nullptr;
+}
+
+
+inline bool Sink::IsRunning() const {
+  return running_.load(std::memory_order_relaxed);
+}
+
+
+inline Ring& Sink::GetThreadRing() {
+  thread_local std::shared_ptr<Ring> ring = [this] {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rings_.push_back(std::make_shared<Ring>(next_thread_id_++));
+    return rings_.back();
+  }();
+  return *ring;
+}
+
+
+inline void Sink::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_.load()) {
+    stop_requested_.wait_for(
+        lock, std::chrono::milliseconds(DRAIN_PERIOD_MS));
+    DrainAll();
+  }
+}
+
+
+inline void Sink::DrainAll() {
+  size_t kept = 0;
+  for (size_t i = 0; i < rings_.size(); ++i) {
+    // Only the sink holds the ring of a finished thread. Checked before
+    // draining, so that its last records are not lost.
+    const bool finished = rings_[i].use_count() == 1;
+    rings_[i]->Drain(file_);
+    if (!finished) {
+      rings_[kept++] = std::move(rings_[i]);
+    }
+  }
+  rings_.resize(kept);
+  fflush(file_);
+}
+
+/**
+ * Stands in for logs::Logger in stacks with LogBinary: an id instead of a
+ * name, and records instead of messages.
+ */
+class Logger {
+  public:
+  Logger();
+
+  uint64_t GetId() const;
+  void Emit(Event event, size_t cur_size, size_t buf_size,
+            int error_code = 0);
+
+  private:
+  uint64_t id_;
+};
+
+
+inline Logger::Logger() {
+  static std::atomic<uint64_t> stacks_created(0);
+  id_ = stacks_created++;
+}
+
+
+inline uint64_t Logger::GetId() const {
+  return id_;
+}
+
+
+inline void Logger::Emit(Event event, size_t cur_size, size_t buf_size,
+                         int error_code) {
+  Sink& sink = Sink::Get();
+  if (!sink.IsRunning()) {
+    return;
+  }
+
+  Ring& ring = sink.GetThreadRing();
+  Record record;
+  record.time       = GetTime();
+  record.stack_id   = id_;
+  record.cur_size   = cur_size;
+  record.buf_size   = buf_size;
+  record.thread_id  = ring.GetThreadId();
+  record.event      = event;
+  record.error_code = static_cast<int16_t>(error_code);
+  ring.Push(record);
+}
+
+} // namespace binlog
+
+
+/**
+ * No text at all: the stack writes binlog::Record's of its main events and
+ * errors to the ring of the thread, and binlog::Sink writes them to a
+ * file. The file is turned into text by shush-stack-logdump.
+ */
+struct LogBinary {
+  static constexpr bool        DBG    = false;
+  static constexpr bool        LOG    = false;
+  static constexpr bool        BINARY = true;
+  static constexpr const char* NAME   = "binary";
+};
+
+/**
+ * Records an event with the given sizes, if LogPolicy is binary.
+ */
+#define SHUSH_STACK_EVENT(event, ...)                            \
+  do {                                                           \
+    if constexpr (LogPolicy::BINARY) {                           \
+      this->logger_.Emit(binlog::Event::event, __VA_ARGS__);     \
+    }                                                            \
+  } while (false)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - STATS - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Define SHUSH_STACK_STATS to 1 to count what every SafeStack does and how
+ * long each protection layer takes. With 0, the counters take no space
+ * and the stats are all zeros.
+ */
+#ifndef SHUSH_STACK_STATS
+#define SHUSH_STACK_STATS 0
+#endif
+
+namespace stats {
+
+/**
+ * The parts of the stack that are timed separately. A layer called from
+ * another one, e.g. hashing from Ok(), counts only for the inner one.
+ */
+enum class Layer {
+  CANARIES,
+  HASH,
+  POISON,
+  VERIFY,
+  NONE
+};
+
+inline static const size_t LAYERS_COUNT = static_cast<size_t>(Layer::NONE);
+
+inline const char* GetLayerName(Layer layer) {
+  switch (layer) {
+  case Layer::CANARIES:
+    return "canaries";
+  case Layer::HASH:
+    return "hash";
+  case Layer::POISON:
+    return "poison";
+  case Layer::VERIFY:
+    return "verify";
+  default:
+    return "none";
+  }
+}
+
+/**
+ * Time stamp counter ticks, or nanoseconds where there is no TSC.
+ */
+inline uint64_t ReadTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct Stats {
+  uint64_t pushes            = 0;
+  uint64_t pops              = 0;
+  uint64_t reallocations     = 0;
+  /**
+   * Bytes copied or moved to a new buffer by reallocations.
+   */
+  uint64_t bytes_moved       = 0;
+  uint64_t hash_computations = 0;
+  uint64_t bytes_hashed      = 0;
+  /**
+   * Ok() calls that checked anything.
+   */
+  uint64_t verifications     = 0;
+  /**
+   * Time spent in each layer, in ReadTicks() units.
+   */
+  uint64_t ticks[LAYERS_COUNT] = {};
+
+  Stats& operator+=(const Stats& other);
+};
+
+inline Stats& Stats::operator+=(const Stats& other) {
+  pushes            += other.pushes;
+  pops              += other.pops;
+  reallocations     += other.reallocations;
+  bytes_moved       += other.bytes_moved;
+  hash_computations += other.hash_computations;
+  bytes_hashed      += other.bytes_hashed;
+  verifications     += other.verifications;
+  for (size_t i = 0; i < LAYERS_COUNT; ++i) {
+    ticks[i] += other.ticks[i];
+  }
+
+  return *this;
+}
+
+/**
+ * The stats of one stack and the layer that is being timed now.
+ */
+struct Recorder {
+  /**
+   * Charges the time since the last switch to the current layer and
+   * starts timing the given one.
+   */
+  void Switch(Layer next_layer);
+
+  Stats    stats;
+  Layer    layer = Layer::NONE;
+  uint64_t since = 0;
+};
+
+inline void Recorder::Switch(Layer next_layer) {
+  const uint64_t now = ReadTicks();
+  if (layer != Layer::NONE) {
+    stats.ticks[static_cast<size_t>(layer)] += now - since;
+  }
+  layer = next_layer;
+  since = now;
+}
+
+/**
+ * Times the layer until the end of the scope, then goes back to timing
+ * the one it interrupted.
+ */
+class LayerTimer {
+  public:
+  LayerTimer(Recorder& recorder, Layer layer)
+    : recorder_(recorder)
+    , outer_layer_(recorder.layer) {
+    recorder_.Switch(layer);
+  }
+
+  ~LayerTimer() {
+    recorder_.Switch(outer_layer_);
+  }
+
+  LayerTimer(const LayerTimer& timer)            = delete;
+  LayerTimer& operator=(const LayerTimer& timer) = delete;
+
+  private:
+  Recorder& recorder_;
+  Layer     outer_layer_;
+};
+
+/**
+ * One line per counter.
+ */
+inline std::string Format(const Stats& stats) {
+  std::string message =
+      "pushes: " + std::to_string(stats.pushes) +
+      "\npops: " + std::to_string(stats.pops) +
+      "\nreallocations: " + std::to_string(stats.reallocations) +
+      "\nbytes moved: " + std::to_string(stats.bytes_moved) +
+      "\nhash computations: " + std::to_string(stats.hash_computations) +
+      "\nbytes hashed: " + std::to_string(stats.bytes_hashed) +
+      "\nverifications: " + std::to_string(stats.verifications);
+  for (size_t i = 0; i < LAYERS_COUNT; ++i) {
+    message += "\nticks in ";
+    message += GetLayerName(static_cast<Layer>(i));
+    message += ": " + std::to_string(stats.ticks[i]);
+  }
+
+  return message;
+}
+
+/**
+ * Logs the stats under the given title, whatever the LogPolicy.
+ */
+inline void Log(logs::Logger& logger, const std::string& title,
+                const Stats& stats) {
+  logger.Log(title + ":\n" + Format(stats));
+}
+
+} // namespace stats
+
+/**
+ * Both compile to nothing, arguments included, unless SHUSH_STACK_STATS
+ * is set.
+ */
+#if SHUSH_STACK_STATS
+#define SHUSH_STACK_COUNT(counter, n)      \
+  (this->stats_.stats.counter += (n))
+
+#define SHUSH_STACK_TIME(layer)            \
+  stats::LayerTimer layer_timer(this->stats_, stats::Layer::layer)
+#else
+#define SHUSH_STACK_COUNT(counter, n) ((void)0)
+#define SHUSH_STACK_TIME(layer)       ((void)0)
+#endif
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - DYNAMIC - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * STRUCTURE:
+ * [CANARY][HASH][CUR_SIZE][BUFFER_SIZE]([PAD])[B - U - F - F - E - R][CANARY]
+ *
+ * Every protection layer is a policy. The ones that are off take no bytes
+ * in the buffer and compile to nothing. The header is padded with poison
+ * only as far as T needs (see GetBufAlignment()).
+ */
+template <class T, class HashPolicy = FullHash,
+          class VerifyPolicy = VerifyParanoid, class LogPolicy = LogDefault,
+          class Allocator = HeapAllocator, class CanaryPolicy = WithCanaries,
+          class PoisonPolicy = WithPoison>
+class SafeStack {
+  public:
+  // Layout of this very stack. Shadows the global one, which is the layout
+  // with every layer on.
+  static constexpr size_t CANARY_SIZE =
+      CanaryPolicy::ENABLED ? sizeof(uint64_t) : 0;
+  static constexpr size_t HASH_SIZE =
+      HashPolicy::ENABLED ? sizeof(uint64_t) : 0;
+  static constexpr size_t HASH_POS     = CANARY_SIZE;
+  static constexpr size_t CUR_SIZE_POS = HASH_POS + HASH_SIZE;
+  static constexpr size_t BUF_SIZE_POS = CUR_SIZE_POS + CUR_SIZE_SIZE;
+  static constexpr size_t HEADER_SIZE  = BUF_SIZE_POS + BUF_SIZE_SIZE;
+  // What the buffer is allocated aligned to.
+  static constexpr size_t BUF_ALIGNMENT = GetBufAlignment<T>();
+  static constexpr size_t BUF_POS       = AlignUp(HEADER_SIZE, BUF_ALIGNMENT);
+
+  static_assert(BUF_ALIGNMENT <= Allocator::MAX_ALIGNMENT,
+                "The allocator cannot align buffers enough for T");
+
+  SafeStack();
+  /**
+   * Takes buffers from the given allocator, e.g. a PmrAllocator.
+   */
+  explicit SafeStack(const Allocator& allocator);
+  ~SafeStack();
+
+  SafeStack(const SafeStack& stack)            = delete;
+  SafeStack(SafeStack&& stack)                 = delete;
+  SafeStack& operator=(const SafeStack& stack) = delete;
+  SafeStack& operator=(SafeStack&& stack)      = delete;
+
+  void Push(const T& item);
+  void Push(T&& item);
+  /**
+   * Constructs the new top element in place from args.
+   */
+  template <class... Args>
+  void Emplace(Args&&... args);
+
+  /**
+   * Moves the top element out and destroys it.
+   */
+  T Pop();
+  /**
+   * Same as Pop(), but moves into out, so nothing is constructed.
+   */
+  void Pop(T& out);
+  /**
+   * Destroys the top element.
+   */
+  void Drop();
+
+  /**
+   * The top element. Const, since changing it would break the hash.
+   */
+  const T& Top();
+  /**
+   * The ind-th element from the top, so Peek(0) is Top().
+   */
+  const T& Peek(size_t ind);
+
+  /**
+   * Pushes n elements with a single verification, reallocation and hash
+   * update. Trivially copyable elements are memcpy'd.
+   */
+  void PushN(const T* items, size_t n);
+  /**
+   * Same as PushN for any range. Forward ranges grow the buffer only once.
+   * Pass move iterators to move the elements in. Only ranges of pointers
+   * may refer to elements of this stack.
+   */
+  template <class InputIt>
+  void PushRange(InputIt first, InputIt last);
+  /**
+   * Pushes every element of a contiguous container (std::vector, std::array,
+   * C array, ...).
+   */
+  template <class Container>
+  void Append(const Container& items);
+  /**
+   * Pops n elements into out with a single verification, poison sweep and
+   * hash update. The elements are written in the order they were pushed,
+   * so PopN undoes PushN.
+   */
+  void PopN(T* out, size_t n);
+
+  /**
+   * The depth of a checkpoint and the hash state at it.
+   */
+  struct CheckpointToken {
+    size_t      depth;
+    size_t      buf_size;
+    uint64_t    slots_hash;
+    const char* buf;
+  };
+  /**
+   * Remembers the current depth for Rollback(). Free with IncrementalHash,
+   * a hash of the elements with FullHash. There is nothing to commit: a
+   * token that is not needed is just dropped, and checkpoints nest.
+   */
+  CheckpointToken Checkpoint();
+  /**
+   * Destroys and poisons everything pushed since the checkpoint with a
+   * single sweep and hash update. Throws a dump if the stack was popped
+   * below the checkpoint or the elements under it changed since, e.g. by
+   * rolling back to an outer checkpoint and pushing again. If T is not
+   * trivially copyable and the buffer was reallocated since the checkpoint,
+   * the elements were moved and may have other bytes, so only the depth is
+   * checked.
+   */
+  void Rollback(const CheckpointToken& checkpoint);
+
+  /**
+   * Sets how the capacity grows when the stack is full and shrinks when it
+   * is mostly empty. Doubling and halving below a quarter by default.
+   */
+  void SetGrowthPolicy(const GrowthPolicy& growth);
+  /**
+   * Makes the capacity at least n elements, reallocating once.
+   */
+  void Reserve(size_t n);
+  /**
+   * Makes the capacity exactly the current size. Does nothing if the
+   * allocator is bounded, e.g. in SafeStackStatic.
+   */
+  void ShrinkToFit();
+
+  /**
+   * Unheard generosity!
+   */
+  T GetElement(size_t ind);
+
+  /**
+   * Get the size of current used space.
+   */
+  size_t GetCurSize();
+  /**
+   * Get current capacity of the stack.
+   */
+  size_t GetBufSize();
+
+  /**
+   * Verifies the stack as deep as VerifyPolicy says. If full is set, the
+   * stack is verified paranoidly whatever the policy is.
+   */
+  void Ok(bool full = false);
+
+  /**
+   * What this stack has done so far. All zeros unless SHUSH_STACK_STATS
+   * is set.
+   */
+  stats::Stats GetStats();
+  /**
+   * Sum of the stats of every destroyed stack of this very type, so of
+   * this combination of policies.
+   */
+  static stats::Stats GetTypeStats();
+  /**
+   * Logs both with the logger of the stack.
+   */
+  void LogStats();
+
+  protected:
+  /**
+   * Starts with a buffer of initial_size elements. The allocator is built
+   * from allocator_args in place, so big inline allocators are not copied.
+   */
+  template <class... AllocatorArgs>
+  explicit SafeStack(size_t initial_size,
+                     const AllocatorArgs&... allocator_args);
+
+  /**
+   * Adopts the buffer of bytes bytes a persistent allocator has reopened.
+   * Verifies it paranoidly, rolling back a Push the previous owner was
+   * killed in the middle of. The caller frees the buffer if it throws.
+   */
+  void Reopen(size_t bytes);
+  /**
+   * Whether the hash stored in the buffer is the one of the buffer as it
+   * is. Recomputes the incremental hash first.
+   */
+  bool IsHashConsistent();
+
+  /**
+   * Checks the next VerifyPolicy::WINDOW unused cells for poison.
+   */
+  void VerifyPoisonWindow();
+  /**
+   * Moves the watermark down to the current size after a paranoid check
+   * found the cells above it poisoned. A full check recounts clean_hash_.
+   */
+  void MarkClean(bool full);
+  /**
+   * Called from the SIGSEGV handler when a guard page of the buffer is hit.
+   * Writes the dump a failed Ok() would throw straight to stderr, without
+   * the logger, exceptions or allocations, which are not async-signal-safe.
+   */
+  static void OnGuardFault(void* owner, const void* address);
+  void ReportGuardFault(const void* address);
+  /**
+   * Message for Ok() calls, in a per-thread buffer.
+   */
+  char* GetDumpMessage(int error_code);
+  /**
+   * Writes the message into the given buffer. Does not allocate unless
+   * debug messages are logged.
+   */
+  char* GetDumpMessage(int error_code, char* buffer, size_t size);
+
+  /**
+   * Fills both sides of buffer with canaries.
+   */
+  void FillCanaries(size_t all_buffer_size);
+  /**
+   * Sets current size of stack in buffer.
+   */
+  void SetCurSizeVal(size_t cur_size);
+  /**
+   * Sets capacity of the stack in buffer.
+   */
+  void SetBufferSizeVal(size_t buffer_size);
+  /**
+   * Fills given range with poison values.
+   */
+  void FillWithPoison(char* from, char* to);
+  /**
+   * Calculates and places hash into corresponding place
+   */
+  void CalculateAndPlaceHash(size_t all_buffer_size);
+  void CalculateAndPlaceHash();
+
+  uint64_t GetHashValue();
+  uint64_t GetFirstCanary();
+  uint64_t GetSecondCanary();
+  /**
+   * Get size of all allocated space. In chars.
+   */
+  size_t GetAllBufferSize();
+  /**
+   * How many elements the allocated buffer fits, whatever the header says.
+   */
+  size_t GetCapacity();
+
+  /**
+   * Get poison value as if it was T.
+   */
+  constexpr T GetPoisonValue();
+  /**
+   * Checks whether the given value is poison.
+   */
+  bool IsPoison(const T& val);
+
+  uint64_t CalculateHash(size_t all_buffer_size);
+  uint64_t CalculateHash();
+  /**
+   * Hash of the whole buffer computed from memory, whatever the HashPolicy.
+   */
+  uint64_t CalculateFullHash();
+  /**
+   * Same as CalculateFullHash for IncrementalHash, but takes the slots past
+   * the watermark from clean_hash_ instead of memory.
+   */
+  uint64_t CalculateWatermarkHash();
+  /**
+   * Hash of everything except the element slots.
+   */
+  uint64_t CalculateHeaderHash();
+  /**
+   * Hash of the slot with the given index, as it is in memory now.
+   */
+  uint64_t CalculateSlotHash(size_t ind);
+  /**
+   * Hash the slot with the given index would have if it was poisoned.
+   */
+  uint64_t CalculatePoisonSlotHash(size_t ind);
+  /**
+   * Sum of hashes of slots in [from, to), as they are in memory now.
+   */
+  uint64_t CalculateSlotsHash(size_t from, size_t to);
+  /**
+   * Same for unused slots. They count only if they hold poison.
+   */
+  uint64_t CalculateUnusedSlotsHash(size_t from, size_t to);
+  /**
+   * Sum of hashes the slots in [from, to) would have if poisoned.
+   */
+  uint64_t CalculatePoisonSlotsHash(size_t from, size_t to);
+  /**
+   * Hash state of the slots under depth, which is not above the current
+   * size: the slots_hash_ the stack would have if popped down to it for
+   * IncrementalHash, their hash for FullHash.
+   */
+  uint64_t CalculateCheckpointHash(size_t depth);
+  /**
+   * Ties the hash to the address of the stack, so that a buffer copied to
+   * another stack does not verify. Zero for persistent buffers, which are
+   * reopened by other objects.
+   */
+  uint64_t CalculateOwnerHash();
+  /**
+   * Hashes raw bytes with the hash function of the policy.
+   */
+  static uint64_t HashBytes(const char* data, size_t size) {
+    return HashPolicy::Function::Hash(data, size);
+  }
+
+  /**
+   * Verifies the stack and takes the top element out of the hash. The
+   * element has to be removed with RemoveTop() then.
+   */
+  T&   PrepareTopRemoval();
+  /**
+   * Destroys and poisons the top element and shrinks the stack.
+   */
+  void RemoveTop();
+
+  /**
+   * Grows the capacity as the GrowthPolicy says.
+   */
+  void Grow();
+  /**
+   * Grows the capacity so it fits min_buf_size elements, reallocating the
+   * buffer once.
+   */
+  void GrowToFit(size_t min_buf_size);
+  /**
+   * Shrinks the capacity if the GrowthPolicy says the stack is too empty.
+   * Called after pops, once the hash is in place.
+   */
+  void ShrinkIfSparse();
+  /**
+   * Reallocates the buffer to hold new_buf_size elements, which may be
+   * fewer than now, but not fewer than the current size. Trivially
+   * copyable elements are not copied at all when the allocator can resize
+   * in place; other ones are moved and the moved-from objects destroyed.
+   */
+  void Reallocate(size_t new_buf_size);
+
+  /**
+   * Binary stacks hand their records to binlog::Sink instead of writing
+   * text.
+   */
+  using Logger = std::conditional_t<LogPolicy::BINARY,
+                                    binlog::Logger, logs::Logger>;
+  static Logger MakeLogger();
+
+  char*         buf_;
+  /**
+   * Bytes the buffer was allocated with. The allocator is told this, never
+   * the sizes in the header, which may be corrupted.
+   */
+  size_t        all_size_;
+  Allocator     allocator_;
+  GrowthPolicy  growth_;
+  Logger        logger_;
+  /**
+   * Sum of slot hashes, maintained only by IncrementalHash.
+   */
+  uint64_t      slots_hash_;
+  /**
+   * Number of Ok() calls and the start of the next window to check,
+   * used only by VerifySampled.
+   */
+  size_t        verify_calls_;
+  size_t        verify_cursor_;
+  /**
+   * The dirty watermark: slots from it on have not been written since
+   * the last paranoid check found them poisoned, so the next one skips
+   * them. clean_hash_ is the sum of their poisoned hashes, maintained only
+   * by IncrementalHash.
+   */
+  size_t        dirty_end_;
+  uint64_t      clean_hash_;
+  static std::atomic<size_t> stacks_count;
+#if SHUSH_STACK_STATS
+  stats::Recorder     stats_;
+  static stats::Stats retired_stats;
+  static std::mutex   retired_stats_mutex;
+#endif
+};
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+constexpr T SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                      CanaryPolicy, PoisonPolicy>::
+GetPoisonValue() {
+  char elem[sizeof(T)];
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    elem[i] = POISON_VALUE;
+  }
+  return *reinterpret_cast<T*>(&elem);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+typename SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::Logger
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::MakeLogger() {
+  if constexpr (LogPolicy::BINARY) {
+    return Logger();
+  } else {
+    return Logger("shush-stack-" + std::to_string(stacks_count.load()));
+  }
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::SafeStack()
+  : SafeStack(DEFAULT_INITIAL_SIZE) {}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::SafeStack(const Allocator& allocator)
+  : SafeStack(DEFAULT_INITIAL_SIZE, allocator) {}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+template <class... AllocatorArgs>
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::
+SafeStack(size_t initial_size, const AllocatorArgs&... allocator_args)
+  : all_size_(0)
+  , allocator_(allocator_args...)
+  , growth_(DEFAULT_GROWTH)
+  , logger_(MakeLogger())
+  , slots_hash_(0)
+  , verify_calls_(0)
+  , verify_cursor_(0)
+  , dirty_end_(0)
+  , clean_hash_(0) {
+  SHUSH_STACK_DBG("Construction of the DYNAMIC stack started.");
+  SHUSH_STACK_DBG(
+      "The type that is held in the stack is " +
+      std::string(typeid(T).name()) + ", and its size is " +
+      std::to_string(sizeof(T)) + ".");
+
+  if constexpr (Allocator::HARDWARE_GUARDED) {
+    allocator_.Bind(this, &OnGuardFault);
+  }
+
+  if constexpr (Allocator::PERSISTENT) {
+    size_t bytes = 0;
+    buf_ = allocator_.Open(bytes);
+    if (buf_ != nullptr) {
+      SHUSH_STACK_DBG(
+          "Reopening a buffer of " + std::to_string(bytes) + " bytes.");
+      all_size_ = bytes;
+      try {
+        Reopen(bytes);
+      } catch (...) {
+        allocator_.Deallocate(buf_, bytes, BUF_ALIGNMENT);
+        throw;
+      }
+      SHUSH_STACK_EVENT(CONSTRUCTED, GetCurSize(), GetBufSize());
+      ++stacks_count;
+      return;
+    }
+  }
+
+  const size_t all_size = BUF_POS + initial_size * sizeof(T) + CANARY_SIZE;
+
+  buf_      = allocator_.Allocate(all_size, BUF_ALIGNMENT);
+  all_size_ = all_size;
+  SHUSH_STACK_DBG(
+      "Allocated " + std::to_string(all_size) +
+      " bytes of memory for DYNAMIC buffer.");
+
+  SetBufferSizeVal(initial_size);
+  SetCurSizeVal(0);
+  FillCanaries(all_size);
+  if constexpr (!Allocator::POISONED) {
+    FillWithPoison(buf_ + HEADER_SIZE, buf_ + all_size - CANARY_SIZE);
+  }
+  if constexpr (HashPolicy::INCREMENTAL) {
+    slots_hash_ = CalculateUnusedSlotsHash(0, initial_size);
+    clean_hash_ = CalculatePoisonSlotsHash(0, initial_size);
+  }
+  CalculateAndPlaceHash(all_size);
+
+  SHUSH_STACK_DBG("Construction of the stack completed.");
+  SHUSH_STACK_EVENT(CONSTRUCTED, 0, initial_size);
+  ++stacks_count;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::~SafeStack() {
+  SHUSH_STACK_DBG("Destructing stack by deleting the buffer...");
+  if (buf_ != nullptr) {
+    SHUSH_STACK_EVENT(DESTROYED, GetCurSize(), GetBufSize());
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      const size_t cur_size = std::min(GetCurSize(), GetCapacity());
+      for (size_t i = 0; i < cur_size; ++i) {
+        reinterpret_cast<T*>(buf_ + BUF_POS + i * sizeof(T))->~T();
+      }
+    }
+    allocator_.Deallocate(buf_, all_size_, BUF_ALIGNMENT);
+  }
+#if SHUSH_STACK_STATS
+  {
+    std::lock_guard<std::mutex> lock(retired_stats_mutex);
+    retired_stats += stats_.stats;
+  }
+#endif
+  SHUSH_STACK_DBG("Destruction is complete. Bye-bye!");
+  --stacks_count;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Push(const T& item) {
+  SHUSH_STACK_DBG("Pushing an element that is a const ref...");
+  Emplace(item);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Push(T&& item) {
+  SHUSH_STACK_DBG("Pushing an element that is an rvalue...");
+  Emplace(std::move(item));
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+template <class... Args>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Emplace(Args&&... args) {
+  VERIFIED
+
+  char* slot = nullptr;
+  try {
+    if (GetCurSize() == GetBufSize()) {
+      SHUSH_STACK_DBG(
+          "The size of buffer is equal to current size! Starting the reallocation...");
+      // args may refer to an element of this stack, which the reallocation
+      // moves away.
+      T item(std::forward<Args>(args)...);
+      Grow();
+      slot = buf_ + BUF_POS + GetCurSize() * sizeof(T);
+      new(slot) T(std::move(item));
+    } else {
+      slot = buf_ + BUF_POS + GetCurSize() * sizeof(T);
+      new(slot) T(std::forward<Args>(args)...);
+    }
+  } catch (...) {
+    // Neither the size nor the hash counts the slot yet.
+    if (slot != nullptr) {
+      FillWithPoison(slot, slot + sizeof(T));
+    }
+    throw;
+  }
+
+  const size_t cur_size = GetCurSize() + 1;
+  if constexpr (HashPolicy::INCREMENTAL) {
+    SHUSH_STACK_TIME(HASH);
+    slots_hash_ += CalculateSlotHash(cur_size - 1) -
+                   CalculatePoisonSlotHash(cur_size - 1);
+  }
+  SHUSH_STACK_DBG(
+      "Placed the new element in cell " + std::to_string(cur_size - 1) +
+      ".");
+
+  SHUSH_STACK_COUNT(pushes, 1);
+  SetCurSizeVal(cur_size);
+  SHUSH_STACK_DBG(
+      "Pushing is complete. The new cur size is " +
+      std::to_string(cur_size) + ".");
+
+  CalculateAndPlaceHash();
+  SHUSH_STACK_EVENT(PUSHED, cur_size, GetBufSize());
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+T SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+            CanaryPolicy, PoisonPolicy>::Pop() {
+  SHUSH_STACK_DBG("Started popping the element...");
+
+  T res(std::move(PrepareTopRemoval()));
+  SHUSH_STACK_DBG("Got the value");
+  RemoveTop();
+
+  return res;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::Pop(T& out) {
+  SHUSH_STACK_DBG("Started popping the element into out...");
+
+  out = std::move(PrepareTopRemoval());
+  RemoveTop();
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::Drop() {
+  SHUSH_STACK_DBG("Started dropping the element...");
+
+  PrepareTopRemoval();
+  RemoveTop();
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+const T& SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::Top() {
+  return Peek(0);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+const T& SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+Peek(size_t ind) {
+  const size_t size = GetCurSize();
+  if (ind >= size) {
+    SHUSH_STACK_LOG("Oh no, the stack is not that deep! Aborting...");
+  }
+  MASSERT(ind < size, Errc::ELEMENT_OUT_OF_RANGE);
+
+  return *reinterpret_cast<const T*>(
+      buf_ + BUF_POS + (size - 1 - ind) * sizeof(T));
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+T& SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+             CanaryPolicy, PoisonPolicy>::
+PrepareTopRemoval() {
+  VERIFIED
+
+  const size_t size = GetCurSize();
+  if (size == 0) {
+    SHUSH_STACK_LOG("Oh no, the size of stack is already 0! Aborting...");
+  }
+  MASSERT(size != 0, Errc::POP_ON_0_SIZE);
+  SHUSH_STACK_COUNT(pops, 1);
+
+  // Before the element is moved from, while its bytes are still hashed.
+  if constexpr (HashPolicy::INCREMENTAL) {
+    SHUSH_STACK_TIME(HASH);
+    slots_hash_ -= CalculateSlotHash(size - 1) -
+                   CalculatePoisonSlotHash(size - 1);
+  }
+
+  return *reinterpret_cast<T*>(buf_ + BUF_POS + (size - 1) * sizeof(T));
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::RemoveTop() {
+  const size_t size = GetCurSize() - 1;
+  char*        pos  = buf_ + BUF_POS + size * sizeof(T);
+  reinterpret_cast<T*>(pos)->~T();
+  FillWithPoison(pos, pos + sizeof(T));
+
+  SetCurSizeVal(size);
+  SHUSH_STACK_DBG(
+      "Popping is complete. The new size is " + std::to_string(size));
+
+  CalculateAndPlaceHash();
+  SHUSH_STACK_EVENT(POPPED, size, GetBufSize());
+  ShrinkIfSparse();
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+PushN(const T* items, size_t n) {
+  VERIFIED
+  SHUSH_STACK_DBG("Pushing " + std::to_string(n) + " elements...");
+
+  const size_t cur_size = GetCurSize();
+  if (n > SIZE_MAX / sizeof(T) - cur_size) {
+    SHUSH_STACK_LOG("Oh no! The size would overflow! Aborting...");
+  }
+  MASSERT(n <= SIZE_MAX / sizeof(T) - cur_size, Errc::SIZE_OVERFLOW);
+
+  if (cur_size + n > GetBufSize()) {
+    SHUSH_STACK_DBG("The elements do not fit! Starting the reallocation...");
+    // items may be elements of this stack, which the reallocation moves.
+    const char*  slots  = buf_ + BUF_POS;
+    const char*  src    = reinterpret_cast<const char*>(items);
+    const bool   own    = slots <= src && src < slots + cur_size * sizeof(T);
+    const size_t offset = src - slots;
+    GrowToFit(cur_size + n);
+    if (own) {
+      items = reinterpret_cast<const T*>(buf_ + BUF_POS + offset);
+    }
+  }
+
+  char* dest = buf_ + BUF_POS + cur_size * sizeof(T);
+  if constexpr (std::is_trivially_copyable_v<T>) {
+    memcpy(dest, items, n * sizeof(T));
+  } else {
+    size_t built = 0;
+    try {
+      for (; built < n; ++built) {
+        new(dest + built * sizeof(T)) T(items[built]);
+      }
+    } catch (...) {
+      // Nothing is counted in the size or the hash yet, so only the slots
+      // have to be undone.
+      for (size_t i = 0; i < built; ++i) {
+        reinterpret_cast<T*>(dest + i * sizeof(T))->~T();
+      }
+      FillWithPoison(dest, dest + (built + 1) * sizeof(T));
+      throw;
+    }
+  }
+
+  if constexpr (HashPolicy::INCREMENTAL) {
+    SHUSH_STACK_TIME(HASH);
+    for (size_t i = cur_size; i < cur_size + n; ++i) {
+      slots_hash_ += CalculateSlotHash(i) - CalculatePoisonSlotHash(i);
+    }
+  }
+
+  SHUSH_STACK_COUNT(pushes, n);
+  SetCurSizeVal(cur_size + n);
+  CalculateAndPlaceHash();
+  SHUSH_STACK_EVENT(PUSHED, cur_size + n, GetBufSize());
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+template <class InputIt>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+PushRange(InputIt first, InputIt last) {
+  // Pointers may point into this stack, and PushN knows how to follow
+  // them through the reallocation.
+  if constexpr (std::is_convertible_v<InputIt, const T*>) {
+    PushN(first, last - first);
+    return;
+  }
+
+  VERIFIED
+  SHUSH_STACK_DBG("Pushing a range of elements...");
+
+  using Category = typename std::iterator_traits<InputIt>::iterator_category;
+  const size_t old_size = GetCurSize();
+  if constexpr (std::is_base_of_v<std::forward_iterator_tag, Category>) {
+    const size_t n = std::distance(first, last);
+    if (old_size + n > GetBufSize()) {
+      GrowToFit(old_size + n);
+    }
+  }
+
+  size_t cur_size = old_size;
+  for (; first != last; ++first, ++cur_size) {
+    if (cur_size == GetBufSize()) {
+      SetCurSizeVal(cur_size);
+      CalculateAndPlaceHash();
+      Grow();
+    }
+
+    char* slot = buf_ + BUF_POS + cur_size * sizeof(T);
+    try {
+      new(slot) T(*first);
+    } catch (...) {
+      // Puts the stack back as it was before the range. The watermark may
+      // have gone up with the growths, which only makes the next paranoid
+      // check look at the slots poisoned here.
+      for (size_t i = old_size; i < cur_size; ++i) {
+        if constexpr (HashPolicy::INCREMENTAL) {
+          slots_hash_ -= CalculateSlotHash(i) - CalculatePoisonSlotHash(i);
+        }
+        reinterpret_cast<T*>(buf_ + BUF_POS + i * sizeof(T))->~T();
+      }
+      FillWithPoison(buf_ + BUF_POS + old_size * sizeof(T),
+                     slot + sizeof(T));
+      SetCurSizeVal(old_size);
+      CalculateAndPlaceHash();
+      throw;
+    }
+
+    if constexpr (HashPolicy::INCREMENTAL) {
+      SHUSH_STACK_TIME(HASH);
+      slots_hash_ +=
+          CalculateSlotHash(cur_size) - CalculatePoisonSlotHash(cur_size);
+    }
+  }
+
+  SHUSH_STACK_COUNT(pushes, cur_size - old_size);
+  SetCurSizeVal(cur_size);
+  SHUSH_STACK_DBG(
+      "Pushed " + std::to_string(cur_size - old_size) + " elements.");
+
+  CalculateAndPlaceHash();
+  SHUSH_STACK_EVENT(PUSHED, cur_size, GetBufSize());
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+template <class Container>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Append(const Container& items) {
+  PushN(std::data(items), std::size(items));
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+PopN(T* out, size_t n) {
+  VERIFIED
+  SHUSH_STACK_DBG("Popping " + std::to_string(n) + " elements...");
+
+  const size_t size = GetCurSize();
+  if (n > size) {
+    SHUSH_STACK_LOG("Oh no, there are not that many elements! Aborting...");
+  }
+  MASSERT(n <= size, Errc::POP_MORE_THAN_CUR_SIZE);
+  SHUSH_STACK_COUNT(pops, n);
+
+  const size_t new_size = size - n;
+  char*        src      = buf_ + BUF_POS + new_size * sizeof(T);
+  if constexpr (HashPolicy::INCREMENTAL) {
+    SHUSH_STACK_TIME(HASH);
+    for (size_t i = new_size; i < size; ++i) {
+      slots_hash_ -= CalculateSlotHash(i) - CalculatePoisonSlotHash(i);
+    }
+  }
+
+  if constexpr (std::is_trivially_copyable_v<T>) {
+    memcpy(out, src, n * sizeof(T));
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      T* item = reinterpret_cast<T*>(src + i * sizeof(T));
+      out[i] = std::move(*item);
+      item->~T();
+    }
+  }
+
+  FillWithPoison(src, src + n * sizeof(T));
+
+  SetCurSizeVal(new_size);
+  SHUSH_STACK_DBG(
+      "Popping is complete. The new size is " + std::to_string(new_size));
+
+  CalculateAndPlaceHash();
+  SHUSH_STACK_EVENT(POPPED, new_size, GetBufSize());
+  ShrinkIfSparse();
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+typename SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::CheckpointToken
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::Checkpoint() {
+  VERIFIED
+  const size_t depth = GetCurSize();
+  SHUSH_STACK_DBG("Checkpoint at depth " + std::to_string(depth) + ".");
+
+  return {depth, GetBufSize(), CalculateCheckpointHash(depth), buf_};
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Rollback(const CheckpointToken& checkpoint) {
+  VERIFIED
+  const size_t size  = GetCurSize();
+  const size_t depth = checkpoint.depth;
+  SHUSH_STACK_DBG(
+      "Rolling back from depth " + std::to_string(size) + " to " +
+      std::to_string(depth) + "...");
+
+  if (depth > size) {
+    SHUSH_STACK_LOG(
+        "Oh no, the stack was popped below the checkpoint! Aborting...");
+  }
+  MASSERT(depth <= size, Errc::CHECKPOINT_MISMATCH);
+
+  const uint64_t hash = CalculateCheckpointHash(depth);
+  // Moved elements may have other bytes, so they can only be compared in
+  // the buffer they were checkpointed in.
+  if (std::is_trivially_copyable_v<T> || checkpoint.buf == buf_) {
+    uint64_t expected_hash = checkpoint.slots_hash;
+    // The capacity may have changed since, which adds or removes poisoned
+    // slots over the checkpoint.
+    if constexpr (HashPolicy::INCREMENTAL) {
+      const size_t buf_size = GetBufSize();
+      if (buf_size > checkpoint.buf_size) {
+        expected_hash +=
+            CalculatePoisonSlotsHash(checkpoint.buf_size, buf_size);
+      } else {
+        expected_hash -=
+            CalculatePoisonSlotsHash(buf_size, checkpoint.buf_size);
+      }
+    }
+
+    if (hash != expected_hash) {
+      SHUSH_STACK_LOG(
+          "Oh no, the elements under the checkpoint have changed! Aborting...");
+    }
+    MASSERT(hash == expected_hash, Errc::CHECKPOINT_MISMATCH);
+  }
+
+  char* from = buf_ + BUF_POS + depth * sizeof(T);
+  if constexpr (!std::is_trivially_destructible_v<T>) {
+    for (size_t i = depth; i < size; ++i) {
+      reinterpret_cast<T*>(buf_ + BUF_POS + i * sizeof(T))->~T();
+    }
+  }
+  FillWithPoison(from, from + (size - depth) * sizeof(T));
+  if constexpr (HashPolicy::INCREMENTAL) {
+    slots_hash_ = hash;
+  }
+
+  SHUSH_STACK_COUNT(pops, size - depth);
+  SetCurSizeVal(depth);
+  SHUSH_STACK_DBG(
+      "Rollback is complete. The new size is " + std::to_string(depth));
+
+  CalculateAndPlaceHash();
+  SHUSH_STACK_EVENT(POPPED, depth, GetBufSize());
+  ShrinkIfSparse();
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Ok(bool full) {
+  if (!full && VerifyPolicy::LEVEL == VerifyLevel::NONE) {
+    return;
+  }
+  SHUSH_STACK_DBG("Started verification procedure...");
+  SHUSH_STACK_COUNT(verifications, 1);
+  SHUSH_STACK_TIME(VERIFY);
+
+  MASSERT(this != nullptr, Errc::THIS_PTR_IS_NULLPTR);
+  // The sizes say where everything else is, so they are checked first.
+  MASSERT(GetBufSize() <= GetCapacity(),
+          Errc::BUF_SIZE_EXCEEDS_ALLOCATION);
+  MASSERT(GetCurSize() <= GetBufSize(), Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+  if constexpr (CanaryPolicy::ENABLED) {
+    // Guard pages catch overruns when they happen.
+    if (full || !Allocator::HARDWARE_GUARDED) {
+      SHUSH_STACK_TIME(CANARIES);
+      MASSERT(GetFirstCanary() == CANARY_VALUE,
+              Errc::CORRUPTED_FIRST_CANARY);
+      MASSERT(GetSecondCanary() == CANARY_VALUE,
+              Errc::CORRUPTED_SECOND_CANARY);
+    }
+  }
+
+  const bool paranoid = full || VerifyPolicy::LEVEL == VerifyLevel::PARANOID;
+  if (!paranoid && VerifyPolicy::LEVEL == VerifyLevel::CANARIES) {
+    return;
+  }
+
+  if constexpr (HashPolicy::ENABLED) {
+    MASSERT(GetHashValue() == CalculateHash(), Errc::HASH_NOT_THE_SAME);
+    if (HashPolicy::INCREMENTAL && paranoid) {
+      MASSERT(GetHashValue() ==
+                  (full ? CalculateFullHash() : CalculateWatermarkHash()),
+              Errc::HASH_NOT_THE_SAME);
+    }
+  }
+
+  if (!paranoid) {
+    if constexpr (PoisonPolicy::ENABLED &&
+                  VerifyPolicy::LEVEL == VerifyLevel::SAMPLED) {
+      if (++verify_calls_ % VerifyPolicy::PERIOD == 0) {
+        VerifyPoisonWindow();
+      }
+    }
+    return;
+  }
+
+  if constexpr (PoisonPolicy::ENABLED) {
+    const size_t cur_size_bytes = BUF_POS + GetCurSize() * sizeof(T);
+    if constexpr (LogPolicy::DBG) {
+      for (size_t i = BUF_POS; i < cur_size_bytes; i += sizeof(T)) {
+        if (IsPoison(*reinterpret_cast<T*>(buf_ + i))) {
+          SHUSH_STACK_DBG(
+              "WARNING: element " +
+              std::to_string((i - BUF_POS) / sizeof(T)) +
+              " is equal to poison value");
+        }
+      }
+    }
+
+    // Past the watermark the cells were poison at the last paranoid check,
+    // and the stack has not written them since.
+    SHUSH_STACK_TIME(POISON);
+    const char* tail_end =
+        buf_ + (full ? GetAllBufferSize() - CANARY_SIZE
+                     : BUF_POS + dirty_end_ * sizeof(T));
+    MASSERT(
+        poison::FindNonPoison(buf_ + cur_size_bytes, tail_end) == tail_end,
+        Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+    if constexpr (BUF_POS != HEADER_SIZE) {
+      MASSERT(poison::FindNonPoison(buf_ + HEADER_SIZE, buf_ + BUF_POS) ==
+                  buf_ + BUF_POS,
+              Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+    }
+  }
+
+  MarkClean(full);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+MarkClean(bool full) {
+  const size_t cur_size = GetCurSize();
+  if constexpr (HashPolicy::INCREMENTAL) {
+    clean_hash_ =
+        full ? CalculatePoisonSlotsHash(cur_size, GetBufSize())
+             : clean_hash_ + CalculatePoisonSlotsHash(cur_size, dirty_end_);
+  }
+  dirty_end_ = cur_size;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+stats::Stats SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                       CanaryPolicy, PoisonPolicy>::
+GetStats() {
+#if SHUSH_STACK_STATS
+  return stats_.stats;
+#else
+  return {};
+#endif
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+stats::Stats SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                       CanaryPolicy, PoisonPolicy>::
+GetTypeStats() {
+#if SHUSH_STACK_STATS
+  std::lock_guard<std::mutex> lock(retired_stats_mutex);
+  return retired_stats;
+#else
+  return {};
+#endif
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+LogStats() {
+  auto write = [this](logs::Logger& logger) {
+    stats::Log(logger, "Stats of the stack", GetStats());
+    stats::Log(logger, "Stats of the destroyed stacks of its type",
+               GetTypeStats());
+  };
+
+  if constexpr (LogPolicy::BINARY) {
+    logs::Logger logger("shush-stack-" + std::to_string(logger_.GetId()));
+    write(logger);
+  } else {
+    write(logger_);
+  }
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Reopen(size_t bytes) {
+  // Nothing in the header can be trusted before the sizes are checked
+  // against the file.
+  MASSERT(bytes >= BUF_POS + CANARY_SIZE, Errc::MAPPED_FILE_MISMATCH);
+  MASSERT(GetBufSize() <= (bytes - BUF_POS - CANARY_SIZE) / sizeof(T),
+          Errc::MAPPED_FILE_MISMATCH);
+  MASSERT(GetCurSize() <= GetBufSize(), Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+
+  if constexpr (HashPolicy::ENABLED) {
+    if (!IsHashConsistent()) {
+      // Push writes the element, then the size, then the hash. A crash
+      // between them leaves the old hash with a poisoned cell overwritten,
+      // and maybe with the size already bumped. Both are rolled back.
+      const size_t cur_size = GetCurSize();
+      char         saved[sizeof(T)];
+      bool         recovered = false;
+
+      for (size_t rolled_back = 0; rolled_back <= 1; ++rolled_back) {
+        const size_t ind = cur_size - rolled_back;
+        if (rolled_back > cur_size || ind >= GetBufSize()) {
+          continue;
+        }
+
+        char* cell = buf_ + BUF_POS + ind * sizeof(T);
+        memcpy(saved, cell, sizeof(T));
+        FillWithPoison(cell, cell + sizeof(T));
+        SetCurSizeVal(ind);
+        if (IsHashConsistent()) {
+          SHUSH_STACK_LOG(
+              "Rolled back a torn push of element " + std::to_string(ind) +
+              ".");
+          recovered = true;
+          break;
+        }
+
+        memcpy(cell, saved, sizeof(T));
+        SetCurSizeVal(cur_size);
+      }
+
+      if (!recovered) {
+        SHUSH_STACK_LOG("Oh no, the reopened buffer is broken! Aborting...");
+      }
+      MASSERT(recovered, Errc::HASH_NOT_THE_SAME);
+      allocator_.Commit(buf_, GetAllBufferSize());
+    }
+  }
+
+  Ok(true);
+
+  // The file is grown before the header, so a crash in between leaves it
+  // longer than the buffer.
+  const size_t all_size = GetAllBufferSize();
+  if (all_size < bytes) {
+    SHUSH_STACK_LOG(
+        "The file is " + std::to_string(bytes - all_size) +
+        " bytes longer than the buffer, truncating it.");
+    buf_      = allocator_.Reallocate(buf_, bytes, all_size);
+    all_size_ = all_size;
+  }
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+bool SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+IsHashConsistent() {
+  if constexpr (HashPolicy::INCREMENTAL) {
+    slots_hash_ = CalculateSlotsHash(0, GetCurSize()) +
+                  CalculateUnusedSlotsHash(GetCurSize(), GetBufSize());
+  }
+
+  return GetHashValue() == CalculateHash();
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+VerifyPoisonWindow() {
+  SHUSH_STACK_TIME(POISON);
+  const size_t cur_size = GetCurSize();
+  const size_t buf_size = GetBufSize();
+  if (verify_cursor_ < cur_size || verify_cursor_ >= buf_size) {
+    verify_cursor_ = cur_size;
+  }
+
+  const size_t window_end = std::min(
+      buf_size, verify_cursor_ + VerifyPolicy::WINDOW);
+  SHUSH_STACK_DBG(
+      "Checking cells from " + std::to_string(verify_cursor_) + " to " +
+      std::to_string(window_end) + " for poison.");
+
+  const char* window_end_ptr = buf_ + BUF_POS + window_end * sizeof(T);
+  MASSERT(
+      poison::FindNonPoison(
+          buf_ + BUF_POS + verify_cursor_ * sizeof(T), window_end_ptr) ==
+      window_end_ptr,
+      Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+
+  verify_cursor_ = window_end;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+OnGuardFault(void* owner, const void* address) {
+  static_cast<SafeStack*>(owner)->ReportGuardFault(address);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+ReportGuardFault(const void* address) {
+#if defined(__unix__)
+  char  buffer[DUMP_MESSAGE_MAX_CHAR_COUNT];
+  char* message =
+      GetDumpMessage(Errc::GUARD_PAGE_HIT, buffer, sizeof(buffer));
+  char  fault[64];
+  DumpWriter(fault, sizeof(fault))
+      .Write("\nFaulting address: ")
+      .WriteUnsigned(reinterpret_cast<size_t>(address)).Write(".\n");
+
+  for (const char* part : {static_cast<const char*>(fault),
+                           static_cast<const char*>(message)}) {
+    for (size_t left = strlen(part); left != 0;) {
+      const ssize_t written = write(STDERR_FILENO, part, left);
+      if (written <= 0) {
+        break;
+      }
+      part += written;
+      left -= written;
+    }
+  }
+#else
+  (void) address;
+#endif
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+char* SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                CanaryPolicy, PoisonPolicy>::
+GetDumpMessage(int error_code) {
+  if (buf_ != nullptr) {
+    SHUSH_STACK_EVENT(ERROR, GetCurSize(), GetBufSize(), error_code);
+  }
+  return GetDumpMessage(
+      error_code, dump_msg_buffer, DUMP_MESSAGE_MAX_CHAR_COUNT);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+char* SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                CanaryPolicy, PoisonPolicy>::
+GetDumpMessage(int error_code, char* buffer, size_t size) {
+  DumpWriter out(buffer, size);
+  out.Write("\n- - - - - - DUMP MESSAGE FROM SHUSH::STACK- - - - - - \n");
+
+  out.Write("this address: ").WriteUnsigned(reinterpret_cast<size_t>(this))
+     .Write(".\n");
+  out.Write("Error code == ").WriteSigned(error_code)
+     .Write(" (").Write(GetErrorName(error_code)).Write(")\n");
+  out.Write("Hash policy: ").Write(HashPolicy::NAME)
+     .Write(" (").Write(HashPolicy::Function::NAME).Write(")")
+     .Write(", verification policy: ").Write(VerifyPolicy::NAME)
+     .Write(", log policy: ").Write(LogPolicy::NAME)
+     .Write(", allocator: ").Write(Allocator::NAME)
+     .Write(", canaries: ").Write(CanaryPolicy::NAME)
+     .Write(", poison: ").Write(PoisonPolicy::NAME).Write("\n\n");
+
+  out.Write("Byte representation of the header:\n")
+     .WriteBytes(buf_, HEADER_SIZE).Write("\n\n");
+
+  // Sizes may be broken too, so nothing past the allocated buffer is read
+  // because of them.
+  const size_t buf_size    = GetBufSize();
+  const size_t capacity    = GetCapacity();
+  const bool   buf_size_ok = buf_size <= capacity;
+  const bool   cur_size_ok = GetCurSize() <= buf_size;
+  const size_t cur_size    = std::min(GetCurSize(), buf_size);
+
+  out.Write("Detailed:\n");
+  if constexpr (CanaryPolicy::ENABLED) {
+    out.WriteGoodBad(GetFirstCanary() == CANARY_VALUE)
+       .Write("[CANARY] == ").WriteUnsigned(GetFirstCanary()).Write("\n");
+  }
+  if constexpr (HashPolicy::ENABLED) {
+    if (buf_size_ok && cur_size_ok) {
+      const uint64_t hash = CalculateHash();
+      out.WriteGoodBad(hash == GetHashValue())
+         .Write("[HASH] == ").WriteUnsigned(hash).Write("\n");
+    } else {
+      out.Write("[HASH] == ").WriteUnsigned(GetHashValue())
+         .Write(" (stored, not recomputed)\n");
+    }
+  }
+  out.WriteGoodBad(cur_size_ok)
+     .Write("[CUR_SIZE] == ").WriteUnsigned(GetCurSize()).Write("\n");
+  out.WriteGoodBad(buf_size_ok && cur_size_ok)
+     .Write("[BUF_SIZE] == ").WriteUnsigned(buf_size).Write("\n");
+
+  if (!buf_size_ok) {
+    out.Write("The buffer was allocated for ").WriteUnsigned(capacity)
+       .Write(" elements, so the elements and the second canary are not "
+              "shown.\n");
+    out.Write("\n- - - -END OF DUMP MESSAGE FROM SHUSH::STACK- - - - - - \n");
+
+    return out.GetMessage();
+  }
+
+  for (size_t i = 0; i < cur_size; ++i) {
+    if (i == DUMP_ELEMENTS_SHOWN && cur_size > 2 * DUMP_ELEMENTS_SHOWN) {
+      out.Write("... ").WriteUnsigned(cur_size - 2 * DUMP_ELEMENTS_SHOWN)
+         .Write(" elements skipped ...\n");
+      i = cur_size - DUMP_ELEMENTS_SHOWN;
+    }
+
+    const T& item =
+        *reinterpret_cast<const T*>(buf_ + BUF_POS + i * sizeof(T));
+    out.Write(IsPoison(item) ? "(WARNING) " : "(GOOD) ")
+       .Write("[").WriteUnsigned(i).Write("] == ").WriteValue(item)
+       .Write("\n");
+  }
+
+  // Unused cells are listed only if they are not poison.
+  if constexpr (PoisonPolicy::ENABLED) {
+    const char* slots      = buf_ + BUF_POS;
+    const char* unused_end = slots + buf_size * sizeof(T);
+    size_t      violations = 0;
+    for (const char* cell = slots + cur_size * sizeof(T); ;) {
+      cell = poison::FindNonPoison(cell, unused_end);
+      if (cell == unused_end) {
+        break;
+      }
+
+      const size_t ind = (cell - slots) / sizeof(T);
+      if (++violations <= DUMP_VIOLATIONS_SHOWN) {
+        out.WriteGoodBad(false).Write("[").WriteUnsigned(ind).Write("] == ")
+           .WriteValue(*reinterpret_cast<const T*>(slots + ind * sizeof(T)))
+           .Write("\n");
+      }
+      cell = slots + (ind + 1) * sizeof(T);
+    }
+    out.WriteGoodBad(violations == 0)
+       .Write("[").WriteUnsigned(cur_size).Write(", ")
+       .WriteUnsigned(buf_size).Write(") are unused, ")
+       .WriteUnsigned(violations).Write(" of them are not poison\n");
+  }
+
+  if constexpr (CanaryPolicy::ENABLED) {
+    out.WriteGoodBad(GetSecondCanary() == CANARY_VALUE)
+       .Write("[CANARY] == ").WriteUnsigned(GetSecondCanary()).Write("\n");
+  }
+
+  out.Write("\n- - - -END OF DUMP MESSAGE FROM SHUSH::STACK- - - - - - \n");
+
+  return out.GetMessage();
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+bool SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+IsPoison(const T& val) {
+  if constexpr (!PoisonPolicy::ENABLED) {
+    return false;
+  }
+
+  const char* bytes = reinterpret_cast<const char*>(&val);
+  return poison::FindNonPoison(bytes, bytes + sizeof(T)) == bytes + sizeof(T);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+FillCanaries(size_t all_buffer_size) {
+  if constexpr (!CanaryPolicy::ENABLED) {
+    return;
+  }
+  SHUSH_STACK_TIME(CANARIES);
+
+  memcpy(buf_, &CANARY_VALUE, CANARY_SIZE);
+  memcpy(
+      buf_ + all_buffer_size - CANARY_SIZE,
+      &CANARY_VALUE, CANARY_SIZE);
+
+  SHUSH_STACK_DBG(
+      "Filled canaries inside " +
+      std::to_string(all_buffer_size) + " bytes.");
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+SetCurSizeVal(size_t cur_size) {
+  memcpy(buf_ + CUR_SIZE_POS, &cur_size, CUR_SIZE_SIZE);
+  // The stack writes only the slots below the size.
+  if (cur_size > dirty_end_) {
+    if constexpr (HashPolicy::INCREMENTAL) {
+      clean_hash_ -= CalculatePoisonSlotsHash(dirty_end_, cur_size);
+    }
+    dirty_end_ = cur_size;
+  }
+
+  SHUSH_STACK_DBG(
+      "Set current size of the stack to " +
+      std::to_string(cur_size) + ".");
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+SetBufferSizeVal(size_t buffer_size) {
+  memcpy(buf_ + BUF_SIZE_POS, &buffer_size, BUF_SIZE_SIZE);
+
+  SHUSH_STACK_DBG(
+      "Set buffer size value of the stack to " +
+      std::to_string(buffer_size) + ".");
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+FillWithPoison(char* from, char* to) {
+  if constexpr (!PoisonPolicy::ENABLED) {
+    return;
+  }
+  SHUSH_STACK_TIME(POISON);
+
+  poison::Fill(from, to);
+
+  SHUSH_STACK_DBG(
+      "Filled addresses from " +
+      std::to_string(reinterpret_cast<size_t>(from)) + " to " +
+      std::to_string(reinterpret_cast<size_t>(to)) + " with Poison.");
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+CalculateAndPlaceHash(
+    const size_t all_buffer_size) {
+  if constexpr (HashPolicy::ENABLED) {
+    uint64_t hash = CalculateHash(all_buffer_size);
+    memcpy(buf_ + HASH_POS, &hash, HASH_SIZE);
+
+    SHUSH_STACK_DBG("Placed hash.");
+  }
+
+  // Every mutation ends here, with the hash as its commit point.
+  if constexpr (Allocator::PERSISTENT) {
+    allocator_.Commit(buf_, all_buffer_size);
+  }
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+CalculateAndPlaceHash() {
+  CalculateAndPlaceHash(GetAllBufferSize());
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateHash(size_t all_buffer_size) {
+  uint64_t hash = 0;
+  if constexpr (!HashPolicy::ENABLED) {
+    return hash;
+  }
+  SHUSH_STACK_COUNT(hash_computations, 1);
+  SHUSH_STACK_TIME(HASH);
+
+  if constexpr (HashPolicy::INCREMENTAL) {
+    hash = CalculateHeaderHash() + slots_hash_;
+  } else if constexpr (PoisonPolicy::ENABLED) {
+    SHUSH_STACK_COUNT(bytes_hashed, all_buffer_size - HASH_SIZE);
+    hash =
+        CalculateOwnerHash() +
+        HashBytes(buf_, HASH_POS) +
+        HashBytes(buf_ + HASH_POS + HASH_SIZE,
+                  all_buffer_size - HASH_SIZE - HASH_POS);
+  } else {
+    // Unused cells hold whatever was there, so leave them out.
+    SHUSH_STACK_COUNT(bytes_hashed, GetCurSize() * sizeof(T));
+    hash =
+        CalculateHeaderHash() +
+        HashBytes(buf_ + BUF_POS, GetCurSize() * sizeof(T));
+  }
+
+  SHUSH_STACK_DBG("Calculated hash. Its value: " + std::to_string(hash));
+
+  return hash;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateHash() {
+  return CalculateHash(GetAllBufferSize());
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateFullHash() {
+  if constexpr (HashPolicy::INCREMENTAL) {
+    return CalculateHeaderHash() + CalculateSlotsHash(0, GetCurSize()) +
+           CalculateUnusedSlotsHash(GetCurSize(), GetBufSize());
+  } else {
+    return CalculateHash();
+  }
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateWatermarkHash() {
+  return CalculateHeaderHash() + CalculateSlotsHash(0, GetCurSize()) +
+         CalculateUnusedSlotsHash(GetCurSize(), dirty_end_) + clean_hash_;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateHeaderHash() {
+  SHUSH_STACK_COUNT(bytes_hashed, HEADER_SIZE - HASH_SIZE + CANARY_SIZE);
+  SHUSH_STACK_TIME(HASH);
+
+  return
+      CalculateOwnerHash() +
+      HashBytes(buf_, HASH_POS) +
+      HashBytes(buf_ + CUR_SIZE_POS, HEADER_SIZE - CUR_SIZE_POS) +
+      HashBytes(buf_ + GetAllBufferSize() - CANARY_SIZE, CANARY_SIZE);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateCheckpointHash(size_t depth) {
+  if constexpr (HashPolicy::INCREMENTAL) {
+    const size_t size = GetCurSize();
+    SHUSH_STACK_TIME(HASH);
+    return slots_hash_ - CalculateSlotsHash(depth, size) +
+           CalculatePoisonSlotsHash(depth, size);
+  } else if constexpr (HashPolicy::ENABLED) {
+    return CalculateSlotsHash(0, depth);
+  }
+
+  return 0;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateOwnerHash() {
+  if constexpr (Allocator::PERSISTENT) {
+    return 0;
+  }
+
+  return MixHash(reinterpret_cast<size_t>(this));
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateSlotHash(size_t ind) {
+  // Timed by the callers, a single slot is too cheap for it.
+  SHUSH_STACK_COUNT(bytes_hashed, sizeof(T));
+
+  const uint64_t bytes_hash =
+      HashBytes(buf_ + BUF_POS + ind * sizeof(T), sizeof(T));
+
+  return MixHash(bytes_hash + ind * SLOT_INDEX_MULTIPLIER);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculatePoisonSlotHash(size_t ind) {
+  if constexpr (!PoisonPolicy::ENABLED) {
+    return 0;
+  }
+
+  static const uint64_t poison_bytes_hash = [] {
+    char poison_bytes[sizeof(T)];
+    memset(poison_bytes, POISON_VALUE, sizeof(T));
+    return HashBytes(poison_bytes, sizeof(T));
+  }();
+
+  return MixHash(poison_bytes_hash + ind * SLOT_INDEX_MULTIPLIER);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateSlotsHash(size_t from, size_t to) {
+  SHUSH_STACK_TIME(HASH);
+  uint64_t hash = 0;
+  for (size_t i = from; i < to; ++i) {
+    hash += CalculateSlotHash(i);
+  }
+
+  return hash;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculateUnusedSlotsHash(size_t from, size_t to) {
+  if constexpr (!PoisonPolicy::ENABLED) {
+    return 0;
+  }
+
+  return CalculateSlotsHash(from, to);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+CalculatePoisonSlotsHash(size_t from, size_t to) {
+  uint64_t hash = 0;
+  for (size_t i = from; i < to; ++i) {
+    hash += CalculatePoisonSlotHash(i);
+  }
+
+  return hash;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+T SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+            CanaryPolicy, PoisonPolicy>::
+GetElement(size_t ind) {
+  return *reinterpret_cast<T*>(buf_ + BUF_POS + ind * sizeof(T));
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+SetGrowthPolicy(const GrowthPolicy& growth) {
+  growth_ = growth;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::Grow() {
+  Reallocate(growth_.GetNextSize(GetBufSize(), GetBufSize() + 1));
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+GrowToFit(size_t min_buf_size) {
+  Reallocate(growth_.GetNextSize(GetBufSize(), min_buf_size));
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+ShrinkIfSparse() {
+  // A bounded buffer is inside the stack, shrinking it frees nothing.
+  if constexpr (Allocator::MAX_BYTES != SIZE_MAX) {
+    return;
+  }
+
+  const size_t buf_size = GetBufSize();
+  const size_t new_size = growth_.GetShrunkSize(buf_size, GetCurSize());
+  if (new_size < buf_size) {
+    SHUSH_STACK_DBG(
+        "The stack is mostly empty! Shrinking it to " +
+        std::to_string(new_size) + " elements...");
+    Reallocate(new_size);
+  }
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Reserve(size_t n) {
+  if (n > GetBufSize()) {
+    Reallocate(n);
+  }
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+ShrinkToFit() {
+  if constexpr (Allocator::MAX_BYTES != SIZE_MAX) {
+    return;
+  }
+
+  if (GetCurSize() < GetBufSize()) {
+    Reallocate(GetCurSize());
+  }
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+void SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+               CanaryPolicy, PoisonPolicy>::
+Reallocate(size_t new_buf_size) {
+  VERIFIED
+  const size_t all_size     = all_size_;
+  const size_t buf_t_size   = GetCapacity();
+  const size_t cur_size     = std::min(GetCurSize(), buf_t_size);
+  const size_t new_all_size =
+      all_size + (new_buf_size - buf_t_size) * sizeof(T);
+
+  if (new_all_size > Allocator::MAX_BYTES) {
+    SHUSH_STACK_LOG(
+        "Oh no! The buffer cannot grow that much in this stack! Aborting...");
+  }
+  MASSERT(new_all_size <= Allocator::MAX_BYTES,
+          Errc::REALLOCATION_IN_STATIC_STACK);
+
+  SHUSH_STACK_DBG(
+      "Started reallocating stack. Initial all_size = " +
+      std::to_string(all_size) + ", new_all_size = " +
+      std::to_string(new_all_size));
+
+  SHUSH_STACK_COUNT(reallocations, 1);
+
+  if (new_buf_size < buf_t_size) {
+    if constexpr (HashPolicy::INCREMENTAL &&
+                  std::is_trivially_copyable_v<T>) {
+      slots_hash_ -= CalculateUnusedSlotsHash(new_buf_size, buf_t_size);
+    }
+    // A poisoned allocator may hand the cut off part out again.
+    if constexpr (Allocator::POISONED) {
+      poison::Fill(buf_ + new_all_size, buf_ + all_size);
+    }
+  }
+
+  // The poisoned part of the buffer that survives the reallocation.
+  size_t poisoned_end = BUF_POS + cur_size * sizeof(T);
+  if constexpr (std::is_trivially_copyable_v<T>) {
+    SHUSH_STACK_DBG("Resizing the buffer in place...");
+    [[maybe_unused]] const char* old_buf = buf_;
+    buf_ = allocator_.Reallocate(buf_, all_size, new_all_size, BUF_ALIGNMENT);
+    all_size_ = new_all_size;
+    poisoned_end = std::max(poisoned_end, all_size - CANARY_SIZE);
+    SHUSH_STACK_COUNT(bytes_moved, buf_ != old_buf ? all_size : 0);
+  } else {
+    char* new_buf = allocator_.Allocate(new_all_size, BUF_ALIGNMENT);
+    if constexpr (!Allocator::POISONED) {
+      FillWithPoison(new_buf + HEADER_SIZE, new_buf + BUF_POS);
+    }
+
+    SHUSH_STACK_DBG("Now starting to call constructors in allocated space.");
+    for (size_t i = 0; i < cur_size; ++i) {
+      const size_t pos  = BUF_POS + i * sizeof(T);
+      T*           item = reinterpret_cast<T*>(buf_ + pos);
+      new(new_buf + pos) T(std::move(*item));
+      item->~T();
+    }
+    SHUSH_STACK_COUNT(bytes_moved, cur_size * sizeof(T));
+
+    SHUSH_STACK_DBG("Deleting the old buffer...");
+    allocator_.Deallocate(buf_, all_size, BUF_ALIGNMENT);
+    buf_      = new_buf;
+    all_size_ = new_all_size;
+  }
+
+  // A poisoned allocator has poisoned everything past the old contents,
+  // so only the old canary is left, if the contents were kept.
+  size_t poison_end = new_all_size - CANARY_SIZE;
+  if constexpr (Allocator::POISONED) {
+    poison_end = std::is_trivially_copyable_v<T>
+                     ? std::min(poison_end, all_size)
+                     : poisoned_end;
+  }
+  poisoned_end = std::min(poisoned_end, poison_end);
+
+  SetBufferSizeVal(new_buf_size);
+  SetCurSizeVal(cur_size);
+  FillCanaries(new_all_size);
+  FillWithPoison(buf_ + poisoned_end, buf_ + poison_end);
+  if constexpr (HashPolicy::INCREMENTAL) {
+    if constexpr (std::is_trivially_copyable_v<T>) {
+      slots_hash_ += CalculateUnusedSlotsHash(buf_t_size, new_buf_size);
+    } else {
+      // A moved object may have other bytes, e.g. if it points into itself.
+      slots_hash_ = CalculateSlotsHash(0, cur_size) +
+                    CalculateUnusedSlotsHash(cur_size, new_buf_size);
+    }
+  }
+
+  // New slots are poisoned and unwritten, so they are above the watermark.
+  if constexpr (HashPolicy::INCREMENTAL) {
+    if (new_buf_size > buf_t_size) {
+      clean_hash_ += CalculatePoisonSlotsHash(buf_t_size, new_buf_size);
+    } else {
+      clean_hash_ -= CalculatePoisonSlotsHash(
+          std::max(dirty_end_, new_buf_size), buf_t_size);
+    }
+  }
+  dirty_end_ = std::min(dirty_end_, new_buf_size);
+
+  SHUSH_STACK_DBG("Reallocation completed.");
+
+  CalculateAndPlaceHash(new_all_size);
+  SHUSH_STACK_EVENT(REALLOCATED, cur_size, new_buf_size);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+GetFirstCanary() {
+  if constexpr (!CanaryPolicy::ENABLED) {
+    return CANARY_VALUE;
+  }
+
+  return *reinterpret_cast<uint64_t*>(buf_);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+GetSecondCanary() {
+  if constexpr (!CanaryPolicy::ENABLED) {
+    return CANARY_VALUE;
+  }
+
+  return *reinterpret_cast<uint64_t*>(buf_ + GetAllBufferSize()
+                                      - CANARY_SIZE);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+size_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                 CanaryPolicy, PoisonPolicy>::
+GetCurSize() {
+  return *reinterpret_cast<size_t*>(buf_ + CUR_SIZE_POS);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+size_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                 CanaryPolicy, PoisonPolicy>::
+GetBufSize() {
+  return *reinterpret_cast<size_t*>(buf_ + BUF_SIZE_POS);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+uint64_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                   CanaryPolicy, PoisonPolicy>::
+GetHashValue() {
+  if constexpr (!HashPolicy::ENABLED) {
+    return 0;
+  }
+
+  return *reinterpret_cast<uint64_t*>(buf_ + HASH_POS);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+size_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                 CanaryPolicy, PoisonPolicy>::
+GetAllBufferSize() {
+  return BUF_POS + GetBufSize() * sizeof(T) + CANARY_SIZE;
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+size_t SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+                 CanaryPolicy, PoisonPolicy>::
+GetCapacity() {
+  return (all_size_ - BUF_POS - CANARY_SIZE) / sizeof(T);
+}
+
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+std::atomic<size_t>
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::stacks_count(0);
+
+#if SHUSH_STACK_STATS
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+stats::Stats
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::retired_stats;
+
+template <class T, class HashPolicy, class VerifyPolicy, class LogPolicy,
+          class Allocator, class CanaryPolicy, class PoisonPolicy>
+std::mutex
+SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy, Allocator,
+          CanaryPolicy, PoisonPolicy>::retired_stats_mutex;
+#endif
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - STATIC- - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Bytes of the buffer of a stack with the given layers that holds size
+ * elements.
+ */
+template <class T, class HashPolicy, class CanaryPolicy>
+constexpr size_t GetStackBufferBytes(size_t size) {
+  using Layout = SafeStack<T, HashPolicy, VerifyNone, LogNone, HeapAllocator,
+                           CanaryPolicy, NoPoison>;
+  return Layout::BUF_POS + size * sizeof(T) + Layout::CANARY_SIZE;
+}
+
+/**
+ * Keeps ReservedSize elements inside the object and never allocates.
+ * Pushing more fails with REALLOCATION_IN_STATIC_STACK.
+ */
+template <class T, size_t ReservedSize = DEFAULT_RESERVED_SIZE,
+          class HashPolicy = FullHash, class VerifyPolicy = VerifyParanoid,
+          class LogPolicy = LogDefault, class CanaryPolicy = WithCanaries,
+          class PoisonPolicy = WithPoison>
+class SafeStackStatic
+    : public SafeStack<
+          T, HashPolicy, VerifyPolicy, LogPolicy,
+          InlineAllocator<
+              GetStackBufferBytes<T, HashPolicy, CanaryPolicy>(ReservedSize),
+              void, GetBufAlignment<T>()>,
+          CanaryPolicy, PoisonPolicy> {
+  public:
+  SafeStackStatic();
+
+  SafeStackStatic(const SafeStackStatic& stack)            = delete;
+  SafeStackStatic(SafeStackStatic&& stack)                 = delete;
+  SafeStackStatic& operator=(const SafeStackStatic& stack) = delete;
+  SafeStackStatic& operator=(SafeStackStatic&& stack)      = delete;
+};
+
+
+template <class T, size_t ReservedSize, class HashPolicy,
+          class VerifyPolicy, class LogPolicy, class CanaryPolicy,
+          class PoisonPolicy>
+SafeStackStatic<T, ReservedSize, HashPolicy, VerifyPolicy, LogPolicy,
+                CanaryPolicy, PoisonPolicy>::
+SafeStackStatic()
+  : SafeStackStatic::SafeStack(ReservedSize) {
+  SHUSH_STACK_DBG("The reserved size is " + std::to_string(ReservedSize));
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - SMALL - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Keeps up to InlineSize elements inside the object and moves them to a
+ * buffer from Fallback when it overflows, so small stacks never allocate
+ * and deep ones still work. The elements stay in the heap buffer after
+ * that, even if the stack gets small again.
+ */
+template <class T, size_t InlineSize = DEFAULT_INITIAL_SIZE,
+          class HashPolicy = FullHash, class VerifyPolicy = VerifyParanoid,
+          class LogPolicy = LogDefault, class CanaryPolicy = WithCanaries,
+          class PoisonPolicy = WithPoison, class Fallback = HeapAllocator>
+class SafeStackSmall
+    : public SafeStack<
+          T, HashPolicy, VerifyPolicy, LogPolicy,
+          InlineAllocator<
+              GetStackBufferBytes<T, HashPolicy, CanaryPolicy>(InlineSize),
+              Fallback, GetBufAlignment<T>()>,
+          CanaryPolicy, PoisonPolicy> {
+  public:
+  SafeStackSmall();
+
+  SafeStackSmall(const SafeStackSmall& stack)            = delete;
+  SafeStackSmall(SafeStackSmall&& stack)                 = delete;
+  SafeStackSmall& operator=(const SafeStackSmall& stack) = delete;
+  SafeStackSmall& operator=(SafeStackSmall&& stack)      = delete;
+
+  /**
+   * Whether the elements are still inside the object.
+   */
+  bool IsInline();
+
+  private:
+  static_assert(InlineSize > 0, "Use SafeStack for no inline elements");
+};
+
+
+template <class T, size_t InlineSize, class HashPolicy, class VerifyPolicy,
+          class LogPolicy, class CanaryPolicy, class PoisonPolicy,
+          class Fallback>
+SafeStackSmall<T, InlineSize, HashPolicy, VerifyPolicy, LogPolicy,
+               CanaryPolicy, PoisonPolicy, Fallback>::
+SafeStackSmall()
+  : SafeStackSmall::SafeStack(InlineSize) {}
+
+
+template <class T, size_t InlineSize, class HashPolicy, class VerifyPolicy,
+          class LogPolicy, class CanaryPolicy, class PoisonPolicy,
+          class Fallback>
+bool SafeStackSmall<T, InlineSize, HashPolicy, VerifyPolicy, LogPolicy,
+                    CanaryPolicy, PoisonPolicy, Fallback>::
+IsInline() {
+  const char* begin = reinterpret_cast<const char*>(&this->allocator_);
+  return this->buf_ >= begin && this->buf_ < begin + sizeof(this->allocator_);
+}
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - MAPPED- - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+#if defined(__unix__)
+
+/**
+ * Keeps the buffer in a memory-mapped file, so the elements survive the
+ * process. Opening a file that already holds a stack verifies it fully
+ * and continues from it; a Push torn by a crash is rolled back, anything
+ * else that does not verify fails the construction. FlushPolicy says how
+ * eagerly the buffer is written to disk.
+ */
+template <class T, class FlushPolicy = FlushNever,
+          class HashPolicy = IncrementalHash,
+          class VerifyPolicy = VerifySampled<>,
+          class LogPolicy = LogDefault, class CanaryPolicy = WithCanaries,
+          class PoisonPolicy = WithPoison>
+class MappedSafeStack
+    : public SafeStack<T, HashPolicy, VerifyPolicy, LogPolicy,
+                       MappedAllocator<FlushPolicy>, CanaryPolicy,
+                       PoisonPolicy> {
+  public:
+  /**
+   * Opens the stack kept in the file at path, or starts an empty one
+   * there.
+   */
+  explicit MappedSafeStack(const char* path);
+
+  MappedSafeStack(const MappedSafeStack& stack)            = delete;
+  MappedSafeStack(MappedSafeStack&& stack)                 = delete;
+  MappedSafeStack& operator=(const MappedSafeStack& stack) = delete;
+  MappedSafeStack& operator=(MappedSafeStack&& stack)      = delete;
+
+  /**
+   * Writes the buffer to disk and waits for it, whatever the FlushPolicy.
+   */
+  void Flush();
+
+  private:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Only trivially copyable elements can be kept in a file");
+};
+
+
+template <class T, class FlushPolicy, class HashPolicy, class VerifyPolicy,
+          class LogPolicy, class CanaryPolicy, class PoisonPolicy>
+MappedSafeStack<T, FlushPolicy, HashPolicy, VerifyPolicy, LogPolicy,
+                CanaryPolicy, PoisonPolicy>::
+MappedSafeStack(const char* path)
+  : MappedSafeStack::SafeStack(DEFAULT_INITIAL_SIZE, path) {}
+
+
+template <class T, class FlushPolicy, class HashPolicy, class VerifyPolicy,
+          class LogPolicy, class CanaryPolicy, class PoisonPolicy>
+void MappedSafeStack<T, FlushPolicy, HashPolicy, VerifyPolicy, LogPolicy,
+                     CanaryPolicy, PoisonPolicy>::
+Flush() {
+  this->allocator_.Flush(this->buf_, this->all_size_);
+}
+
+#endif
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - SHARED- - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+#if defined(__unix__)
+
+/**
+ * Stack of trivially copyable elements in a POSIX shared memory segment,
+ * which any number of processes attach to by its name.
+ *
+ * STRUCTURE OF THE SEGMENT:
+ * [CONTROL][CANARY][HASH][CUR_SIZE][BUFFER_SIZE]([PAD])[BUFFER][CANARY]
+ *
+ * CONTROL says what the segment holds and has a robust process-shared
+ * mutex that every operation takes. The rest is the layout of SafeStack
+ * with a fixed capacity. Nothing in the segment is a pointer, so every
+ * process maps it wherever it likes. HASH is the hash of the sizes plus a
+ * hash per slot, poison included, so Push and Pop update it in O(1).
+ *
+ * Push and Pop check canaries and sizes, Ok() and attaching check the whole
+ * segment. So does the next operation after a process died holding the
+ * mutex: the Push or Pop it left half done is finished or rolled back.
+ * Anything else fails with the dump, in that process and every later one.
+ */
+template <class T, class LogPolicy = LogDefault>
+class SharedSafeStack {
+  public:
+  /**
+   * Attaches to the segment called name (see shm_open), or creates it with
+   * room for capacity elements if there is none. Throws std::system_error
+   * if it cannot be opened.
+   */
+  explicit SharedSafeStack(const char* name,
+                           size_t capacity = DEFAULT_RESERVED_SIZE);
+  /**
+   * Detaches. The segment is kept until Remove().
+   */
+  ~SharedSafeStack();
+
+  SharedSafeStack(const SharedSafeStack& stack)            = delete;
+  SharedSafeStack(SharedSafeStack&& stack)                 = delete;
+  SharedSafeStack& operator=(const SharedSafeStack& stack) = delete;
+  SharedSafeStack& operator=(SharedSafeStack&& stack)      = delete;
+
+  /**
+   * Unlinks the segment. Processes that are attached keep it until they
+   * detach.
+   */
+  static void Remove(const char* name);
+
+  /**
+   * Returns false if the stack is full.
+   */
+  bool TryPush(const T& item);
+  /**
+   * Same as TryPush, but the stack must not be full.
+   */
+  void Push(const T& item);
+  /**
+   * Pops into item. Returns false if the stack was empty.
+   */
+  bool TryPop(T& item);
+  /**
+   * Same as TryPop, but the stack must not be empty.
+   */
+  T Pop();
+
+  size_t GetCurSize();
+  size_t GetBufSize();
+
+  /**
+   * Checks canaries, sizes, poison of the padding and of every free slot,
+   * and the hash.
+   */
+  void Ok();
+
+  protected:
+  static constexpr char     MAGIC[8] = {'S', 'H', 'U', 'S', 'H', 'S', 'H',
+                                        'M'};
+  static constexpr uint32_t VERSION  = 1;
+  // How long attaching waits for the creator to set the segment up.
+  static constexpr int      ATTACH_TIMEOUT_MS = 1000;
+
+  struct Control {
+    char                  magic[sizeof(MAGIC)];
+    uint32_t              version;
+    uint32_t              element_size;
+    std::atomic<uint32_t> ready;
+    // The hash the operation in progress is going to store.
+    uint64_t              pending_hash;
+    pthread_mutex_t       mutex;
+  };
+
+  // The header of the stack starts on a cache line of its own.
+  static constexpr size_t STACK_POS    =
+      AlignUp(sizeof(Control), CACHE_LINE_SIZE);
+  static constexpr size_t ELEMENTS_POS =
+      STACK_POS + AlignUp(BUF_POS, GetBufAlignment<T>());
+
+  static size_t GetSegmentSize(size_t capacity);
+
+  /**
+   * Holds the mutex of the segment. Checks and repairs the stack if its
+   * previous owner died.
+   */
+  class Lock {
+    public:
+    explicit Lock(SharedSafeStack& stack);
+    ~Lock();
+
+    Lock(const Lock& lock)            = delete;
+    Lock& operator=(const Lock& lock) = delete;
+
+    private:
+    // For MASSERT.
+    char* GetDumpMessage(int error_code);
+
+    SharedSafeStack& stack_;
+  };
+
+  void Create(size_t capacity);
+  void Attach(const char* name);
+
+  Control& GetControl();
+  char*    GetSlot(size_t ind);
+
+  size_t   GetCurSizeVal();
+  size_t   GetBufSizeVal();
+  uint64_t GetHashValue();
+  void     SetCurSizeVal(size_t cur_size);
+  void     SetHashValue(uint64_t hash);
+
+  uint64_t CalculateHeaderHash(size_t cur_size);
+  uint64_t CalculateSlotHash(const char* slot, size_t ind);
+  uint64_t CalculatePoisonSlotHash(size_t ind);
+  uint64_t CalculateHash();
+
+  /**
+   * Ok() without the mutex.
+   */
+  void Verify();
+  void VerifyCanaries();
+  bool IsPoison(const char* from, const char* to);
+  /**
+   * Called with the mutex of a process that died holding it. Puts back the
+   * state before or after the operation that process was in.
+   */
+  void Recover();
+
+  char* GetDumpMessage(int error_code);
+
+  char*        segment_;
+  size_t       segment_size_;
+  logs::Logger logger_;
+  static std::atomic<size_t> stacks_count;
+
+  private:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Only trivially copyable elements can be shared");
+};
+
+
+template <class T, class LogPolicy>
+SharedSafeStack<T, LogPolicy>::
+SharedSafeStack(const char* name, size_t capacity)
+  : segment_(nullptr)
+  , segment_size_(0)
+  , logger_("shush-shared-stack-" + std::to_string(stacks_count++)) {
+  SHUSH_STACK_DBG("Opening the shared segment " + std::string(name) + "...");
+
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1 && errno != EEXIST) {
+    throw std::system_error(errno, std::generic_category(), name);
+  }
+  if (fd == -1) {
+    Attach(name);
+    return;
+  }
+
+  segment_size_ = GetSegmentSize(capacity);
+  if (ftruncate(fd, segment_size_) == -1) {
+    const int error = errno;
+    close(fd);
+    shm_unlink(name);
+    throw std::system_error(error, std::generic_category(), "ftruncate");
+  }
+
+  void* segment = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    shm_unlink(name);
+    throw std::bad_alloc();
+  }
+
+  segment_ = static_cast<char*>(segment);
+  Create(capacity);
+  SHUSH_STACK_DBG("Created the shared stack.");
+}
+
+
+template <class T, class LogPolicy>
+SharedSafeStack<T, LogPolicy>::~SharedSafeStack() {
+  SHUSH_STACK_DBG("Detaching from the shared segment...");
+  munmap(segment_, segment_size_);
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::Remove(const char* name) {
+  shm_unlink(name);
+}
+
+
+template <class T, class LogPolicy>
+bool SharedSafeStack<T, LogPolicy>::TryPush(const T& item) {
+  Lock lock(*this);
+  VerifyCanaries();
+
+  const size_t cur_size = GetCurSizeVal();
+  const size_t buf_size = GetBufSizeVal();
+  MASSERT(cur_size <= buf_size, Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+  if (cur_size == buf_size) {
+    return false;
+  }
+
+  char* slot = GetSlot(cur_size);
+  MASSERT(IsPoison(slot, slot + sizeof(T)),
+          Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+
+  // The hash to come is written down first, so that Recover() can tell a
+  // finished Push from a broken stack.
+  const uint64_t hash =
+      GetHashValue() -
+      CalculateHeaderHash(cur_size) + CalculateHeaderHash(cur_size + 1) -
+      CalculatePoisonSlotHash(cur_size) +
+      CalculateSlotHash(reinterpret_cast<const char*>(&item), cur_size);
+  GetControl().pending_hash = hash;
+
+  memcpy(slot, &item, sizeof(T));
+  SetCurSizeVal(cur_size + 1);
+  SetHashValue(hash);
+  return true;
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::Push(const T& item) {
+  if (!TryPush(item)) {
+    SHUSH_STACK_LOG("Oh no, the shared stack is full! Aborting...");
+    MASSERT(false, Errc::REALLOCATION_IN_STATIC_STACK);
+  }
+}
+
+
+template <class T, class LogPolicy>
+bool SharedSafeStack<T, LogPolicy>::TryPop(T& item) {
+  Lock lock(*this);
+  VerifyCanaries();
+
+  const size_t cur_size = GetCurSizeVal();
+  MASSERT(cur_size <= GetBufSizeVal(), Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+  if (cur_size == 0) {
+    return false;
+  }
+
+  char*          slot = GetSlot(cur_size - 1);
+  const uint64_t hash =
+      GetHashValue() -
+      CalculateHeaderHash(cur_size) + CalculateHeaderHash(cur_size - 1) -
+      CalculateSlotHash(slot, cur_size - 1) +
+      CalculatePoisonSlotHash(cur_size - 1);
+  GetControl().pending_hash = hash;
+
+  memcpy(&item, slot, sizeof(T));
+  poison::Fill(slot, slot + sizeof(T));
+  SetCurSizeVal(cur_size - 1);
+  SetHashValue(hash);
+  return true;
+}
+
+
+template <class T, class LogPolicy>
+T SharedSafeStack<T, LogPolicy>::Pop() {
+  T item;
+  if (!TryPop(item)) {
+    SHUSH_STACK_LOG("Oh no, the shared stack is empty! Aborting...");
+    MASSERT(false, Errc::POP_ON_0_SIZE);
+  }
+
+  return item;
+}
+
+
+template <class T, class LogPolicy>
+size_t SharedSafeStack<T, LogPolicy>::GetCurSize() {
+  Lock lock(*this);
+  return GetCurSizeVal();
+}
+
+
+template <class T, class LogPolicy>
+size_t SharedSafeStack<T, LogPolicy>::GetBufSize() {
+  return GetBufSizeVal();
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::Ok() {
+  Lock lock(*this);
+  Verify();
+}
+
+
+template <class T, class LogPolicy>
+size_t SharedSafeStack<T, LogPolicy>::GetSegmentSize(size_t capacity) {
+  return ELEMENTS_POS + capacity * sizeof(T) + CANARY_SIZE;
+}
+
+
+template <class T, class LogPolicy>
+SharedSafeStack<T, LogPolicy>::Lock::Lock(SharedSafeStack& stack)
+  : stack_(stack) {
+  pthread_mutex_t* mutex = &stack_.GetControl().mutex;
+  const int        error = pthread_mutex_lock(mutex);
+  if (error == EOWNERDEAD) {
+    try {
+      stack_.Recover();
+    } catch (...) {
+      // Not marked consistent, so the mutex is of no use to anyone now.
+      pthread_mutex_unlock(mutex);
+      throw;
+    }
+    pthread_mutex_consistent(mutex);
+  } else if (error == ENOTRECOVERABLE) {
+    MASSERT(false, Errc::HASH_NOT_THE_SAME);
+  } else if (error != 0) {
+    throw std::system_error(error, std::generic_category(),
+                            "pthread_mutex_lock");
+  }
+}
+
+
+template <class T, class LogPolicy>
+SharedSafeStack<T, LogPolicy>::Lock::~Lock() {
+  pthread_mutex_unlock(&stack_.GetControl().mutex);
+}
+
+
+template <class T, class LogPolicy>
+char* SharedSafeStack<T, LogPolicy>::Lock::GetDumpMessage(int error_code) {
+  return stack_.GetDumpMessage(error_code);
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::Create(size_t capacity) {
+  Control* control = new(segment_) Control;
+  memcpy(control->magic, MAGIC, sizeof(MAGIC));
+  control->version      = VERSION;
+  control->element_size = sizeof(T);
+  control->pending_hash = 0;
+
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&control->mutex, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+
+  char* stack = segment_ + STACK_POS;
+  memcpy(stack, &CANARY_VALUE, CANARY_SIZE);
+  memcpy(stack + BUF_SIZE_POS, &capacity, BUF_SIZE_SIZE);
+  SetCurSizeVal(0);
+  poison::Fill(stack + BUF_POS, segment_ + segment_size_ - CANARY_SIZE);
+  memcpy(segment_ + segment_size_ - CANARY_SIZE, &CANARY_VALUE, CANARY_SIZE);
+  SetHashValue(CalculateHash());
+
+  control->ready.store(1, std::memory_order_release);
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::Attach(const char* name) {
+  const int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) {
+    throw std::system_error(errno, std::generic_category(), name);
+  }
+
+  // The creator may not have sized the segment yet.
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(ATTACH_TIMEOUT_MS);
+  struct stat segment_stat = {};
+  while (true) {
+    if (fstat(fd, &segment_stat) == -1) {
+      const int error = errno;
+      close(fd);
+      throw std::system_error(error, std::generic_category(), "fstat");
+    }
+    if (segment_stat.st_size != 0) {
+      break;
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      close(fd);
+      throw std::system_error(ETIMEDOUT, std::generic_category(), name);
+    }
+    std::this_thread::yield();
+  }
+
+  segment_size_ = segment_stat.st_size;
+  void* segment = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  segment_ = static_cast<char*>(segment);
+
+  try {
+    if (segment_size_ < ELEMENTS_POS + CANARY_SIZE) {
+      SHUSH_STACK_LOG("Oh no, the shared segment is too short! Aborting...");
+    }
+    MASSERT(segment_size_ >= ELEMENTS_POS + CANARY_SIZE,
+            Errc::MAPPED_FILE_MISMATCH);
+    while (GetControl().ready.load(std::memory_order_acquire) == 0) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        throw std::system_error(ETIMEDOUT, std::generic_category(), name);
+      }
+      std::this_thread::yield();
+    }
+
+    // Nothing else in the segment can be trusted before the sizes are
+    // checked against it.
+    const Control& control = GetControl();
+    const bool     matches =
+        memcmp(control.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+        control.version == VERSION && control.element_size == sizeof(T) &&
+        GetSegmentSize(GetBufSizeVal()) == segment_size_;
+    if (!matches) {
+      SHUSH_STACK_LOG(
+          "Oh no, the shared segment does not hold a stack of this type! "
+          "Aborting...");
+    }
+    MASSERT(matches, Errc::MAPPED_FILE_MISMATCH);
+
+    Ok();
+  } catch (...) {
+    munmap(segment_, segment_size_);
+    throw;
+  }
+  SHUSH_STACK_DBG(
+      "Attached to a shared stack of " + std::to_string(GetBufSizeVal()) +
+      " elements.");
+}
+
+
+template <class T, class LogPolicy>
+typename SharedSafeStack<T, LogPolicy>::Control&
+SharedSafeStack<T, LogPolicy>::GetControl() {
+  return *reinterpret_cast<Control*>(segment_);
+}
+
+
+template <class T, class LogPolicy>
+char* SharedSafeStack<T, LogPolicy>::GetSlot(size_t ind) {
+  return segment_ + ELEMENTS_POS + ind * sizeof(T);
+}
+
+
+template <class T, class LogPolicy>
+size_t SharedSafeStack<T, LogPolicy>::GetCurSizeVal() {
+  size_t cur_size = 0;
+  memcpy(&cur_size, segment_ + STACK_POS + CUR_SIZE_POS, CUR_SIZE_SIZE);
+  return cur_size;
+}
+
+
+template <class T, class LogPolicy>
+size_t SharedSafeStack<T, LogPolicy>::GetBufSizeVal() {
+  size_t buf_size = 0;
+  memcpy(&buf_size, segment_ + STACK_POS + BUF_SIZE_POS, BUF_SIZE_SIZE);
+  return buf_size;
+}
+
+
+template <class T, class LogPolicy>
+uint64_t SharedSafeStack<T, LogPolicy>::GetHashValue() {
+  uint64_t hash = 0;
+  memcpy(&hash, segment_ + STACK_POS + HASH_POS, HASH_SIZE);
+  return hash;
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::SetCurSizeVal(size_t cur_size) {
+  memcpy(segment_ + STACK_POS + CUR_SIZE_POS, &cur_size, CUR_SIZE_SIZE);
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::SetHashValue(uint64_t hash) {
+  memcpy(segment_ + STACK_POS + HASH_POS, &hash, HASH_SIZE);
+}
+
+
+template <class T, class LogPolicy>
+uint64_t SharedSafeStack<T, LogPolicy>::
+CalculateHeaderHash(size_t cur_size) {
+  const size_t sizes[] = {cur_size, GetBufSizeVal()};
+  return Wyhash::Hash(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+}
+
+
+template <class T, class LogPolicy>
+uint64_t SharedSafeStack<T, LogPolicy>::
+CalculateSlotHash(const char* slot, size_t ind) {
+  return MixHash(Wyhash::Hash(slot, sizeof(T)) +
+                 ind * SLOT_INDEX_MULTIPLIER);
+}
+
+
+template <class T, class LogPolicy>
+uint64_t SharedSafeStack<T, LogPolicy>::
+CalculatePoisonSlotHash(size_t ind) {
+  static const uint64_t poison_hash = [] {
+    char poison[sizeof(T)];
+    poison::Fill(poison, poison + sizeof(T));
+    return Wyhash::Hash(poison, sizeof(T));
+  }();
+
+  return MixHash(poison_hash + ind * SLOT_INDEX_MULTIPLIER);
+}
+
+
+template <class T, class LogPolicy>
+uint64_t SharedSafeStack<T, LogPolicy>::CalculateHash() {
+  const size_t buf_size = GetBufSizeVal();
+  uint64_t     hash     = CalculateHeaderHash(GetCurSizeVal());
+  for (size_t i = 0; i < buf_size; ++i) {
+    hash += CalculateSlotHash(GetSlot(i), i);
+  }
+
+  return hash;
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::Verify() {
+  SHUSH_STACK_DBG("Started verification procedure...");
+
+  VerifyCanaries();
+  const size_t cur_size = GetCurSizeVal();
+  MASSERT(cur_size <= GetBufSizeVal(), Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+  MASSERT(IsPoison(segment_ + STACK_POS + BUF_POS, GetSlot(0)) &&
+              IsPoison(GetSlot(cur_size),
+                       segment_ + segment_size_ - CANARY_SIZE),
+          Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+  MASSERT(CalculateHash() == GetHashValue(), Errc::HASH_NOT_THE_SAME);
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::VerifyCanaries() {
+  uint64_t first_canary  = 0;
+  uint64_t second_canary = 0;
+  memcpy(&first_canary, segment_ + STACK_POS, CANARY_SIZE);
+  memcpy(&second_canary, segment_ + segment_size_ - CANARY_SIZE,
+         CANARY_SIZE);
+  MASSERT(first_canary == CANARY_VALUE, Errc::CORRUPTED_FIRST_CANARY);
+  MASSERT(second_canary == CANARY_VALUE, Errc::CORRUPTED_SECOND_CANARY);
+}
+
+
+template <class T, class LogPolicy>
+bool SharedSafeStack<T, LogPolicy>::
+IsPoison(const char* from, const char* to) {
+  return poison::FindNonPoison(from, to) == to;
+}
+
+
+template <class T, class LogPolicy>
+void SharedSafeStack<T, LogPolicy>::Recover() {
+  SHUSH_STACK_LOG(
+      "A process died holding the shared stack, checking what it left...");
+  VerifyCanaries();
+
+  const size_t cur_size = GetCurSizeVal();
+  const size_t buf_size = GetBufSizeVal();
+  MASSERT(cur_size <= buf_size, Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+
+  // Either hash is fine: the one before the operation or the one it was
+  // about to store.
+  const uint64_t stored_hash  = GetHashValue();
+  const uint64_t pending_hash = GetControl().pending_hash;
+  auto           is_whole     = [&] {
+    const uint64_t hash = CalculateHash();
+    if (hash != stored_hash && hash != pending_hash) {
+      return false;
+    }
+    SetHashValue(hash);
+    return true;
+  };
+
+  if (is_whole()) {
+    return;
+  }
+
+  char saved[sizeof(T)];
+  // A Push that wrote (a part of) its element, but not the size.
+  if (cur_size < buf_size) {
+    char* slot = GetSlot(cur_size);
+    memcpy(saved, slot, sizeof(T));
+    poison::Fill(slot, slot + sizeof(T));
+    if (is_whole()) {
+      SHUSH_STACK_LOG("Rolled back a torn push.");
+      return;
+    }
+    memcpy(slot, saved, sizeof(T));
+  }
+
+  // A Pop that poisoned (a part of) its element, but did not write the
+  // size, or a Push that wrote both. The element is given up on.
+  if (cur_size > 0) {
+    char* slot = GetSlot(cur_size - 1);
+    memcpy(saved, slot, sizeof(T));
+    poison::Fill(slot, slot + sizeof(T));
+    SetCurSizeVal(cur_size - 1);
+    if (is_whole()) {
+      SHUSH_STACK_LOG("Dropped the top element of a torn push or pop.");
+      return;
+    }
+    memcpy(slot, saved, sizeof(T));
+    SetCurSizeVal(cur_size);
+  }
+
+  SHUSH_STACK_LOG("Oh no, the shared stack is broken! Aborting...");
+  MASSERT(false, Errc::HASH_NOT_THE_SAME);
+}
+
+
+template <class T, class LogPolicy>
+char* SharedSafeStack<T, LogPolicy>::GetDumpMessage(int error_code) {
+  DumpWriter out(dump_msg_buffer, DUMP_MESSAGE_MAX_CHAR_COUNT);
+  out.Write("\n- - - - - DUMP MESSAGE FROM SHUSH::SHARED_STACK- - - - - \n");
+
+  out.Write("segment address: ")
+     .WriteUnsigned(reinterpret_cast<size_t>(segment_))
+     .Write(", size: ").WriteUnsigned(segment_size_).Write(".\n");
+  out.Write("Error code == ").WriteSigned(error_code)
+     .Write(" (").Write(GetErrorName(error_code)).Write(")\n");
+  out.Write("Log policy: ").Write(LogPolicy::NAME).Write("\n\n");
+
+  if (segment_size_ >= ELEMENTS_POS) {
+    out.Write("Byte representation of the header:\n")
+       .WriteBytes(segment_ + STACK_POS, BUF_POS).Write("\n\n");
+    out.Write("[VERSION] == ").WriteUnsigned(GetControl().version)
+       .Write(", [ELEMENT_SIZE] == ")
+       .WriteUnsigned(GetControl().element_size).Write("\n");
+    out.Write("[CUR_SIZE] == ").WriteUnsigned(GetCurSizeVal()).Write("\n");
+    out.Write("[BUFFER_SIZE] == ").WriteUnsigned(GetBufSizeVal())
+       .Write("\n");
+    out.Write("[HASH] == ").WriteUnsigned(GetHashValue())
+       .Write(", [PENDING_HASH] == ")
+       .WriteUnsigned(GetControl().pending_hash).Write("\n");
+  }
+
+  out.Write("\n- - - END OF DUMP MESSAGE FROM SHUSH::SHARED_STACK- - - - \n");
+
+  return out.GetMessage();
+}
+
+
+template <class T, class LogPolicy>
+std::atomic<size_t> SharedSafeStack<T, LogPolicy>::stacks_count(0);
+
+#endif
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - PRESETS - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Every layer on, at its most thorough.
+ */
+template <class T>
+using HardenedSafeStack = SafeStack<T, FullHash, VerifyParanoid, LogAll>;
+
+/**
+ * Every layer off: only the sizes are left in the header, and Push/Pop are
+ * about as fast as std::vector's.
+ */
+template <class T>
+using BareSafeStack = SafeStack<T, NoHash, VerifyNone, LogNone, HeapAllocator,
+                                NoCanaries, NoPoison>;
+
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - SEGMENTED - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+
+/**
+ * Stack of fixed-size chunks linked from the top down. Growing allocates
+ * one chunk and never moves elements, so Push is O(1) even in the worst
+ * case and references to elements stay valid until they are popped.
+ *
+ * STRUCTURE OF A CHUNK:
+ * [CANARY][HASH][PREV][SIZE][SLOTS_HASH][E - L - E - M - E - N - T - S][CANARY]
+ *
+ * Every chunk is a small incrementally hashed stack of its own: unused
+ * slots hold poison, SLOTS_HASH is the sum of per-slot hashes, and HASH
+ * covers the address of the chunk and PREV, SIZE and SLOTS_HASH. Push and
+ * Pop check the canaries and HASH of the top chunk, Ok() the whole top
+ * chunk, Ok(true) every chunk. An emptied chunk is kept as a spare, so a
+ * stack moving back and forth over a chunk boundary does not allocate.
+ */
+template <class T,
+          size_t ChunkSize = (sizeof(T) < DEFAULT_CHUNK_BYTES
+                                  ? DEFAULT_CHUNK_BYTES / sizeof(T) : 1),
+          class HashFunction = Wyhash, class LogPolicy = LogDefault,
+          class Allocator = HeapAllocator>
+class SegmentedSafeStack {
+  public:
+  static_assert(ChunkSize > 0, "A chunk must hold at least one element");
+  static_assert(alignof(T) <= Allocator::MAX_ALIGNMENT,
+                "The allocator cannot align chunks enough for T");
+
+  SegmentedSafeStack();
+  explicit SegmentedSafeStack(const Allocator& allocator);
+  ~SegmentedSafeStack();
+
+  SegmentedSafeStack(const SegmentedSafeStack& stack)            = delete;
+  SegmentedSafeStack(SegmentedSafeStack&& stack)                 = delete;
+  SegmentedSafeStack& operator=(const SegmentedSafeStack& stack) = delete;
+  SegmentedSafeStack& operator=(SegmentedSafeStack&& stack)      = delete;
+
+  void Push(const T& item);
+  void Push(T&& item);
+  /**
+   * Constructs the new top element in place from args.
+   */
+  template <class... Args>
+  void Emplace(Args&&... args);
+
+  /**
+   * Moves the top element out and destroys it.
+   */
+  T    Pop();
+  /**
+   * Moves the top element into item and destroys it.
+   */
+  void Pop(T& item);
+  /**
+   * Destroys the top element without returning it.
+   */
+  void Drop();
+
+  /**
+   * The top element. Stays valid until it is popped.
+   */
+  const T& Top();
+  /**
+   * The element ind positions below the top, so Peek(0) is Top(). Walks
+   * ind / ChunkSize chunks.
+   */
+  const T& Peek(size_t ind);
+
+  size_t GetCurSize();
+  /**
+   * Chunks holding elements, not counting the spare one.
+   */
+  size_t GetChunksCount();
+
+  /**
+   * Checks the top chunk: canaries, both hashes and poison in its unused
+   * slots. With full == true checks every chunk and the spare one.
+   */
+  void Ok(bool full = false);
+
+  char* GetDumpMessage(int error_code);
+
+  protected:
+  struct Chunk {
+    uint64_t        first_canary;
+    uint64_t        hash;
+    Chunk*          prev;
+    size_t          size;
+    uint64_t        slots_hash;
+    alignas(T) char elements[ChunkSize * sizeof(T)];
+    uint64_t        second_canary;
+  };
+
+  static char* GetSlot(Chunk& chunk, size_t ind);
+
+  /**
+   * Allocates a poisoned, empty chunk.
+   */
+  Chunk* NewChunk();
+  void   DeleteChunk(Chunk* chunk);
+  /**
+   * Puts the spare chunk, or a new one, on top of the stack.
+   */
+  void   PushChunk();
+  /**
+   * Takes the empty top chunk off the stack and keeps it as the spare one,
+   * or frees it if there is a spare one already.
+   */
+  void   PopChunk();
+
+  /**
+   * Verifies the top chunk and takes the top element out of its hash. The
+   * element has to be removed with RemoveTop() then.
+   */
+  T&   PrepareTopRemoval();
+  /**
+   * Destroys and poisons the top element and pops the top chunk if it is
+   * empty now.
+   */
+  void RemoveTop();
+
+  static uint64_t CalculateHash(const Chunk& chunk);
+  static uint64_t CalculateSlotHash(Chunk& chunk, size_t ind);
+  static uint64_t CalculatePoisonSlotHash(size_t ind);
+  /**
+   * Slots hash of an empty chunk, the same for all of them.
+   */
+  static uint64_t CalculateEmptySlotsHash();
+  static void     PlaceHash(Chunk& chunk);
+
+  /**
+   * Checks the canaries and the hash of the chunk. O(1).
+   */
+  void VerifyHeader(const Chunk& chunk);
+  /**
+   * Also recomputes the slots hash and checks the unused slots. O(ChunkSize).
+   */
+  void VerifyChunk(Chunk& chunk);
+
+  Chunk*       top_;
+  Chunk*       spare_;
+  size_t       chunks_count_;
+  Allocator    allocator_;
+  logs::Logger logger_;
+  static std::atomic<size_t> stacks_count;
+};
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+SegmentedSafeStack()
+  : SegmentedSafeStack(Allocator()) {}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+SegmentedSafeStack(const Allocator& allocator)
+  : top_(nullptr)
+  , spare_(nullptr)
+  , chunks_count_(0)
+  , allocator_(allocator)
+  , logger_("shush-segmented-stack-" + std::to_string(stacks_count++)) {
+  SHUSH_STACK_DBG("Construction of the SEGMENTED stack completed.");
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+~SegmentedSafeStack() {
+  SHUSH_STACK_DBG("Destructing the SEGMENTED stack...");
+  while (top_ != nullptr) {
+    Chunk* prev = top_->prev;
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      for (size_t i = 0; i < top_->size; ++i) {
+        reinterpret_cast<T*>(GetSlot(*top_, i))->~T();
+      }
+    }
+    DeleteChunk(top_);
+    top_ = prev;
+  }
+  if (spare_ != nullptr) {
+    DeleteChunk(spare_);
+  }
+  --stacks_count;
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Push(const T& item) {
+  Emplace(item);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Push(T&& item) {
+  Emplace(std::move(item));
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+template <class... Args>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Emplace(Args&&... args) {
+  if (top_ != nullptr) {
+    VerifyHeader(*top_);
+  }
+  // Nothing moves when a chunk is added, so args may still refer to an
+  // element of this stack.
+  if (top_ == nullptr || top_->size == ChunkSize) {
+    SHUSH_STACK_DBG("The top chunk is full! Adding a new one...");
+    PushChunk();
+  }
 
-// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
-// - - - - - - - - - - - - - ERROR CODES - - - - - - - - - - - - - - - - -
-// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
-enum Errc {
-  ASSERT_FAILED                    = -1,
-  THIS_PTR_IS_NULLPTR              = 0,
-  CORRUPTED_FIRST_CANARY           = 1,
-  CORRUPTED_SECOND_CANARY          = 2,
-  HASH_NOT_THE_SAME                = 3,
-  CUR_SIZE_IS_BIGGER_THAN_BUF      = 4,
-  UNINITIALIZED_CELL_IS_NOT_POISON = 5,
-  POP_ON_0_SIZE                    = 6,
-  REALLOCATION_IN_STATIC_STACK     = 7
-};
+  Chunk&       chunk = *top_;
+  const size_t ind   = chunk.size;
+  char*        slot  = GetSlot(chunk, ind);
+  MASSERT(poison::FindNonPoison(slot, slot + sizeof(T)) == slot + sizeof(T),
+          Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+
+  try {
+    new(slot) T(std::forward<Args>(args)...);
+  } catch (...) {
+    poison::Fill(slot, slot + sizeof(T));
+    if (ind == 0) {
+      PopChunk();
+    }
+    throw;
+  }
+
+  chunk.slots_hash += CalculateSlotHash(chunk, ind) -
+                      CalculatePoisonSlotHash(ind);
+  chunk.size = ind + 1;
+  PlaceHash(chunk);
+  SHUSH_STACK_DBG(
+      "Pushing is complete. The size of the top chunk is " +
+      std::to_string(ind + 1) + ".");
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+T SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Pop() {
+  SHUSH_STACK_DBG("Started popping the element...");
+
+  T res(std::move(PrepareTopRemoval()));
+  RemoveTop();
+
+  return res;
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Pop(T& item) {
+  SHUSH_STACK_DBG("Started popping the element...");
+
+  item = std::move(PrepareTopRemoval());
+  RemoveTop();
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Drop() {
+  SHUSH_STACK_DBG("Started dropping the element...");
+
+  PrepareTopRemoval();
+  RemoveTop();
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+const T& SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Top() {
+  return Peek(0);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+const T& SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Peek(size_t ind) {
+  Chunk* chunk = top_;
+  while (chunk != nullptr && ind >= chunk->size) {
+    ind  -= chunk->size;
+    chunk = chunk->prev;
+  }
+  if (chunk == nullptr) {
+    SHUSH_STACK_LOG("Oh no, the stack is not that deep! Aborting...");
+  }
+  MASSERT(chunk != nullptr, Errc::ELEMENT_OUT_OF_RANGE);
+  VerifyHeader(*chunk);
+
+  return *reinterpret_cast<const T*>(GetSlot(*chunk, chunk->size - 1 - ind));
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+size_t SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+GetCurSize() {
+  if (top_ == nullptr) {
+    return 0;
+  }
+
+  return (chunks_count_ - 1) * ChunkSize + top_->size;
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+size_t SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+GetChunksCount() {
+  return chunks_count_;
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+Ok(bool full) {
+  SHUSH_STACK_DBG("Started verification procedure...");
+
+  if (top_ != nullptr) {
+    VerifyChunk(*top_);
+  }
+  if (!full) {
+    return;
+  }
+
+  size_t chunks_count = 0;
+  for (Chunk* chunk = top_; chunk != nullptr; chunk = chunk->prev) {
+    VerifyChunk(*chunk);
+    // Only the top chunk may be partially filled.
+    MASSERT(chunk == top_ || chunk->size == ChunkSize,
+            Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+    ++chunks_count;
+  }
+  MASSERT(chunks_count == chunks_count_, Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+
+  if (spare_ != nullptr) {
+    VerifyChunk(*spare_);
+    MASSERT(spare_->size == 0, Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+  }
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+char* SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+GetSlot(Chunk& chunk, size_t ind) {
+  return chunk.elements + ind * sizeof(T);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+typename SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy,
+                            Allocator>::Chunk*
+SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+NewChunk() {
+  SHUSH_STACK_DBG("Allocating a new chunk...");
+
+  Chunk* chunk = new(allocator_.Allocate(sizeof(Chunk), alignof(Chunk))) Chunk;
+  chunk->first_canary  = CANARY_VALUE;
+  chunk->prev          = nullptr;
+  chunk->size          = 0;
+  chunk->slots_hash    = CalculateEmptySlotsHash();
+  chunk->second_canary = CANARY_VALUE;
+  if constexpr (!Allocator::POISONED) {
+    poison::Fill(chunk->elements, chunk->elements + sizeof(chunk->elements));
+  }
+  PlaceHash(*chunk);
+
+  return chunk;
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+DeleteChunk(Chunk* chunk) {
+  allocator_.Deallocate(
+      reinterpret_cast<char*>(chunk), sizeof(Chunk), alignof(Chunk));
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+PushChunk() {
+  Chunk* chunk = spare_;
+  if (chunk != nullptr) {
+    VerifyHeader(*chunk);
+    spare_ = nullptr;
+  } else {
+    chunk = NewChunk();
+  }
+
+  chunk->prev = top_;
+  PlaceHash(*chunk);
+  top_ = chunk;
+  ++chunks_count_;
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+PopChunk() {
+  Chunk* chunk = top_;
+  top_ = chunk->prev;
+  --chunks_count_;
+
+  if (spare_ != nullptr) {
+    SHUSH_STACK_DBG("Freeing the emptied chunk...");
+    DeleteChunk(chunk);
+    return;
+  }
+
+  chunk->prev = nullptr;
+  PlaceHash(*chunk);
+  spare_ = chunk;
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+T& SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+PrepareTopRemoval() {
+  if (top_ == nullptr) {
+    SHUSH_STACK_LOG("Oh no, the size of stack is already 0! Aborting...");
+  }
+  MASSERT(top_ != nullptr, Errc::POP_ON_0_SIZE);
+  VerifyHeader(*top_);
+
+  // Before the element is moved from, while its bytes are still hashed.
+  Chunk&       chunk = *top_;
+  const size_t ind   = chunk.size - 1;
+  chunk.slots_hash -= CalculateSlotHash(chunk, ind) -
+                      CalculatePoisonSlotHash(ind);
+
+  return *reinterpret_cast<T*>(GetSlot(chunk, ind));
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+RemoveTop() {
+  Chunk&       chunk = *top_;
+  const size_t ind   = chunk.size - 1;
+  char*        slot  = GetSlot(chunk, ind);
+  reinterpret_cast<T*>(slot)->~T();
+  poison::Fill(slot, slot + sizeof(T));
+
+  chunk.size = ind;
+  PlaceHash(chunk);
+  if (ind == 0) {
+    SHUSH_STACK_DBG("The top chunk is empty! Removing it...");
+    PopChunk();
+  }
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+uint64_t SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+CalculateHash(const Chunk& chunk) {
+  // PREV, SIZE and SLOTS_HASH are adjacent words.
+  const char* header = reinterpret_cast<const char*>(&chunk.prev);
+  const char* end    = reinterpret_cast<const char*>(&chunk.slots_hash + 1);
+
+  return MixHash(reinterpret_cast<size_t>(&chunk)) +
+         HashFunction::Hash(header, end - header);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+uint64_t SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+CalculateSlotHash(Chunk& chunk, size_t ind) {
+  const uint64_t bytes_hash =
+      HashFunction::Hash(GetSlot(chunk, ind), sizeof(T));
+
+  return MixHash(bytes_hash + ind * SLOT_INDEX_MULTIPLIER);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+uint64_t SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+CalculatePoisonSlotHash(size_t ind) {
+  static const uint64_t poison_bytes_hash = [] {
+    char poison_bytes[sizeof(T)];
+    memset(poison_bytes, POISON_VALUE, sizeof(T));
+    return HashFunction::Hash(poison_bytes, sizeof(T));
+  }();
+
+  return MixHash(poison_bytes_hash + ind * SLOT_INDEX_MULTIPLIER);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+uint64_t SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+CalculateEmptySlotsHash() {
+  static const uint64_t empty_slots_hash = [] {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < ChunkSize; ++i) {
+      hash += CalculatePoisonSlotHash(i);
+    }
+    return hash;
+  }();
+
+  return empty_slots_hash;
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+PlaceHash(Chunk& chunk) {
+  chunk.hash = CalculateHash(chunk);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+VerifyHeader(const Chunk& chunk) {
+  MASSERT(chunk.first_canary == CANARY_VALUE, Errc::CORRUPTED_FIRST_CANARY);
+  MASSERT(chunk.second_canary == CANARY_VALUE,
+          Errc::CORRUPTED_SECOND_CANARY);
+  MASSERT(chunk.hash == CalculateHash(chunk), Errc::HASH_NOT_THE_SAME);
+  MASSERT(chunk.size <= ChunkSize, Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+void SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+VerifyChunk(Chunk& chunk) {
+  VerifyHeader(chunk);
+
+  uint64_t slots_hash = 0;
+  for (size_t i = 0; i < chunk.size; ++i) {
+    slots_hash += CalculateSlotHash(chunk, i);
+  }
+  for (size_t i = chunk.size; i < ChunkSize; ++i) {
+    slots_hash += CalculatePoisonSlotHash(i);
+  }
+  MASSERT(chunk.slots_hash == slots_hash, Errc::HASH_NOT_THE_SAME);
+
+  const char* end = GetSlot(chunk, ChunkSize);
+  MASSERT(poison::FindNonPoison(GetSlot(chunk, chunk.size), end) == end,
+          Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+char* SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy, Allocator>::
+GetDumpMessage(int error_code) {
+  DumpWriter out(dump_msg_buffer, DUMP_MESSAGE_MAX_CHAR_COUNT);
+  out.Write("\n- - - - DUMP MESSAGE FROM SHUSH::SEGMENTED_STACK - - - - \n");
+
+  out.Write("this address: ").WriteUnsigned(reinterpret_cast<size_t>(this))
+     .Write(".\n");
+  out.Write("Error code == ").WriteSigned(error_code)
+     .Write(" (").Write(GetErrorName(error_code)).Write(")\n");
+  out.Write("Hash function: ").Write(HashFunction::NAME)
+     .Write(", log policy: ").Write(LogPolicy::NAME)
+     .Write(", allocator: ").Write(Allocator::NAME).Write("\n\n");
+
+  out.Write("[CHUNK_SIZE] == ").WriteUnsigned(ChunkSize).Write("\n");
+  out.Write("[CHUNKS_COUNT] == ").WriteUnsigned(chunks_count_).Write("\n");
+  out.Write("[SPARE_CHUNK] == ")
+     .WriteUnsigned(reinterpret_cast<size_t>(spare_)).Write("\n");
+  out.Write("[TOP_CHUNK] == ")
+     .WriteUnsigned(reinterpret_cast<size_t>(top_)).Write("\n");
+  if (top_ != nullptr) {
+    out.Write("Byte representation of the top chunk header:\n")
+       .WriteBytes(reinterpret_cast<const char*>(top_),
+                   offsetof(Chunk, elements))
+       .Write("\n");
+    out.Write("[TOP_CHUNK_SIZE] == ").WriteUnsigned(top_->size).Write("\n");
+  }
+
+  out.Write("\n- - END OF DUMP MESSAGE FROM SHUSH::SEGMENTED_STACK - - -\n");
+
+  return out.GetMessage();
+}
+
+
+template <class T, size_t ChunkSize, class HashFunction, class LogPolicy,
+          class Allocator>
+std::atomic<size_t> SegmentedSafeStack<T, ChunkSize, HashFunction, LogPolicy,
+                                       Allocator>::stacks_count(0);
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
-// - - - - - - - - - - - - - - DYNAMIC - - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - CONCURRENT- - - - - - - - - - - - - - - - -
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
 
 /**
- * STRUCTURE:
- * [CANARY][HASH][CUR_SIZE][BUFFER_SIZE][B - U - F - F - E - R][CANARY]
+ * Lock-free (Treiber) stack of canaried nodes that any number of threads
+ * can Push to and Pop from.
+ *
+ * STRUCTURE OF A NODE:
+ * [CANARY][NEXT][HASH][E - L - E - M - E - N - T][CANARY]
+ *
+ * Nodes live in blocks that are freed only with the stack, and the heads of
+ * the stack and of the free list are (index, tag) pairs swapped with one
+ * CAS. So a node a thread still looks at is never unmapped, and a head that
+ * was popped and pushed back meanwhile fails the CAS, which is what hazard
+ * pointers or epochs would otherwise be needed for.
+ *
+ * Free nodes hold poison, which Push checks before constructing an element.
+ * Every node keeps the hash of its element, which Pop checks before handing
+ * the element out. The sum of them is kept in per-thread stripes, so
+ * updating it is an uncontended atomic add. Ok() checks it against the
+ * nodes and must be called when no other thread uses the stack.
  */
-template <class T>
-class SafeStack {
+template <class T, class LogPolicy = LogDefault>
+class ConcurrentSafeStack {
   public:
-  SafeStack();
-  ~SafeStack();
+  ConcurrentSafeStack();
+  ~ConcurrentSafeStack();
 
-  SafeStack(const SafeStack& stack)            = delete;
-  SafeStack(SafeStack&& stack)                 = delete;
-  SafeStack& operator=(const SafeStack& stack) = delete;
-  SafeStack& operator=(SafeStack&& stack)      = delete;
+  ConcurrentSafeStack(const ConcurrentSafeStack& stack)            = delete;
+  ConcurrentSafeStack(ConcurrentSafeStack&& stack)                 = delete;
+  ConcurrentSafeStack& operator=(const ConcurrentSafeStack& stack) = delete;
+  ConcurrentSafeStack& operator=(ConcurrentSafeStack&& stack)      = delete;
 
   void Push(const T& item);
   void Push(T&& item);
 
-  T Pop();
-
   /**
-   * Unheard generosity!
+   * Pops into item. Returns false if the stack was empty.
    */
-  T GetElement(size_t ind);
+  bool TryPop(T& item);
+  /**
+   * Same as TryPop, but the stack must not be empty.
+   */
+  T Pop();
 
   /**
-   * Get the size of current used space.
+   * Number of elements. Exact only when no other thread uses the stack.
    */
   size_t GetCurSize();
+
   /**
-   * Get current capacity of the stack.
+   * Checks canaries of every node, poison of every free node and the hash.
+   * Must not run concurrently with anything else.
    */
-  size_t GetBufSize();
-
   void Ok();
 
   protected:
-  /**
-   * Message for Ok() calls.
-   */
-  char* GetDumpMessage(int error_code);
-  char* GetErrorName(int error_code);
+  static constexpr uint32_t NIL_INDEX        = UINT32_MAX;
+  static constexpr size_t   FIRST_BLOCK_SIZE = 64;
+  static constexpr size_t   MAX_BLOCKS       = 26;
+  static constexpr size_t   STRIPES_COUNT    = 16;
+
+  struct Node {
+    Node();
+
+    uint64_t              first_canary;
+    std::atomic<uint32_t> next;
+    uint64_t              hash;
+    alignas(T) char       element[sizeof(T)];
+    uint64_t              second_canary;
+  };
+
+  struct alignas(64) Stripe {
+    std::atomic<uint64_t> hash{0};
+    std::atomic<int64_t>  count{0};
+  };
 
   /**
-   * Fills both sides of buffer with canaries.
-   */
-  void FillCanaries(size_t all_buffer_size);
-  /**
-   * Sets current size of stack in buffer.
+   * A head is the index of the top node and a tag that changes on every
+   * update.
    */
-  void SetCurSizeVal(size_t cur_size);
+  static uint64_t MakeHead(uint32_t index, uint32_t tag);
+  static uint32_t GetHeadIndex(uint64_t head);
+  static uint32_t GetHeadTag(uint64_t head);
+
   /**
-   * Sets capacity of the stack in buffer.
+   * Block k holds FIRST_BLOCK_SIZE << k nodes.
    */
-  void SetBufferSizeVal(size_t buffer_size);
+  static size_t GetBlockIndex(uint32_t index);
+  static size_t GetBlockBegin(size_t block);
+  Node& GetNode(uint32_t index);
+
+  void     PushHead(std::atomic<uint64_t>& head, uint32_t index);
+  uint32_t PopHead(std::atomic<uint64_t>& head);
+
   /**
-   * Fills given range with poison values.
+   * Takes a free node, from the free list or never used yet.
    */
-  void FillWithPoison(char* from, char* to);
+  uint32_t AcquireNode();
+  void     ReleaseNode(uint32_t index);
+
   /**
-   * Calculates and places hash into corresponding place
+   * Constructs the element in a free node and pushes the node. If the
+   * constructor throws, the node goes back to the free list poisoned.
    */
-  void CalculateAndPlaceHash(size_t all_buffer_size);
-  void CalculateAndPlaceHash();
+  template <class Item>
+  void PushItem(Item&& item);
+  void PushNode(uint32_t index);
 
-  uint64_t GetHashValue();
-  uint64_t GetFirstCanary();
-  uint64_t GetSecondCanary();
   /**
-   * Get size of all allocated space. In chars.
+   * Stripe of the calling thread.
    */
-  size_t GetAllBufferSize();
+  Stripe&  GetStripe();
+  uint64_t CalculateNodeHash(uint32_t index);
+
+  bool IsPoison(const Node& node);
+  void VerifyCanaries(const Node& node);
+
+  char* GetDumpMessage(int error_code);
+
+  std::atomic<uint64_t> head_;
+  std::atomic<uint64_t> free_head_;
+  std::atomic<uint32_t> next_unused_;
+  std::atomic<Node*>    blocks_[MAX_BLOCKS];
+  Stripe                stripes_[STRIPES_COUNT];
+  logs::Logger          logger_;
+  static std::atomic<size_t> stacks_count;
+};
+
+
+template <class T, class LogPolicy>
+ConcurrentSafeStack<T, LogPolicy>::Node::Node()
+  : first_canary(CANARY_VALUE)
+  , next(NIL_INDEX)
+  , hash(0)
+  , second_canary(CANARY_VALUE) {
+  poison::Fill(element, element + sizeof(T));
+}
+
+
+template <class T, class LogPolicy>
+ConcurrentSafeStack<T, LogPolicy>::ConcurrentSafeStack()
+  : head_(MakeHead(NIL_INDEX, 0))
+  , free_head_(MakeHead(NIL_INDEX, 0))
+  , next_unused_(0)
+  , logger_("shush-concurrent-stack-" + std::to_string(stacks_count++)) {
+  for (std::atomic<Node*>& block : blocks_) {
+    block.store(nullptr, std::memory_order_relaxed);
+  }
+  SHUSH_STACK_DBG("Construction of the CONCURRENT stack completed.");
+}
+
+
+template <class T, class LogPolicy>
+ConcurrentSafeStack<T, LogPolicy>::~ConcurrentSafeStack() {
+  SHUSH_STACK_DBG("Destructing the CONCURRENT stack...");
+  if constexpr (!std::is_trivially_destructible_v<T>) {
+    for (uint32_t i = GetHeadIndex(head_.load()); i != NIL_INDEX;
+         i = GetNode(i).next.load()) {
+      reinterpret_cast<T*>(GetNode(i).element)->~T();
+    }
+  }
+
+  for (std::atomic<Node*>& block : blocks_) {
+    delete[] block.load();
+  }
+  --stacks_count;
+}
+
+
+template <class T, class LogPolicy>
+void ConcurrentSafeStack<T, LogPolicy>::Push(const T& item) {
+  PushItem(item);
+}
+
+
+template <class T, class LogPolicy>
+void ConcurrentSafeStack<T, LogPolicy>::Push(T&& item) {
+  PushItem(std::move(item));
+}
+
+
+template <class T, class LogPolicy>
+bool ConcurrentSafeStack<T, LogPolicy>::TryPop(T& item) {
+  const uint32_t index = PopHead(head_);
+  if (index == NIL_INDEX) {
+    return false;
+  }
+
+  Node& node = GetNode(index);
+  VerifyCanaries(node);
+  const uint64_t hash = CalculateNodeHash(index);
+  MASSERT(node.hash == hash, Errc::HASH_NOT_THE_SAME);
+
+  Stripe& stripe = GetStripe();
+  stripe.hash.fetch_sub(hash, std::memory_order_relaxed);
+  stripe.count.fetch_sub(1, std::memory_order_relaxed);
+
+  T* element = reinterpret_cast<T*>(node.element);
+  item = std::move(*element);
+  element->~T();
+  poison::Fill(node.element, node.element + sizeof(T));
+
+  ReleaseNode(index);
+  return true;
+}
+
+
+template <class T, class LogPolicy>
+T ConcurrentSafeStack<T, LogPolicy>::Pop() {
+  T item;
+  if (!TryPop(item)) {
+    SHUSH_STACK_LOG("Oh no, the stack is empty! Aborting...");
+    MASSERT(false, Errc::POP_ON_0_SIZE);
+  }
+
+  return item;
+}
+
+
+template <class T, class LogPolicy>
+size_t ConcurrentSafeStack<T, LogPolicy>::GetCurSize() {
+  int64_t count = 0;
+  for (Stripe& stripe : stripes_) {
+    count += stripe.count.load(std::memory_order_relaxed);
+  }
+
+  return count < 0 ? 0 : static_cast<size_t>(count);
+}
+
+
+template <class T, class LogPolicy>
+void ConcurrentSafeStack<T, LogPolicy>::Ok() {
+  SHUSH_STACK_DBG("Started verification procedure...");
+
+  const uint32_t unused = next_unused_.load();
+  for (uint32_t i = 0; i < unused; ++i) {
+    VerifyCanaries(GetNode(i));
+  }
+
+  uint64_t hash  = 0;
+  size_t   count = 0;
+  for (uint32_t i = GetHeadIndex(head_.load()); i != NIL_INDEX;
+       i = GetNode(i).next.load()) {
+    const uint64_t node_hash = CalculateNodeHash(i);
+    MASSERT(GetNode(i).hash == node_hash, Errc::HASH_NOT_THE_SAME);
+    hash += node_hash;
+    ++count;
+  }
+
+  uint64_t stored_hash = 0;
+  for (Stripe& stripe : stripes_) {
+    stored_hash += stripe.hash.load();
+  }
+  MASSERT(hash == stored_hash, Errc::HASH_NOT_THE_SAME);
+  MASSERT(count == GetCurSize(), Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+
+  for (uint32_t i = GetHeadIndex(free_head_.load()); i != NIL_INDEX;
+       i = GetNode(i).next.load()) {
+    MASSERT(IsPoison(GetNode(i)), Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+  }
+}
+
+
+template <class T, class LogPolicy>
+uint64_t ConcurrentSafeStack<T, LogPolicy>::
+MakeHead(uint32_t index, uint32_t tag) {
+  return static_cast<uint64_t>(tag) << 32 | index;
+}
+
+
+template <class T, class LogPolicy>
+uint32_t ConcurrentSafeStack<T, LogPolicy>::GetHeadIndex(uint64_t head) {
+  return static_cast<uint32_t>(head);
+}
+
+
+template <class T, class LogPolicy>
+uint32_t ConcurrentSafeStack<T, LogPolicy>::GetHeadTag(uint64_t head) {
+  return static_cast<uint32_t>(head >> 32);
+}
+
+
+template <class T, class LogPolicy>
+size_t ConcurrentSafeStack<T, LogPolicy>::GetBlockIndex(uint32_t index) {
+  const uint64_t shifted = index / FIRST_BLOCK_SIZE + 1;
+  return 63 - __builtin_clzll(shifted);
+}
+
+
+template <class T, class LogPolicy>
+size_t ConcurrentSafeStack<T, LogPolicy>::GetBlockBegin(size_t block) {
+  return FIRST_BLOCK_SIZE * ((size_t(1) << block) - 1);
+}
+
+
+template <class T, class LogPolicy>
+typename ConcurrentSafeStack<T, LogPolicy>::Node&
+ConcurrentSafeStack<T, LogPolicy>::GetNode(uint32_t index) {
+  const size_t block = GetBlockIndex(index);
+  return blocks_[block].load(std::memory_order_acquire)
+      [index - GetBlockBegin(block)];
+}
+
 
-  /**
-   * Get poison value as if it was T.
-   */
-  constexpr T GetPoisonValue();
-  /**
-   * Checks whether the given value is poison.
-   */
-  bool IsPoison(const T& val);
+template <class T, class LogPolicy>
+void ConcurrentSafeStack<T, LogPolicy>::
+PushHead(std::atomic<uint64_t>& head, uint32_t index) {
+  Node&    node     = GetNode(index);
+  uint64_t old_head = head.load(std::memory_order_relaxed);
+  do {
+    node.next.store(GetHeadIndex(old_head), std::memory_order_relaxed);
+  } while (!head.compare_exchange_weak(
+      old_head, MakeHead(index, GetHeadTag(old_head) + 1),
+      std::memory_order_release, std::memory_order_relaxed));
+}
 
-  uint64_t CalculateHash(size_t all_buffer_size);
-  uint64_t CalculateHash();
 
-  /**
-   * Doubles the capacity and reallocates the whole buffer.
-   */
-  void ReallocateDoubleSize();
+template <class T, class LogPolicy>
+uint32_t ConcurrentSafeStack<T, LogPolicy>::
+PopHead(std::atomic<uint64_t>& head) {
+  uint64_t old_head = head.load(std::memory_order_acquire);
+  while (GetHeadIndex(old_head) != NIL_INDEX) {
+    // The node may be taken by another thread right now. Then next is
+    // garbage, but so is old_head, and the CAS fails.
+    const uint32_t next =
+        GetNode(GetHeadIndex(old_head)).next.load(std::memory_order_relaxed);
+    if (head.compare_exchange_weak(
+            old_head, MakeHead(next, GetHeadTag(old_head) + 1),
+            std::memory_order_acquire, std::memory_order_acquire)) {
+      return GetHeadIndex(old_head);
+    }
+  }
 
-  char*         buf_;
-  logs::Logger  logger_;
-  static size_t stacks_count;
-};
+  return NIL_INDEX;
+}
 
 
-template <class T>
-constexpr T SafeStack<T>::GetPoisonValue() {
-  char elem[sizeof(T)];
-  for (size_t i = 0; i < sizeof(T); ++i) {
-    elem[i] = POISON_VALUE;
+template <class T, class LogPolicy>
+uint32_t ConcurrentSafeStack<T, LogPolicy>::AcquireNode() {
+  uint32_t index = PopHead(free_head_);
+  if (index == NIL_INDEX) {
+    index = next_unused_.fetch_add(1, std::memory_order_relaxed);
+    MASSERT(index < GetBlockBegin(MAX_BLOCKS), Errc::ASSERT_FAILED);
+
+    // Whoever installs the block first wins, the others throw theirs away.
+    const size_t block = GetBlockIndex(index);
+    if (blocks_[block].load(std::memory_order_acquire) == nullptr) {
+      Node* nodes    = new Node[FIRST_BLOCK_SIZE << block];
+      Node* expected = nullptr;
+      if (!blocks_[block].compare_exchange_strong(
+              expected, nodes, std::memory_order_acq_rel)) {
+        delete[] nodes;
+      }
+    }
   }
-  return *reinterpret_cast<T*>(&elem);
+
+  Node& node = GetNode(index);
+  VerifyCanaries(node);
+  MASSERT(IsPoison(node), Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+
+  return index;
 }
 
 
-template <class T>
-SafeStack<T>::SafeStack()
-  : logger_("shush-stack-" + std::to_string(stacks_count)) {
-  logger_.Dbg("Construction of the DYNAMIC stack started.");
-  logger_.Dbg(
-      "The type that is held in the stack is " +
-      std::string(typeid(T).name()) + ", and its size is " +
-      std::to_string(sizeof(T)) + ".");
+template <class T, class LogPolicy>
+void ConcurrentSafeStack<T, LogPolicy>::ReleaseNode(uint32_t index) {
+  PushHead(free_head_, index);
+}
 
-  const size_t all_size = CANARY_SIZE + HASH_SIZE +
-                          CUR_SIZE_SIZE + BUF_SIZE_SIZE +
-                          DEFAULT_INITIAL_SIZE * sizeof(T) +
-                          CANARY_SIZE;
 
-  buf_ = new char[all_size] {};
-  logger_.Dbg(
-      "Allocated " + std::to_string(all_size) +
-      " bytes of memory for DYNAMIC buffer.");
+template <class T, class LogPolicy>
+template <class Item>
+void ConcurrentSafeStack<T, LogPolicy>::PushItem(Item&& item) {
+  const uint32_t index = AcquireNode();
+  Node&          node  = GetNode(index);
+  try {
+    new(node.element) T(std::forward<Item>(item));
+  } catch (...) {
+    poison::Fill(node.element, node.element + sizeof(T));
+    ReleaseNode(index);
+    throw;
+  }
 
-  SetBufferSizeVal(DEFAULT_INITIAL_SIZE);
-  SetCurSizeVal(0);
-  FillCanaries(all_size);
-  FillWithPoison(buf_ + BUF_POS, buf_ + all_size - CANARY_SIZE);
-  CalculateAndPlaceHash(all_size);
+  PushNode(index);
+}
 
-  logger_.Dbg("Construction of the stack completed.");
-  ++stacks_count;
+
+template <class T, class LogPolicy>
+void ConcurrentSafeStack<T, LogPolicy>::PushNode(uint32_t index) {
+  Node& node = GetNode(index);
+  node.hash  = CalculateNodeHash(index);
+
+  Stripe& stripe = GetStripe();
+  stripe.hash.fetch_add(node.hash, std::memory_order_relaxed);
+  stripe.count.fetch_add(1, std::memory_order_relaxed);
+
+  PushHead(head_, index);
 }
 
 
-template <class T>
-SafeStack<T>::~SafeStack() {
-  logger_.Dbg("Destructing stack by deleting the buffer...");
-  delete[] buf_;
-  logger_.Dbg("Destruction is complete. Bye-bye!");
-  --stacks_count;
+template <class T, class LogPolicy>
+typename ConcurrentSafeStack<T, LogPolicy>::Stripe&
+ConcurrentSafeStack<T, LogPolicy>::GetStripe() {
+  static std::atomic<size_t> threads_count(0);
+  thread_local const size_t  stripe =
+      threads_count.fetch_add(1, std::memory_order_relaxed) % STRIPES_COUNT;
+
+  return stripes_[stripe];
 }
 
 
-template <class T>
-void SafeStack<T>::Push(const T& item) {
-  VERIFIED
-  logger_.Dbg("Pushing an element that is a const ref...");
+template <class T, class LogPolicy>
+uint64_t ConcurrentSafeStack<T, LogPolicy>::
+CalculateNodeHash(uint32_t index) {
+  const uint64_t bytes_hash = Wyhash::Hash(GetNode(index).element, sizeof(T));
 
-  if (GetCurSize() == GetBufSize()) {
-    logger_.Dbg(
-        "The size of buffer is equal to current size! Starting the reallocation...");
-    ReallocateDoubleSize();
-  }
+  return MixHash(bytes_hash + index * SLOT_INDEX_MULTIPLIER);
+}
 
-  const size_t pos = BUF_POS + GetCurSize() * sizeof(T);
-  new(buf_ + pos) T(item);
-  logger_.Dbg(
-      "Placed the new element in cell starting from " +
-      std::to_string(pos) + ".");
 
-  const size_t cur_size = GetCurSize() + 1;
-  SetCurSizeVal(cur_size);
-  logger_.Dbg(
-      "Pushing of const ref element is complete. The new cur size is " + std::
-      to_string(cur_size) + ".");
+template <class T, class LogPolicy>
+bool ConcurrentSafeStack<T, LogPolicy>::IsPoison(const Node& node) {
+  const char* end = node.element + sizeof(T);
+  return poison::FindNonPoison(node.element, end) == end;
+}
 
-  CalculateAndPlaceHash();
+
+template <class T, class LogPolicy>
+void ConcurrentSafeStack<T, LogPolicy>::VerifyCanaries(const Node& node) {
+  MASSERT(node.first_canary == CANARY_VALUE, Errc::CORRUPTED_FIRST_CANARY);
+  MASSERT(node.second_canary == CANARY_VALUE, Errc::CORRUPTED_SECOND_CANARY);
 }
 
 
-template <class T>
-void SafeStack<T>::Push(T&& item) {
-  VERIFIED
-  logger_.Dbg("Pushing an element that is an rvalue...");
+template <class T, class LogPolicy>
+char* ConcurrentSafeStack<T, LogPolicy>::GetDumpMessage(int error_code) {
+  DumpWriter out(dump_msg_buffer, DUMP_MESSAGE_MAX_CHAR_COUNT);
+  out.Write("\n- - - - DUMP MESSAGE FROM SHUSH::CONCURRENT_STACK- - - - \n");
 
-  if (GetCurSize() == GetBufSize()) {
-    logger_.Dbg(
-        "The size of buffer is equal to current size! Starting the reallocation...");
-    ReallocateDoubleSize();
-  }
+  const uint64_t head = head_.load();
+  out.Write("this address: ").WriteUnsigned(reinterpret_cast<size_t>(this))
+     .Write(".\n");
+  out.Write("Error code == ").WriteSigned(error_code)
+     .Write(" (").Write(GetErrorName(error_code)).Write(")\n");
+  out.Write("Log policy: ").Write(LogPolicy::NAME).Write("\n\n");
 
-  const size_t pos = BUF_POS + GetCurSize() * sizeof(T);
-  new(buf_ + pos) T(std::move(item));
-  logger_.Dbg(
-      "Placed the new element in cell starting from " +
-      std::to_string(pos) + ".");
+  out.Write("[HEAD] == ").WriteUnsigned(GetHeadIndex(head))
+     .Write(" (tag ").WriteUnsigned(GetHeadTag(head)).Write(")\n");
+  out.Write("[FREE_HEAD] == ").WriteUnsigned(GetHeadIndex(free_head_.load()))
+     .Write("\n");
+  out.Write("[CUR_SIZE] == ").WriteUnsigned(GetCurSize()).Write("\n");
+  out.Write("[USED_NODES] == ").WriteUnsigned(next_unused_.load())
+     .Write("\n");
 
-  const size_t cur_size = GetCurSize() + 1;
-  SetCurSizeVal(cur_size);
-  logger_.Dbg(
-      "Pushing of an rvalue element is complete. The new cur size is " + 
-      std::to_string(cur_size) + ".");
+  out.Write("\n- - END OF DUMP MESSAGE FROM SHUSH::CONCURRENT_STACK- - - \n");
 
-  CalculateAndPlaceHash();
+  return out.GetMessage();
 }
 
 
-template <class T>
-T SafeStack<T>::Pop() {
-  VERIFIED
-  logger_.Dbg("Started popping the element...");
+template <class T, class LogPolicy>
+std::atomic<size_t> ConcurrentSafeStack<T, LogPolicy>::stacks_count(0);
 
-  const size_t size = GetCurSize();
-  if (size == 0) {
-    logger_.Log("Oh no, the size of stack is already 0! Aborting...");
-    MASSERT(true, Errc::POP_ON_0_SIZE); //TODO maybe make non debug assert
-  }
 
-  const size_t pos = BUF_POS + (size - 1) * sizeof(T);
-  T            res = *reinterpret_cast<T*>(buf_ + pos);
-  logger_.Dbg("Got the value");
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
+// - - - - - - - - - - - - - - - - RING- - - - - - - - - - - - - - - - - -
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
 
-  FillWithPoison(buf_ + pos, buf_ + pos + sizeof(T));
+/**
+ * One thread pushes and one thread pops. Both are wait-free.
+ */
+struct Spsc {
+  static constexpr bool        MULTI = false;
+  static constexpr const char* NAME  = "single producer, single consumer";
+};
 
-  SetCurSizeVal(size - 1);
-  logger_.Dbg(
-      "Popping is complete. The new size is " +
-      std::to_string(size - 1));
+/**
+ * Any number of threads push and pop, each slot has a sequence number that
+ * says whose turn it is (Vyukov's bounded queue). Lock-free.
+ */
+struct Mpmc {
+  static constexpr bool        MULTI = true;
+  static constexpr const char* NAME  = "multiple producers and consumers";
+};
 
-  CalculateAndPlaceHash();
+/**
+ * Bounded FIFO queue with the protection of SafeStack.
+ *
+ * STRUCTURE OF THE OBJECT:
+ * [CANARY][HEAD][TAIL][CANARY]
+ * STRUCTURE OF THE BUFFER:
+ * [CANARY][S - L - O - T - S][CANARY]
+ *
+ * HEAD and TAIL are on cache lines of their own, so the producer and the
+ * consumer do not share one. A slot holds an element and its hash, which
+ * mixes in the position, so an element that was changed or moved to
+ * another slot fails the Pop that takes it. Free slots hold poison, which
+ * Push checks before constructing an element. If the constructor throws in
+ * Mpmc mode, the tail has already moved past the slot, so it is published
+ * as skipped: poison with the complement of its hash, which Pop passes
+ * over. In Spsc mode an index is
+ * kept with its hash by the only thread writing it, which checks it on
+ * every operation. Ok() checks everything and must be called when no
+ * other thread uses the ring.
+ */
+template <class T, class ConcurrencyPolicy = Spsc,
+          class LogPolicy = LogDefault>
+class SafeRing {
+  public:
+  /**
+   * The capacity is rounded up to a power of two.
+   */
+  explicit SafeRing(size_t capacity = DEFAULT_RESERVED_SIZE);
+  ~SafeRing();
 
-  return res;
-}
+  SafeRing(const SafeRing& ring)            = delete;
+  SafeRing(SafeRing&& ring)                 = delete;
+  SafeRing& operator=(const SafeRing& ring) = delete;
+  SafeRing& operator=(SafeRing&& ring)      = delete;
 
+  /**
+   * Returns false if the ring is full.
+   */
+  bool TryPush(const T& item);
+  bool TryPush(T&& item);
+  /**
+   * Same as TryPush, but the ring must not be full.
+   */
+  void Push(const T& item);
+  /**
+   * Pops the oldest element into item. Returns false if the ring was empty.
+   */
+  bool TryPop(T& item);
+  /**
+   * Same as TryPop, but the ring must not be empty.
+   */
+  T Pop();
 
-template <class T>
-void SafeStack<T>::Ok() {
-  logger_.Dbg("Started verification procedure...");
+  /**
+   * Number of elements. Exact only when no other thread uses the ring, and
+   * counts skipped slots that no Pop has passed yet.
+   */
+  size_t GetCurSize();
+  size_t GetBufSize();
 
-  MASSERT(this != nullptr, Errc::THIS_PTR_IS_NULLPTR);
-  MASSERT(GetFirstCanary() == CANARY_VALUE, Errc::CORRUPTED_FIRST_CANARY);
-  MASSERT(GetSecondCanary() == CANARY_VALUE, Errc::CORRUPTED_SECOND_CANARY);
-  MASSERT(GetHashValue() == CalculateHash(), Errc::HASH_NOT_THE_SAME);
-  MASSERT(GetCurSize() <= GetBufSize(), Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+  /**
+   * Checks canaries, indices, the hash of every element and poison of every
+   * free slot. Must not run concurrently with anything else.
+   */
+  void Ok();
 
-  const size_t cur_size_bytes = BUF_POS + GetCurSize() * sizeof(T);
-  for (size_t i = BUF_POS, all_size = GetAllBufferSize() - CANARY_SIZE;
-       i < all_size; i += sizeof(T)) {
-    if (i < cur_size_bytes) {
-      if (IsPoison(*reinterpret_cast<T*>(buf_ + i))) {
-        logger_.Dbg(
-         "WARNING: element " + std::to_string((i - BUF_POS) / sizeof(T)) +
-            " is equal to poison value");
-      }
-    } else {
-      MASSERT(
-          IsPoison(*reinterpret_cast<T*>(buf_ + i)),
-          Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
-    }
-  }
-}
+  protected:
+  struct alignas(CACHE_LINE_SIZE) Index {
+    std::atomic<size_t> value{0};
+    // MixHash(value), in Spsc mode.
+    uint64_t            check = MixHash(0);
+    // The other index as this side saw it last, in Spsc mode.
+    size_t              cached = 0;
+  };
 
+  struct SpscSlot {
+    uint64_t        hash;
+    alignas(T) char element[sizeof(T)];
+  };
 
-template <class T>
-char* SafeStack<T>::GetDumpMessage(int error_code) {
-  logger_.Log("WARNING: Oh-oh, it appears a GetDumpMessage was invoked!");
-  std::string str =
-      "\n- - - - - - DUMP MESSAGE FROM SHUSH::STACK- - - - - - \n";
-
-  str += "this address: " + std::to_string(reinterpret_cast<size_t>(this)) +
-      ".\n";
-  str += "Error code == " + std::to_string(error_code) + " (";
-  str += GetErrorName(error_code);
-  str += ")\n\n";
-
-  str += "Byte representation of the stack:\n" + std::string(buf_) + "\n\n";
-
-  str += "Detailed:\n";
-  str += dump::GetBadGoodStr(GetFirstCanary() == CANARY_VALUE) +
-      "[CANARY] == " + std::to_string(GetFirstCanary()) + "\n";
-  str += dump::GetBadGoodStr(CalculateHash() == GetHashValue()) +
-      "[HASH] == " + std::to_string(CalculateHash()) + "\n";
-  str += dump::GetBadGoodStr(GetCurSize() <= GetBufSize()) +
-      "[CUR_SIZE] == " + std::to_string(GetCurSize()) + "\n";
-  str += dump::GetBadGoodStr(GetCurSize() <= GetBufSize()) +
-      "[BUF_SIZE] == " + std::to_string(GetBufSize()) + "\n";
-
-  using std::to_string;
-  const size_t cur_size = GetCurSize();
-  for (size_t i = 0; i < cur_size; ++i) {
-    str += std::string(IsPoison(GetElement(i)) ? "(WARNING) " : "(GOOD) ")
-        + "[" + to_string(i) + "] == " +
-        to_string(GetElement(i)) + "\n";
-  }
+  struct MpmcSlot {
+    std::atomic<size_t> sequence;
+    uint64_t            hash;
+    alignas(T) char     element[sizeof(T)];
+  };
 
-  for (size_t i = cur_size, buf_size = GetBufSize(); i < buf_size; ++i) {
-    str += dump::GetBadGoodStr(IsPoison(GetElement(i))) +
-        "[" + to_string(i) + "] == " +
-        to_string(GetElement(i)) + "\n";
-  }
+  using Slot =
+      std::conditional_t<ConcurrencyPolicy::MULTI, MpmcSlot, SpscSlot>;
 
-  str += dump::GetBadGoodStr(GetSecondCanary() == CANARY_VALUE) +
-      "[CANARY] == " + std::to_string(GetSecondCanary()) + "\n";
+  static constexpr size_t BUF_ALIGNMENT =
+      std::max(alignof(Slot), CACHE_LINE_SIZE);
+  static constexpr size_t SLOTS_POS = AlignUp(CANARY_SIZE, BUF_ALIGNMENT);
 
-  str += "\n- - - -END OF DUMP MESSAGE FROM SHUSH::STACK- - - - - - \n";
+  static size_t RoundToPowerOfTwo(size_t capacity);
 
-  memcpy(dump_msg_buffer, &str[0], std::min(DUMP_MESSAGE_MAX_CHAR_COUNT, str.length()));
+  template <class U>
+  bool Emplace(U&& item);
 
-  return dump_msg_buffer;
-}
+  /**
+   * Takes the position to push to, or returns false if the ring is full.
+   */
+  bool ClaimPush(size_t& pos);
+  void PublishPush(size_t pos);
+  /**
+   * Takes the position to pop from, or returns false if the ring is empty.
+   */
+  bool ClaimPop(size_t& pos);
+  void PublishPop(size_t pos);
 
+  Slot&    GetSlot(size_t pos);
+  size_t   GetAllBufferSize();
+  uint64_t CalculateSlotHash(const Slot& slot, size_t pos);
+  bool     IsPoison(const Slot& slot);
+  /**
+   * Whether a push to the used slot threw, in Mpmc mode.
+   */
+  bool     IsSkipped(const Slot& slot, size_t pos);
+  void     VerifyIndex(const Index& index);
+  void     VerifyCanaries();
 
-template <class T>
-char* SafeStack<T>::GetErrorName(int error_code) {
-  switch (error_code) {
-  case ASSERT_FAILED: {
-    strcpy(dump_error_name_buffer, "assertion failed");
-  }
-  case THIS_PTR_IS_NULLPTR: {
-    strcpy(dump_error_name_buffer, "[this] pointer points to nullptr. Have you forgot to initialize the object?");
-  }
-  case CORRUPTED_FIRST_CANARY: {
-    strcpy(dump_error_name_buffer, "first [CANARY] was corrupted. Perhaps, someone tried to overwrite it");
-  }
-  case CORRUPTED_SECOND_CANARY: {
-    strcpy(dump_error_name_buffer, "second [CANARY] was corrupted. Perhaps, someone tried to overwrite it");
-  }
-  case CUR_SIZE_IS_BIGGER_THAN_BUF: {
-    strcpy(dump_error_name_buffer, "current size value of stack is bigger than buffer size value");
-  }
-  case HASH_NOT_THE_SAME: {
-    strcpy(dump_error_name_buffer, "calculated hash is not equal to what is stored");
-  }
-  case UNINITIALIZED_CELL_IS_NOT_POISON: {
-    strcpy(dump_error_name_buffer, "one of the uninitialized cells is not equal to poison value. Perhaps, someone tried to overwrite it");
-  }
-  case POP_ON_0_SIZE: {
-    strcpy(dump_error_name_buffer, "the size of the stack was 0, and a Pop() method has been called.");
-  }
-  case REALLOCATION_IN_STATIC_STACK: {
-    strcpy(dump_error_name_buffer, "static stack overflow. Consider increasing its capacity or switching to dynamic stack.");
-  }
-  default: {
-    strcpy(dump_error_name_buffer, "UNKNOWN ERROR CODE");
-  }
-  }
+  char* GetDumpMessage(int error_code);
 
-  return dump_error_name_buffer;
-}
+  uint64_t     first_canary_;
+  Index        head_;
+  Index        tail_;
+  size_t       mask_;
+  char*        buf_;
+  logs::Logger logger_;
+  uint64_t     second_canary_;
+  static std::atomic<size_t> rings_count;
+};
 
 
-template <class T>
-bool SafeStack<T>::IsPoison(const T& val) {
-  for (size_t i = 0; i < sizeof(T); ++i) {
-    if (reinterpret_cast<const char*>(&val)[i] != POISON_VALUE) {
-      return false;
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+SafeRing<T, ConcurrencyPolicy, LogPolicy>::SafeRing(size_t capacity)
+  : first_canary_(CANARY_VALUE)
+  , mask_(RoundToPowerOfTwo(capacity) - 1)
+  , buf_(nullptr)
+  , logger_("shush-ring-" + std::to_string(rings_count++))
+  , second_canary_(CANARY_VALUE) {
+  const size_t all_size = GetAllBufferSize();
+  buf_ = HeapAllocator().Allocate(all_size, BUF_ALIGNMENT);
+  SHUSH_STACK_DBG(
+      "Allocated " + std::to_string(all_size) +
+      " bytes of memory for the RING buffer.");
+
+  memcpy(buf_, &CANARY_VALUE, CANARY_SIZE);
+  memcpy(buf_ + all_size - CANARY_SIZE, &CANARY_VALUE, CANARY_SIZE);
+  for (size_t pos = 0; pos <= mask_; ++pos) {
+    Slot& slot = *new(buf_ + SLOTS_POS + pos * sizeof(Slot)) Slot;
+    if constexpr (ConcurrencyPolicy::MULTI) {
+      slot.sequence.store(pos, std::memory_order_relaxed);
     }
+    poison::Fill(slot.element, slot.element + sizeof(T));
   }
-  return true;
+
+  SHUSH_STACK_DBG("Construction of the RING completed.");
 }
 
 
-template <class T>
-void SafeStack<T>::FillCanaries(size_t all_buffer_size) {
-  memcpy(buf_, &CANARY_VALUE, CANARY_SIZE);
-  memcpy(
-      buf_ + all_buffer_size - CANARY_SIZE,
-      &CANARY_VALUE, CANARY_SIZE);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+SafeRing<T, ConcurrencyPolicy, LogPolicy>::~SafeRing() {
+  SHUSH_STACK_DBG("Destructing the RING...");
+  if constexpr (!std::is_trivially_destructible_v<T>) {
+    const size_t tail = tail_.value.load();
+    for (size_t pos = head_.value.load(); pos != tail; ++pos) {
+      if (!IsSkipped(GetSlot(pos), pos)) {
+        reinterpret_cast<T*>(GetSlot(pos).element)->~T();
+      }
+    }
+  }
 
-  logger_.Dbg(
-      "Filled canaries inside " +
-      std::to_string(all_buffer_size) + " bytes.");
+  HeapAllocator().Deallocate(buf_, GetAllBufferSize(), BUF_ALIGNMENT);
 }
 
 
-template <class T>
-void SafeStack<T>::SetCurSizeVal(size_t cur_size) {
-  memcpy(buf_ + CUR_SIZE_POS, &cur_size, CUR_SIZE_SIZE);
-
-  logger_.Dbg(
-      "Set current size of the stack to " +
-      std::to_string(cur_size) + ".");
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+bool SafeRing<T, ConcurrencyPolicy, LogPolicy>::TryPush(const T& item) {
+  return Emplace(item);
 }
 
 
-template <class T>
-void SafeStack<T>::SetBufferSizeVal(size_t buffer_size) {
-  memcpy(buf_ + BUF_SIZE_POS, &buffer_size, BUF_SIZE_SIZE);
-
-  logger_.Dbg(
-      "Set buffer size value of the stack to " +
-      std::to_string(buffer_size) + ".");
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+bool SafeRing<T, ConcurrencyPolicy, LogPolicy>::TryPush(T&& item) {
+  return Emplace(std::move(item));
 }
 
 
-template <class T>
-void SafeStack<T>::
-FillWithPoison(char* from, char* to) {
-  for (auto i = from; i != to; ++i) {
-    *i = POISON_VALUE;
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+void SafeRing<T, ConcurrencyPolicy, LogPolicy>::Push(const T& item) {
+  if (!TryPush(item)) {
+    SHUSH_STACK_LOG("Oh no, the ring is full! Aborting...");
+    MASSERT(false, Errc::REALLOCATION_IN_STATIC_STACK);
   }
-
-  logger_.Dbg(
-      "Filled addresses from " +
-      std::to_string(reinterpret_cast<size_t>(from)) + " to " +
-      std::to_string(reinterpret_cast<size_t>(to)) + " with Poison.");
 }
 
 
-template <class T>
-void SafeStack<T>::CalculateAndPlaceHash(
-    const size_t all_buffer_size) {
-  uint64_t hash = CalculateHash(all_buffer_size);
-  memcpy(buf_ + HASH_POS, &hash, HASH_SIZE);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+bool SafeRing<T, ConcurrencyPolicy, LogPolicy>::TryPop(T& item) {
+  size_t pos = 0;
+  while (true) {
+    if (!ClaimPop(pos)) {
+      return false;
+    }
+    if (!IsSkipped(GetSlot(pos), pos)) {
+      break;
+    }
+    // Nothing to take from a slot whose push threw.
+    PublishPop(pos);
+  }
 
-  logger_.Dbg("Placed hash.");
-}
+  Slot& slot = GetSlot(pos);
+  MASSERT(slot.hash == CalculateSlotHash(slot, pos),
+          Errc::HASH_NOT_THE_SAME);
 
+  T* element = reinterpret_cast<T*>(slot.element);
+  item = std::move(*element);
+  element->~T();
+  poison::Fill(slot.element, slot.element + sizeof(T));
 
-template <class T>
-void SafeStack<T>::CalculateAndPlaceHash() {
-  CalculateAndPlaceHash(GetAllBufferSize());
+  PublishPop(pos);
+  return true;
 }
 
 
-template <class T>
-uint64_t SafeStack<T>::CalculateHash(size_t all_buffer_size) {
-  const uint64_t hash = 
-      std::hash<size_t>()(reinterpret_cast<size_t>(this)) +
-      std::hash<std::string_view>()(std::string_view(buf_, HASH_POS)) +
-      std::hash<std::string_view>()(
-          std::string_view(
-              buf_ + HASH_POS + HASH_SIZE,
-                           all_buffer_size - HASH_SIZE - HASH_POS + 1)
-      );
-
-  logger_.Dbg("Calculated hash. Its value: " + std::to_string(hash));
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+T SafeRing<T, ConcurrencyPolicy, LogPolicy>::Pop() {
+  T item;
+  if (!TryPop(item)) {
+    SHUSH_STACK_LOG("Oh no, the ring is empty! Aborting...");
+    MASSERT(false, Errc::POP_ON_0_SIZE);
+  }
 
-  return hash;
+  return item;
 }
 
 
-template <class T>
-uint64_t SafeStack<T>::CalculateHash() {
-  return CalculateHash(GetAllBufferSize());
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+size_t SafeRing<T, ConcurrencyPolicy, LogPolicy>::GetCurSize() {
+  const size_t head = head_.value.load(std::memory_order_acquire);
+  const size_t tail = tail_.value.load(std::memory_order_acquire);
+  return tail - head > mask_ + 1 ? 0 : tail - head;
 }
 
 
-template <class T>
-T SafeStack<T>::GetElement(size_t ind) {
-  return *reinterpret_cast<T*>(buf_ + BUF_POS + ind * sizeof(T));
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+size_t SafeRing<T, ConcurrencyPolicy, LogPolicy>::GetBufSize() {
+  return mask_ + 1;
 }
 
 
-template <class T>
-void SafeStack<T>::ReallocateDoubleSize() {
-  VERIFIED
-  const size_t all_size     = GetAllBufferSize();
-  const size_t buf_t_size   = GetBufSize();
-  const size_t new_all_size = all_size + buf_t_size * sizeof(T);
-  char*        new_buf      = new char[new_all_size];
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+void SafeRing<T, ConcurrencyPolicy, LogPolicy>::Ok() {
+  SHUSH_STACK_DBG("Started verification procedure...");
 
-  logger_.Dbg(
-      "Started reallocating stack. Initial all_size = " +
-      std::to_string(all_size) + ", new_all_size = " +
-      std::to_string(new_all_size));
+  VerifyCanaries();
+  if constexpr (!ConcurrencyPolicy::MULTI) {
+    VerifyIndex(head_);
+    VerifyIndex(tail_);
+  }
 
-  logger_.Dbg("Now starting to call constructors in allocated space.");
+  const size_t head = head_.value.load();
+  const size_t tail = tail_.value.load();
+  MASSERT(tail - head <= mask_ + 1, Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
 
-  for (size_t i = 0; i < buf_t_size; ++i) {
-    const size_t pos = BUF_POS + i * sizeof(T);
-    new(new_buf + pos) T(std::move(*reinterpret_cast<T*>(buf_ + pos)));
+  for (size_t pos = head; pos != head + mask_ + 1; ++pos) {
+    const Slot& slot = GetSlot(pos);
+    const bool   used = pos - head < tail - head;
+    if constexpr (ConcurrencyPolicy::MULTI) {
+      MASSERT(slot.sequence.load() == (used ? pos + 1 : pos),
+              Errc::ASSERT_FAILED);
+    }
+    if (used && !IsSkipped(slot, pos)) {
+      MASSERT(slot.hash == CalculateSlotHash(slot, pos),
+              Errc::HASH_NOT_THE_SAME);
+    } else {
+      MASSERT(IsPoison(slot), Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+    }
   }
+}
 
-  logger_.Dbg("Deleting the old buffer...");
-  delete[] buf_;
-  buf_ = new_buf;
-
-  SetBufferSizeVal(buf_t_size * 2);
-  SetCurSizeVal(buf_t_size);
-  FillCanaries(new_all_size);
-  FillWithPoison(
-      buf_ + all_size - CANARY_SIZE,
-      buf_ + new_all_size - CANARY_SIZE);
 
-  logger_.Dbg("Reallocation completed.");
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+size_t SafeRing<T, ConcurrencyPolicy, LogPolicy>::
+RoundToPowerOfTwo(size_t capacity) {
+  size_t rounded = 1;
+  while (rounded < capacity) {
+    rounded *= 2;
+  }
 
-  CalculateAndPlaceHash(new_all_size);
+  return rounded;
 }
 
 
-template <class T>
-uint64_t SafeStack<T>::GetFirstCanary() {
-  return *reinterpret_cast<uint64_t*>(buf_);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+template <class U>
+bool SafeRing<T, ConcurrencyPolicy, LogPolicy>::Emplace(U&& item) {
+  size_t pos = 0;
+  if (!ClaimPush(pos)) {
+    return false;
+  }
+
+  Slot& slot = GetSlot(pos);
+  MASSERT(IsPoison(slot), Errc::UNINITIALIZED_CELL_IS_NOT_POISON);
+  try {
+    new(slot.element) T(std::forward<U>(item));
+  } catch (...) {
+    poison::Fill(slot.element, slot.element + sizeof(T));
+    // Later pushes may have claimed the slots after this one, so it cannot
+    // be given back, and consumers wait for it to be published.
+    if constexpr (ConcurrencyPolicy::MULTI) {
+      slot.hash = ~CalculateSlotHash(slot, pos);
+      PublishPush(pos);
+    }
+    throw;
+  }
+  slot.hash = CalculateSlotHash(slot, pos);
+
+  PublishPush(pos);
+  return true;
 }
 
 
-template <class T>
-uint64_t SafeStack<T>::GetSecondCanary() {
-  return *reinterpret_cast<uint64_t*>(buf_ + GetAllBufferSize()
-                                      - CANARY_SIZE);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+bool SafeRing<T, ConcurrencyPolicy, LogPolicy>::ClaimPush(size_t& pos) {
+  if constexpr (ConcurrencyPolicy::MULTI) {
+    pos = tail_.value.load(std::memory_order_relaxed);
+    while (true) {
+      const size_t sequence =
+          GetSlot(pos).sequence.load(std::memory_order_acquire);
+      const auto lag = static_cast<ptrdiff_t>(sequence - pos);
+      if (lag == 0) {
+        if (tail_.value.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          return true;
+        }
+      } else if (lag < 0) {
+        // The slot still holds the element of the previous lap.
+        return false;
+      } else {
+        pos = tail_.value.load(std::memory_order_relaxed);
+      }
+    }
+  } else {
+    pos = tail_.value.load(std::memory_order_relaxed);
+    VerifyIndex(tail_);
+    if (pos - tail_.cached > mask_) {
+      tail_.cached = head_.value.load(std::memory_order_acquire);
+      MASSERT(pos - tail_.cached <= mask_ + 1,
+              Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+      if (pos - tail_.cached > mask_) {
+        return false;
+      }
+    }
+    return true;
+  }
 }
 
 
-template <class T>
-size_t SafeStack<T>::GetCurSize() {
-  return *reinterpret_cast<size_t*>(buf_ + CUR_SIZE_POS);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+void SafeRing<T, ConcurrencyPolicy, LogPolicy>::PublishPush(size_t pos) {
+  if constexpr (ConcurrencyPolicy::MULTI) {
+    GetSlot(pos).sequence.store(pos + 1, std::memory_order_release);
+  } else {
+    tail_.check = MixHash(pos + 1);
+    tail_.value.store(pos + 1, std::memory_order_release);
+  }
 }
 
 
-template <class T>
-size_t SafeStack<T>::GetBufSize() {
-  return *reinterpret_cast<size_t*>(buf_ + BUF_SIZE_POS);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+bool SafeRing<T, ConcurrencyPolicy, LogPolicy>::ClaimPop(size_t& pos) {
+  if constexpr (ConcurrencyPolicy::MULTI) {
+    pos = head_.value.load(std::memory_order_relaxed);
+    while (true) {
+      const size_t sequence =
+          GetSlot(pos).sequence.load(std::memory_order_acquire);
+      const auto lag = static_cast<ptrdiff_t>(sequence - (pos + 1));
+      if (lag == 0) {
+        if (head_.value.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          return true;
+        }
+      } else if (lag < 0) {
+        // Nothing was pushed to the slot yet.
+        return false;
+      } else {
+        pos = head_.value.load(std::memory_order_relaxed);
+      }
+    }
+  } else {
+    pos = head_.value.load(std::memory_order_relaxed);
+    VerifyIndex(head_);
+    if (pos == head_.cached) {
+      head_.cached = tail_.value.load(std::memory_order_acquire);
+      MASSERT(head_.cached - pos <= mask_ + 1,
+              Errc::CUR_SIZE_IS_BIGGER_THAN_BUF);
+      if (pos == head_.cached) {
+        return false;
+      }
+    }
+    return true;
+  }
 }
 
 
-template <class T>
-uint64_t SafeStack<T>::GetHashValue() {
-  return *reinterpret_cast<uint64_t*>(buf_ + HASH_POS);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+void SafeRing<T, ConcurrencyPolicy, LogPolicy>::PublishPop(size_t pos) {
+  if constexpr (ConcurrencyPolicy::MULTI) {
+    GetSlot(pos).sequence.store(pos + mask_ + 1, std::memory_order_release);
+  } else {
+    head_.check = MixHash(pos + 1);
+    head_.value.store(pos + 1, std::memory_order_release);
+  }
 }
 
 
-template <class T>
-size_t SafeStack<T>::GetAllBufferSize() {
-  return GetBufSize() * sizeof(T) + CANARY_SIZE * 2 +
-         HASH_SIZE + CUR_SIZE_SIZE + BUF_SIZE_SIZE;
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+typename SafeRing<T, ConcurrencyPolicy, LogPolicy>::Slot&
+SafeRing<T, ConcurrencyPolicy, LogPolicy>::GetSlot(size_t pos) {
+  return *reinterpret_cast<Slot*>(
+      buf_ + SLOTS_POS + (pos & mask_) * sizeof(Slot));
 }
 
 
-template <class T>
-size_t SafeStack<T>::stacks_count(0);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+size_t SafeRing<T, ConcurrencyPolicy, LogPolicy>::GetAllBufferSize() {
+  return SLOTS_POS + (mask_ + 1) * sizeof(Slot) + CANARY_SIZE;
+}
 
-// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
-// - - - - - - - - - - - - - - STATIC- - - - - - - - - - - - - - - - - - - 
-// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
 
-template <class T, size_t ReservedSize = DEFAULT_RESERVED_SIZE>
-class SafeStackStatic : public SafeStack<T> {
-  public:
-  SafeStackStatic();
-  ~SafeStackStatic();
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+uint64_t SafeRing<T, ConcurrencyPolicy, LogPolicy>::
+CalculateSlotHash(const Slot& slot, size_t pos) {
+  const uint64_t bytes_hash = Wyhash::Hash(slot.element, sizeof(T));
 
-  SafeStackStatic(const SafeStackStatic& stack)            = delete;
-  SafeStackStatic(SafeStackStatic&& stack)                 = delete;
-  SafeStackStatic& operator=(const SafeStackStatic& stack) = delete;
-  SafeStackStatic& operator=(SafeStackStatic&& stack)      = delete;
+  return MixHash(bytes_hash + pos * SLOT_INDEX_MULTIPLIER);
+}
 
-  private:
-  void ReallocateDoubleSize();
 
-  char buf_static_[CANARY_SIZE + HASH_SIZE +
-                   CUR_SIZE_SIZE + BUF_SIZE_SIZE +
-                   ReservedSize * sizeof(T) + CANARY_SIZE]{};
-};
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+bool SafeRing<T, ConcurrencyPolicy, LogPolicy>::IsPoison(const Slot& slot) {
+  const char* end = slot.element + sizeof(T);
+  return poison::FindNonPoison(slot.element, end) == end;
+}
 
 
-template <class T, size_t ReservedSize>
-SafeStackStatic<T, ReservedSize>::SafeStackStatic() {
-  this->logger_.Dbg("Construction of the STATIC stack started.");
-  this->logger_.Dbg(
-      "The type that is held in the stack is " +
-      std::string(typeid(T).name()) + ", and its size is " +
-      std::to_string(sizeof(T)) + ".");
-  this->logger_.Dbg("The reserved size is " + std::to_string(ReservedSize));
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+bool SafeRing<T, ConcurrencyPolicy, LogPolicy>::
+IsSkipped(const Slot& slot, size_t pos) {
+  if constexpr (!ConcurrencyPolicy::MULTI) {
+    return false;
+  }
+
+  // Poison fails on the first bytes of most elements, before any hashing.
+  return IsPoison(slot) && slot.hash == ~CalculateSlotHash(slot, pos);
+}
 
-  const size_t all_size = CANARY_SIZE + HASH_SIZE +
-                          CUR_SIZE_SIZE + BUF_SIZE_SIZE +
-                          ReservedSize * sizeof(T) + CANARY_SIZE;
 
-  this->logger_.Dbg("Setting buf_ ptr to static buf_ pointer.");
-  this->buf_ = buf_static_;
-  this->SetBufferSizeVal(ReservedSize);
-  this->SetCurSizeVal(0);
-  this->FillCanaries(all_size);
-  this->FillWithPoison(
-      this->buf_ + BUF_POS,
-      this->buf_ + all_size - CANARY_SIZE);
-  this->CalculateAndPlaceHash(all_size);
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+void SafeRing<T, ConcurrencyPolicy, LogPolicy>::
+VerifyIndex(const Index& index) {
+  MASSERT(index.check ==
+              MixHash(index.value.load(std::memory_order_relaxed)),
+          Errc::HASH_NOT_THE_SAME);
 }
 
 
-template <class T, size_t ReservedSize>
-SafeStackStatic<T, ReservedSize>::~SafeStackStatic() {
-  this->logger_.Dbg("Destruction of the safe STATIC stack has been invoked.");
-  this->logger_.Dbg("Untying the pointer buf_ to nullptr...");
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+void SafeRing<T, ConcurrencyPolicy, LogPolicy>::VerifyCanaries() {
+  uint64_t buf_first_canary  = 0;
+  uint64_t buf_second_canary = 0;
+  memcpy(&buf_first_canary, buf_, CANARY_SIZE);
+  memcpy(&buf_second_canary, buf_ + GetAllBufferSize() - CANARY_SIZE,
+         CANARY_SIZE);
 
-  this->buf_ = nullptr;
+  MASSERT(first_canary_ == CANARY_VALUE && buf_first_canary == CANARY_VALUE,
+          Errc::CORRUPTED_FIRST_CANARY);
+  MASSERT(second_canary_ == CANARY_VALUE &&
+              buf_second_canary == CANARY_VALUE,
+          Errc::CORRUPTED_SECOND_CANARY);
 }
 
 
-template <class T, size_t ReservedSize>
-void SafeStackStatic<T, ReservedSize>::ReallocateDoubleSize() {
-  this->logger_.Log(
-      "Oh no! Reallocation was called in STATIC stack! Aborting...");
-  MASSERT(true, Errc::REALLOCATION_IN_STATIC_STACK);
-  //TODO make non debug assert
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+char* SafeRing<T, ConcurrencyPolicy, LogPolicy>::
+GetDumpMessage(int error_code) {
+  DumpWriter out(dump_msg_buffer, DUMP_MESSAGE_MAX_CHAR_COUNT);
+  out.Write("\n- - - - - - DUMP MESSAGE FROM SHUSH::SAFE_RING- - - - - - \n");
+
+  out.Write("this address: ").WriteUnsigned(reinterpret_cast<size_t>(this))
+     .Write(", buffer address: ")
+     .WriteUnsigned(reinterpret_cast<size_t>(buf_)).Write(".\n");
+  out.Write("Error code == ").WriteSigned(error_code)
+     .Write(" (").Write(GetErrorName(error_code)).Write(")\n");
+  out.Write("Concurrency policy: ").Write(ConcurrencyPolicy::NAME)
+     .Write(", log policy: ").Write(LogPolicy::NAME).Write("\n\n");
+
+  out.Write("[FIRST_CANARY] == ").WriteUnsigned(first_canary_).Write("\n");
+  out.Write("[HEAD] == ").WriteUnsigned(head_.value.load())
+     .Write(" (check ").WriteUnsigned(head_.check).Write(")\n");
+  out.Write("[TAIL] == ").WriteUnsigned(tail_.value.load())
+     .Write(" (check ").WriteUnsigned(tail_.check).Write(")\n");
+  out.Write("[BUFFER_SIZE] == ").WriteUnsigned(mask_ + 1).Write("\n");
+  out.Write("[SECOND_CANARY] == ").WriteUnsigned(second_canary_)
+     .Write("\n");
+
+  out.Write("\n- - - - END OF DUMP MESSAGE FROM SHUSH::SAFE_RING- - - - - \n");
+
+  return out.GetMessage();
 }
 
+
+template <class T, class ConcurrencyPolicy, class LogPolicy>
+std::atomic<size_t>
+SafeRing<T, ConcurrencyPolicy, LogPolicy>::rings_count(0);
+
 }
 }
@@ -0,0 +1,52 @@
+// Turns a file written by shush::stack::binlog::Sink into text, one line
+// per record.
+//
+// Usage: shush-stack-logdump <file>
+
+#include <cstdio>
+#include <cstring>
+
+#include "shush-stack.hpp"
+
+using shush::stack::binlog::FileHeader;
+using shush::stack::binlog::Record;
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+    return 1;
+  }
+
+  FILE* file = fopen(argv[1], "rb");
+  if (file == nullptr) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  FileHeader header = {};
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, shush::stack::binlog::FILE_MAGIC,
+             sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s is not a binary log of shush-stack.\n", argv[1]);
+    fclose(file);
+    return 1;
+  }
+  if (header.version != shush::stack::binlog::FILE_VERSION ||
+      header.record_size != sizeof(Record)) {
+    fprintf(stderr,
+            "%s has version %u and records of %u bytes, expected version "
+            "%u and %zu bytes.\n",
+            argv[1], header.version, header.record_size,
+            shush::stack::binlog::FILE_VERSION, sizeof(Record));
+    fclose(file);
+    return 1;
+  }
+
+  Record record = {};
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    printf("%s\n", shush::stack::binlog::Format(record).c_str());
+  }
+
+  fclose(file);
+  return 0;
+}
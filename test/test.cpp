@@ -1,9 +1,43 @@
 #include <gtest/gtest.h>
 #include <iostream>
+#include <atomic>
+#include <climits>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "shush-stack.hpp"
 
 using namespace shush::stack;
 
+static std::atomic<size_t> allocations_count(0);
+
+void* operator new(size_t size) {
+  ++allocations_count;
+  if (void* ptr = malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+// Not inlined, so that GCC does not take the free() in it for a mismatch
+// with the operator new above (-Wmismatched-new-delete).
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
 TEST(DYNAMIC, warmup) {
   try {
     SafeStack<int> stack_0;
@@ -118,6 +152,1853 @@ TEST(DYNAMIC, intrusion) {
   }
 }
 
+TEST(DYNAMIC, incremental_hash) {
+  SafeStack<uint64_t, IncrementalHash> stack;
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  for (size_t i = 0; i < 500; ++i) {
+    ASSERT_EQ(stack.Pop(), 999 - i);
+  }
+  stack.Ok(true);
+
+  char* buf = *reinterpret_cast<char**>(&stack);
+  buf[BUF_POS] ^= 1;
+  EXPECT_THROW(stack.Ok(true), shush::dump::Dump);
+}
+
+TEST(STATIC, incremental_hash) {
+  SafeStackStatic<uint64_t, 1000, IncrementalHash> stack;
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+    ASSERT_EQ(stack.Pop(), i);
+    stack.Push(i);
+  }
+  stack.Ok(true);
+}
+
+TEST(DYNAMIC, verify_sampled) {
+  SafeStack<uint64_t, IncrementalHash, VerifySampled<4, 8>> stack;
+  for (size_t i = 0; i < 100; ++i) {
+    stack.Push(i);
+  }
+
+  char* buf = *reinterpret_cast<char**>(&stack);
+  buf[BUF_POS + (stack.GetBufSize() - 1) * sizeof(uint64_t)] = 0;
+  EXPECT_THROW(
+      for (size_t i = 0; i < 100; ++i) {
+        stack.Ok();
+      },
+      shush::dump::Dump);
+}
+
+TEST(DYNAMIC, verify_header) {
+  SafeStack<uint64_t, IncrementalHash, VerifyHeader> stack;
+  for (size_t i = 0; i < 100; ++i) {
+    stack.Push(i);
+  }
+
+  char* buf = *reinterpret_cast<char**>(&stack);
+  buf[BUF_POS + (stack.GetBufSize() - 1) * sizeof(uint64_t)] = 0;
+  stack.Ok();
+  EXPECT_THROW(stack.Ok(true), shush::dump::Dump);
+}
+
+template <class... Policies>
+class DumpProbe : public SafeStack<int, Policies...> {
+  public:
+  using SafeStack<int, Policies...>::GetDumpMessage;
+};
+
+TEST(DYNAMIC, dump_shows_policies) {
+  DumpProbe<IncrementalHash, VerifySampled<>> stack;
+  const std::string dump = stack.GetDumpMessage(Errc::ASSERT_FAILED);
+  EXPECT_NE(dump.find("incremental"), std::string::npos);
+  EXPECT_NE(dump.find("sampled"), std::string::npos);
+}
+
+TEST(DYNAMIC, dump_is_truncated) {
+  DumpProbe<IncrementalHash, VerifyHeader> stack;
+  for (int i = 0; i < 10000; ++i) {
+    stack.Push(i);
+  }
+
+  char* buf = *reinterpret_cast<char**>(&stack);
+  buf[BUF_POS + (stack.GetBufSize() - 1) * sizeof(int)] = 0;
+
+  const std::string dump = stack.GetDumpMessage(Errc::HASH_NOT_THE_SAME);
+  EXPECT_LT(dump.size(), DUMP_MESSAGE_MAX_CHAR_COUNT);
+  EXPECT_NE(dump.find(GetErrorName(Errc::HASH_NOT_THE_SAME)),
+            std::string::npos);
+  EXPECT_NE(dump.find("[9999] == 9999"), std::string::npos);
+  EXPECT_NE(dump.find("skipped"), std::string::npos);
+  EXPECT_NE(dump.find("1 of them are not poison"), std::string::npos);
+  EXPECT_NE(dump.find("END OF DUMP"), std::string::npos);
+}
+
+TEST(DYNAMIC, dump_of_broken_sizes) {
+  DumpProbe<IncrementalHash, VerifyHeader, LogErrors> stack;
+  for (int i = 0; i < 100; ++i) {
+    stack.Push(i);
+  }
+
+  const size_t old_buf_size = stack.GetBufSize();
+  const size_t buf_size     = size_t(1) << 40;
+  char* buf = *reinterpret_cast<char**>(&stack);
+  memcpy(buf + BUF_SIZE_POS, &buf_size, sizeof(buf_size));
+  EXPECT_THROW(stack.Ok(), shush::dump::Dump);
+
+  const std::string dump =
+      stack.GetDumpMessage(Errc::BUF_SIZE_EXCEEDS_ALLOCATION);
+  EXPECT_NE(dump.find("[BUF_SIZE] == 1099511627776"), std::string::npos);
+  EXPECT_EQ(dump.find("[0] == "), std::string::npos);
+  EXPECT_NE(dump.find("END OF DUMP"), std::string::npos);
+
+  memcpy(buf + BUF_SIZE_POS, &old_buf_size, sizeof(old_buf_size));
+  stack.Ok(true);
+}
+
+TEST(DYNAMIC, dump_does_not_allocate) {
+  DumpProbe<IncrementalHash, VerifyHeader, LogErrors> stack;
+  for (int i = 0; i < 100; ++i) {
+    stack.Push(i);
+  }
+
+  char buffer[200];
+  const size_t allocations_before = allocations_count;
+  stack.GetDumpMessage(Errc::ASSERT_FAILED, buffer, sizeof(buffer));
+  ASSERT_EQ(allocations_count, allocations_before);
+  ASSERT_LT(strlen(buffer), sizeof(buffer));
+}
+
+TEST(DYNAMIC, no_allocations_in_release_config) {
+  SafeStack<uint64_t, IncrementalHash, VerifySampled<>, LogErrors> stack;
+  stack.Push(0);
+  stack.Pop();
+
+  const size_t allocations_before = allocations_count;
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+    stack.Push(i + 1);
+    ASSERT_EQ(stack.Pop(), i + 1);
+    ASSERT_EQ(stack.Pop(), i);
+  }
+  ASSERT_EQ(allocations_count, allocations_before);
+}
+
+TEST(DYNAMIC, bulk) {
+  SafeStack<uint64_t, IncrementalHash> stack;
+  std::vector<uint64_t> items(1000);
+  for (size_t i = 0; i < items.size(); ++i) {
+    items[i] = i;
+  }
+
+  stack.PushN(items.data(), 500);
+  stack.PushRange(items.begin() + 500, items.end());
+  ASSERT_EQ(stack.GetCurSize(), 1000);
+  stack.Append(items);
+  ASSERT_EQ(stack.GetCurSize(), 2000);
+  stack.Ok(true);
+
+  std::vector<uint64_t> out(1000);
+  stack.PopN(out.data(), 1000);
+  ASSERT_EQ(out, items);
+  ASSERT_EQ(stack.Pop(), 999);
+  stack.Ok(true);
+
+  EXPECT_THROW(stack.PopN(out.data(), 1000), shush::dump::Dump);
+}
+
+struct Named {
+  std::string name;
+};
+
+std::string to_string(const Named& named) {
+  return named.name;
+}
+
+TEST(DYNAMIC, bulk_non_trivial) {
+  SafeStack<Named, IncrementalHash> stack;
+  std::vector<Named> items;
+  for (size_t i = 0; i < 100; ++i) {
+    items.push_back({"item number " + std::to_string(i)});
+  }
+
+  stack.PushRange(
+      std::make_move_iterator(items.begin()),
+      std::make_move_iterator(items.end()));
+  stack.Ok(true);
+
+  std::vector<Named> out(100);
+  stack.PopN(out.data(), 100);
+  for (size_t i = 0; i < 100; ++i) {
+    ASSERT_EQ(out[i].name, "item number " + std::to_string(i));
+  }
+  stack.Ok(true);
+}
+
+TEST(DYNAMIC, bulk_from_itself) {
+  SafeStack<uint64_t, IncrementalHash> stack;
+  for (uint64_t i = 0; i < stack.GetBufSize(); ++i) {
+    stack.Push(i);
+  }
+
+  // The stack is full, so the source moves away before it is read.
+  const uint64_t top = stack.Top();
+  stack.PushN(&stack.Top(), 1);
+  ASSERT_EQ(stack.Top(), top);
+
+  const size_t size = stack.GetCurSize();
+  stack.ShrinkToFit();
+  const uint64_t* bottom = &stack.Peek(size - 1);
+  stack.PushRange(bottom, bottom + size);
+  ASSERT_EQ(stack.GetCurSize(), 2 * size);
+  for (size_t i = 0; i < size; ++i) {
+    ASSERT_EQ(stack.Peek(i), stack.Peek(i + size));
+  }
+  stack.Ok(true);
+
+  SafeStack<Named, IncrementalHash> named;
+  for (size_t i = 0; i < named.GetBufSize(); ++i) {
+    named.Push({"item number " + std::to_string(i)});
+  }
+  named.PushN(&named.Peek(1), 2);
+  ASSERT_EQ(named.Peek(0).name, named.Peek(2).name);
+  ASSERT_EQ(named.Peek(1).name, named.Peek(3).name);
+  named.Ok(true);
+
+  EXPECT_THROW(stack.PushN(&stack.Top(), SIZE_MAX), shush::dump::Dump);
+}
+
+TEST(DYNAMIC, emplace_and_access) {
+  SafeStack<std::string, IncrementalHash> stack;
+  stack.Emplace(3, 'a');
+  stack.Emplace("bb");
+  ASSERT_EQ(stack.Top(), "bb");
+  ASSERT_EQ(stack.Peek(1), "aaa");
+  EXPECT_THROW(stack.Peek(2), shush::dump::Dump);
+
+  // The argument is an element of the stack that moves on reallocation.
+  for (size_t i = 0; i < 100; ++i) {
+    stack.Push(stack.Top());
+  }
+  ASSERT_EQ(stack.GetCurSize(), 102);
+  ASSERT_EQ(stack.Top(), "bb");
+
+  std::string out;
+  stack.Pop(out);
+  ASSERT_EQ(out, "bb");
+  for (size_t i = 0; i < 100; ++i) {
+    stack.Drop();
+  }
+  ASSERT_EQ(stack.Pop(), "aaa");
+  EXPECT_THROW(stack.Drop(), shush::dump::Dump);
+  stack.Ok(true);
+}
+
+TEST(DYNAMIC, move_only) {
+  SafeStack<std::unique_ptr<int>, IncrementalHash> stack;
+  for (int i = 0; i < 100; ++i) {
+    stack.Emplace(new int(i));
+  }
+  ASSERT_EQ(*stack.Top(), 99);
+
+  std::unique_ptr<int> out;
+  stack.Pop(out);
+  ASSERT_EQ(*out, 99);
+  ASSERT_EQ(*stack.Pop(), 98);
+  stack.Ok(true);
+}
+
+using NoCanariesStack = SafeStack<uint64_t, IncrementalHash, VerifyParanoid,
+                                  LogDefault, HeapAllocator, NoCanaries>;
+using NoPoisonStack = SafeStack<uint64_t, IncrementalHash, VerifyParanoid,
+                                LogDefault, HeapAllocator, WithCanaries,
+                                NoPoison>;
+
+static_assert(SafeStack<int>::BUF_POS == BUF_POS);
+static_assert(HardenedSafeStack<int>::BUF_POS == BUF_POS);
+static_assert(SafeStack<int, NoHash>::BUF_POS == BUF_POS - HASH_SIZE);
+static_assert(NoCanariesStack::BUF_POS == BUF_POS - CANARY_SIZE);
+static_assert(NoCanariesStack::CANARY_SIZE == 0);
+static_assert(BareSafeStack<int>::BUF_POS == CUR_SIZE_SIZE + BUF_SIZE_SIZE);
+static_assert(
+    sizeof(SafeStackStatic<int, 100, NoHash, VerifyNone, LogNone,
+                           NoCanaries, NoPoison>) +
+    2 * CANARY_SIZE + HASH_SIZE == sizeof(SafeStackStatic<int, 100>));
+
+struct alignas(32) Vec4 {
+  double lanes[4];
+};
+
+struct alignas(64) Line {
+  uint64_t words[8];
+};
+
+std::string to_string(const Vec4& vec) {
+  return std::to_string(vec.lanes[0]);
+}
+
+std::string to_string(const Line& line) {
+  return std::to_string(line.words[0]);
+}
+
+template <class Stack, class T>
+static void CheckAligned(Stack& stack, const T& item, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    stack.Push(item);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(&stack.Top()) % alignof(T), 0);
+  }
+  stack.Ok(true);
+  for (size_t i = 0; i < count; ++i) {
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(&stack.Top()) % alignof(T), 0);
+    stack.Drop();
+  }
+  stack.Ok(true);
+}
+
+TEST(DYNAMIC, over_aligned) {
+  static_assert(SafeStack<Vec4>::BUF_POS == CACHE_LINE_SIZE);
+  static_assert(SafeStackStatic<Line, 10>::BUF_POS == CACHE_LINE_SIZE);
+
+  SafeStack<Vec4, IncrementalHash> vecs;
+  SafeStack<Line, FullHash> lines;
+  SafeStack<Line, IncrementalHash, VerifyParanoid, LogDefault, PoolAllocator>
+      pooled;
+  SafeStack<Vec4, IncrementalHash, VerifyParanoid, LogDefault, PmrAllocator>
+      pmr;
+  SafeStack<Vec4, IncrementalHash, VerifyParanoid, LogDefault,
+            GuardPageAllocator>
+      guarded;
+  SafeStackSmall<Line, 4, IncrementalHash> small;
+  SafeStackStatic<Vec4, 1000> fixed;
+  SegmentedSafeStack<Line, 16> chunked;
+  CheckAligned(vecs, Vec4{{1, 2, 3, 4}}, 5000);
+  CheckAligned(lines, Line{{1, 2, 3}}, 1000);
+  CheckAligned(pooled, Line{{4, 5, 6}}, 1000);
+  CheckAligned(pmr, Vec4{{5, 6, 7, 8}}, 1000);
+  CheckAligned(guarded, Vec4{{6, 7, 8, 9}}, 1000);
+  CheckAligned(small, Line{{7, 8, 9}}, 100);
+  CheckAligned(fixed, Vec4{{9, 10, 11, 12}}, 1000);
+  CheckAligned(chunked, Line{{10, 11, 12}}, 100);
+
+  // A write just below the first cell lands in the padding of the header.
+  char* buf = *reinterpret_cast<char**>(&lines);
+  buf[CACHE_LINE_SIZE - 1] = 0;
+  EXPECT_THROW(lines.Ok(true), shush::dump::Dump);
+}
+
+TEST(DYNAMIC, bare) {
+  BareSafeStack<std::string> stack;
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(std::to_string(i));
+  }
+  for (size_t i = 0; i < 1000; ++i) {
+    ASSERT_EQ(stack.Pop(), std::to_string(999 - i));
+  }
+  stack.Ok(true);
+}
+
+TEST(DYNAMIC, partial_layers) {
+  NoCanariesStack no_canaries;
+  NoPoisonStack   no_poison;
+  for (size_t i = 0; i < 1000; ++i) {
+    no_canaries.Push(i);
+    no_poison.Push(i);
+  }
+  for (size_t i = 0; i < 500; ++i) {
+    ASSERT_EQ(no_canaries.Pop(), 999 - i);
+    ASSERT_EQ(no_poison.Pop(), 999 - i);
+  }
+  no_canaries.Ok(true);
+  no_poison.Ok(true);
+
+  // The hash still covers what the canary would.
+  char* buf = *reinterpret_cast<char**>(&no_canaries);
+  buf[NoCanariesStack::CUR_SIZE_POS] ^= 1;
+  EXPECT_THROW(no_canaries.Ok(), shush::dump::Dump);
+
+  // Unused cells are not checked without poison.
+  buf = *reinterpret_cast<char**>(&no_poison);
+  buf[NoPoisonStack::BUF_POS + (no_poison.GetBufSize() - 1) * 8] = 0;
+  no_poison.Ok(true);
+}
+
+TEST(DYNAMIC, growth_policy) {
+  SafeStack<uint64_t, IncrementalHash> stack;
+  stack.SetGrowthPolicy(GrowthPolicy::Chunk(100));
+  for (size_t i = 0; i < 250; ++i) {
+    stack.Push(i);
+  }
+  ASSERT_EQ(stack.GetBufSize(), DEFAULT_INITIAL_SIZE + 300);
+
+  stack.SetGrowthPolicy(GrowthPolicy::Factor(1.5));
+  for (size_t i = 250; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  stack.Ok(true);
+  for (size_t i = 0; i < 1000; ++i) {
+    ASSERT_EQ(stack.Pop(), 999 - i);
+  }
+}
+
+TEST(DYNAMIC, shrink) {
+  SafeStack<uint64_t, IncrementalHash> stack;
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  ASSERT_EQ(stack.GetBufSize(), 1280);
+
+  // Halved only below a quarter, and then to between a quarter and a half.
+  for (size_t i = 999; i >= 320; --i) {
+    ASSERT_EQ(stack.Pop(), i);
+  }
+  ASSERT_EQ(stack.GetBufSize(), 1280);
+  stack.Drop();
+  ASSERT_EQ(stack.GetBufSize(), 640);
+  stack.Ok(true);
+
+  // Going back and forth over the boundary does not reallocate.
+  for (size_t i = 0; i < 100; ++i) {
+    stack.Push(i);
+    stack.Drop();
+  }
+  ASSERT_EQ(stack.GetBufSize(), 640);
+
+  std::vector<uint64_t> out(318);
+  stack.PopN(out.data(), out.size());
+  ASSERT_EQ(stack.GetBufSize(), DEFAULT_INITIAL_SIZE);
+  ASSERT_EQ(stack.Pop(), 0);
+  ASSERT_EQ(stack.GetBufSize(), DEFAULT_INITIAL_SIZE);
+  stack.Ok(true);
+
+  stack.Reserve(5000);
+  ASSERT_EQ(stack.GetBufSize(), 5000);
+  stack.Push(1);
+  stack.Push(2);
+  stack.ShrinkToFit();
+  ASSERT_EQ(stack.GetBufSize(), 2);
+  stack.Ok(true);
+  stack.Push(3);
+  ASSERT_EQ(stack.Pop(), 3);
+  ASSERT_EQ(stack.Pop(), 2);
+
+  stack.SetGrowthPolicy(GrowthPolicy::Factor(2, 0));
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  const size_t buf_size = stack.GetBufSize();
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Drop();
+  }
+  ASSERT_EQ(stack.GetBufSize(), buf_size);
+}
+
+TEST(DYNAMIC, shrink_layers) {
+  SafeStack<uint64_t, FullHash, VerifyParanoid, LogDefault, PoolAllocator>
+      pooled;
+  SafeStack<std::string, IncrementalHash> strings;
+  NoPoisonStack no_poison;
+  for (size_t i = 0; i < 500; ++i) {
+    pooled.Push(i);
+    strings.Push(std::to_string(i) + std::string(i % 30, 'x'));
+    no_poison.Push(i);
+  }
+  for (size_t i = 499; i >= 10; --i) {
+    ASSERT_EQ(pooled.Pop(), i);
+    ASSERT_EQ(strings.Pop(), std::to_string(i) + std::string(i % 30, 'x'));
+    ASSERT_EQ(no_poison.Pop(), i);
+  }
+  pooled.Ok(true);
+  strings.Ok(true);
+  no_poison.Ok(true);
+  ASSERT_LT(pooled.GetBufSize(), 64);
+  ASSERT_LT(strings.GetBufSize(), 64);
+
+  // The cut off part went back to the pool poisoned.
+  SafeStack<uint64_t, FullHash, VerifyParanoid, LogDefault, PoolAllocator>
+      next;
+  next.Reserve(500);
+  next.Ok(true);
+}
+
+TEST(DYNAMIC, freed_as_allocated) {
+  // Big enough to be mapped, and then claimed to be small enough not to.
+  for (size_t buf_size : {size_t(10), size_t(1) << 40}) {
+    SafeStack<std::string, IncrementalHash, VerifyNone> stack;
+    stack.Reserve(200000);
+    stack.Push("survives");
+
+    char* buf = *reinterpret_cast<char**>(&stack);
+    memcpy(buf + BUF_SIZE_POS, &buf_size, sizeof(buf_size));
+  }
+}
+
+TEST(DYNAMIC, dirty_watermark) {
+  SafeStack<uint64_t, IncrementalHash> stack;
+  stack.SetGrowthPolicy(GrowthPolicy::Factor(2, 0));
+  stack.Reserve(10000);
+  for (size_t i = 0; i < 100; ++i) {
+    stack.Push(i);
+  }
+  for (size_t i = 0; i < 50; ++i) {
+    stack.Drop();
+  }
+
+  char*     buf   = *reinterpret_cast<char**>(&stack);
+  uint64_t* slots = reinterpret_cast<uint64_t*>(buf + BUF_POS);
+
+  // The last popped cell is below the watermark, so Ok() checks it.
+  const uint64_t poison = slots[50];
+  slots[50] = 0;
+  EXPECT_THROW(stack.Ok(), shush::dump::Dump);
+  slots[50] = poison;
+  stack.Ok();
+
+  // Cells the stack has not written since the last check are left to
+  // Ok(true).
+  slots[5000] = 0;
+  stack.Ok();
+  EXPECT_THROW(stack.Ok(true), shush::dump::Dump);
+  slots[5000] = poison;
+  stack.Ok(true);
+
+  for (size_t i = 50; i < 10000; ++i) {
+    stack.Push(i);
+  }
+  stack.Ok(true);
+  for (size_t i = 0; i < 10000; ++i) {
+    ASSERT_EQ(stack.Pop(), 9999 - i);
+  }
+}
+
+TEST(DYNAMIC, big_trivial_growth) {
+  SafeStack<uint64_t, IncrementalHash, VerifySampled<>> stack;
+  const size_t count = 4 * HeapAllocator::MMAP_THRESHOLD / sizeof(uint64_t);
+  for (size_t i = 0; i < count; ++i) {
+    stack.Push(i);
+  }
+  stack.Ok(true);
+  for (size_t i = 0; i < count; ++i) {
+    ASSERT_EQ(stack.Pop(), count - 1 - i);
+  }
+  stack.Ok(true);
+}
+
+struct Tracked {
+  static int alive;
+
+  Tracked() { ++alive; }
+  Tracked(const Tracked&) { ++alive; }
+  Tracked(Tracked&&) { ++alive; }
+  ~Tracked() { --alive; }
+
+  Tracked& operator=(const Tracked&) = default;
+  Tracked& operator=(Tracked&&) = default;
+
+  char payload[16] = {};
+};
+
+int Tracked::alive = 0;
+
+std::string to_string(const Tracked&) {
+  return "tracked";
+}
+
+// Throws from the copy that finds copies_left at zero.
+struct Fragile : Tracked {
+  static int copies_left;
+
+  Fragile() = default;
+  Fragile(const Fragile& other) : Tracked(other) {
+    if (copies_left-- == 0) {
+      throw std::runtime_error("fragile copy");
+    }
+  }
+
+  Fragile& operator=(const Fragile&) = default;
+};
+
+int Fragile::copies_left = INT_MAX;
+
+std::string to_string(const Fragile&) {
+  return "fragile";
+}
+
+TEST(DYNAMIC, non_trivial_growth_destroys) {
+  {
+    SafeStack<Tracked, IncrementalHash> stack;
+    for (size_t i = 0; i < 100; ++i) {
+      stack.Push(Tracked());
+    }
+    ASSERT_EQ(Tracked::alive, 100);
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+}
+
+TEST(DYNAMIC, pop_destroys) {
+  {
+    SafeStack<Tracked, IncrementalHash> stack;
+    for (size_t i = 0; i < 10; ++i) {
+      stack.Emplace();
+    }
+    stack.Drop();
+    stack.Pop();
+    Tracked out;
+    stack.Pop(out);
+    ASSERT_EQ(Tracked::alive, 7 + 1);
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+}
+
+TEST(DYNAMIC, throwing_emplace_changes_nothing) {
+  {
+    SafeStack<Fragile, IncrementalHash, VerifyParanoid> stack;
+    Fragile item;
+
+    // Into free space, and into a full stack, where the element is copied
+    // once before the growth and once after the growth has copied the rest.
+    const size_t full = stack.GetBufSize();
+    for (auto [size, copies] : {std::pair<size_t, int>{1, 0},
+                                {full, 0}, {full, int(full) + 1}}) {
+      while (stack.GetCurSize() < size) {
+        stack.Emplace();
+      }
+      Fragile::copies_left = copies;
+      EXPECT_THROW(stack.Emplace(item), std::runtime_error);
+      Fragile::copies_left = INT_MAX;
+      ASSERT_EQ(stack.GetCurSize(), size);
+      ASSERT_EQ(Tracked::alive, size + 1);
+      stack.Ok(true);
+    }
+
+    stack.Emplace(item);
+    ASSERT_EQ(Tracked::alive, stack.GetCurSize() + 1);
+    stack.Ok(true);
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+}
+
+TEST(DYNAMIC, throwing_bulk_push_rolls_back) {
+  {
+    SafeStack<Fragile, IncrementalHash, VerifyParanoid> stack;
+    for (size_t i = 0; i < 3; ++i) {
+      stack.Emplace();
+    }
+    std::vector<Fragile> items(40);
+    std::list<Fragile> listed(40);
+
+    Fragile::copies_left = 20;
+    EXPECT_THROW(stack.PushN(items.data(), items.size()), std::runtime_error);
+    ASSERT_EQ(stack.GetCurSize(), 3);
+    ASSERT_EQ(Tracked::alive, 3 + 40 + 40);
+    stack.Ok(true);
+
+    Fragile::copies_left = 20;
+    EXPECT_THROW(stack.PushRange(listed.begin(), listed.end()),
+                 std::runtime_error);
+    ASSERT_EQ(stack.GetCurSize(), 3);
+    ASSERT_EQ(Tracked::alive, 3 + 40 + 40);
+    stack.Ok(true);
+
+    Fragile::copies_left = INT_MAX;
+    stack.PushRange(listed.begin(), listed.end());
+    stack.PushN(items.data(), items.size());
+    ASSERT_EQ(stack.GetCurSize(), 3 + 40 + 40);
+    stack.Ok(true);
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+}
+
+template <class Stack>
+static void CheckRollback(bool hashed = true) {
+  Stack stack;
+  for (uint64_t i = 0; i < 20; ++i) {
+    stack.Push(i);
+  }
+
+  const auto outer = stack.Checkpoint();
+  for (uint64_t i = 20; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  const auto inner = stack.Checkpoint();
+  for (uint64_t i = 0; i < 100; ++i) {
+    stack.Push(i);
+  }
+  stack.Rollback(inner);
+  ASSERT_EQ(stack.GetCurSize(), 1000);
+  ASSERT_EQ(stack.Top(), 999);
+  stack.Ok(true);
+
+  // Growth and shrinking under the checkpoint are fine.
+  stack.Rollback(outer);
+  ASSERT_EQ(stack.GetCurSize(), 20);
+  ASSERT_EQ(stack.Top(), 19);
+  stack.Ok(true);
+
+  // The inner checkpoint is gone with the elements it was over.
+  EXPECT_THROW(stack.Rollback(inner), shush::dump::Dump);
+
+  // So are the elements under it if they were replaced, as far as the
+  // hash can tell.
+  const auto replaced = stack.Checkpoint();
+  stack.Drop();
+  stack.Push(1234);
+  if (hashed) {
+    EXPECT_THROW(stack.Rollback(replaced), shush::dump::Dump);
+  }
+
+  // Popping and pushing the same is not a change.
+  stack.Drop();
+  stack.Push(19);
+  stack.Rollback(replaced);
+  stack.Ok(true);
+  for (uint64_t i = 0; i < 20; ++i) {
+    ASSERT_EQ(stack.Pop(), 19 - i);
+  }
+}
+
+TEST(DYNAMIC, checkpoint) {
+  CheckRollback<SafeStack<uint64_t, IncrementalHash, VerifyParanoid>>();
+  CheckRollback<SafeStack<uint64_t, FullHash, VerifyParanoid>>();
+  CheckRollback<SafeStack<uint64_t, NoHash, VerifyParanoid>>(false);
+  CheckRollback<SafeStackStatic<uint64_t, 2000>>();
+
+  {
+    SafeStack<Tracked, IncrementalHash, VerifyParanoid> stack;
+    for (size_t i = 0; i < 10; ++i) {
+      stack.Emplace();
+    }
+    const auto checkpoint = stack.Checkpoint();
+    for (size_t i = 0; i < 100; ++i) {
+      stack.Emplace();
+    }
+    stack.Rollback(checkpoint);
+    ASSERT_EQ(Tracked::alive, 10);
+    stack.Ok(true);
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+}
+
+TEST(DYNAMIC, checkpoint_over_moved_elements) {
+  SafeStack<std::string, IncrementalHash, VerifyParanoid> stack;
+  for (size_t i = 0; i < 10; ++i) {
+    stack.Push("item number " + std::to_string(i));
+  }
+
+  const auto kept = stack.Checkpoint();
+  stack.Drop();
+  stack.Push("changed");
+  EXPECT_THROW(stack.Rollback(kept), shush::dump::Dump);
+
+  // After a reallocation the elements under the checkpoint cannot be
+  // compared, and only the depth is checked.
+  const auto moved = stack.Checkpoint();
+  stack.Drop();
+  stack.Push("changed again");
+  while (stack.GetCurSize() < 1000) {
+    stack.Push("filler");
+  }
+  stack.Rollback(moved);
+  ASSERT_EQ(stack.GetCurSize(), 10);
+  ASSERT_EQ(stack.Top(), "changed again");
+  stack.Ok(true);
+
+  stack.Drop();
+  stack.Drop();
+  EXPECT_THROW(stack.Rollback(moved), shush::dump::Dump);
+}
+
+using GuardedStack = SafeStack<uint64_t, IncrementalHash, VerifyHeader,
+                               LogDefault, GuardPageAllocator>;
+
+TEST(GUARDED, growth) {
+  GuardedStack stack;
+  for (size_t i = 0; i < 10000; ++i) {
+    stack.Push(i);
+  }
+  stack.Ok(true);
+  for (size_t i = 0; i < 10000; ++i) {
+    ASSERT_EQ(stack.Pop(), 9999 - i);
+  }
+  stack.Ok(true);
+}
+
+TEST(GUARDED, overrun_faults) {
+  EXPECT_DEATH(
+      {
+        GuardedStack stack;
+        stack.Push(0);
+
+        // Past the last cell and the canary behind it.
+        char* buf = *reinterpret_cast<char**>(&stack);
+        volatile char* end = buf + BUF_POS +
+                             stack.GetBufSize() * sizeof(uint64_t) +
+                             CANARY_SIZE;
+        *end = 0;
+      },
+      "Faulting address: [0-9]+");
+}
+
+TEST(GUARDED, frees_its_own_mapping) {
+  GuardPageAllocator allocator;
+  char* first  = allocator.Allocate(100);
+  char* second = allocator.Allocate(100);
+  char* lower  = std::min(first, second);
+  char* upper  = std::max(first, second);
+
+  // A size reaching up to the end of the other buffer must not unmap it.
+  allocator.Deallocate(lower, upper - lower + 100);
+  memset(upper, 0, 100);
+  allocator.Deallocate(upper, 100);
+}
+
+TEST(GUARDED, aligns_odd_sizes) {
+  GuardPageAllocator allocator;
+  char* buf = allocator.Allocate(BUF_POS + 5 + CANARY_SIZE, 1);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(buf) % alignof(uint64_t), 0);
+  allocator.Deallocate(buf, BUF_POS + 5 + CANARY_SIZE, 1);
+
+  SafeStack<char, IncrementalHash, VerifyHeader, LogDefault,
+            GuardPageAllocator> stack;
+  for (size_t i = 0; i < 1001; ++i) {
+    stack.Push('a' + i % 26);
+    buf = *reinterpret_cast<char**>(&stack);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(buf) % alignof(uint64_t), 0);
+  }
+  stack.Ok(true);
+}
+
+TEST(POOL, recycles_poisoned_buffers) {
+  PoolAllocator allocator;
+  char* buf = allocator.Allocate(100);
+  ASSERT_EQ(poison::FindNonPoison(buf, buf + 128), buf + 128);
+
+  memset(buf, 0, 100);
+  allocator.Deallocate(buf, 100);
+  char* recycled = allocator.Allocate(120);
+  ASSERT_EQ(recycled, buf);
+  ASSERT_EQ(poison::FindNonPoison(recycled, recycled + 128), recycled + 128);
+
+  // Grows in place within the size class.
+  ASSERT_EQ(allocator.Reallocate(recycled, 120, 128), recycled);
+  char* moved = allocator.Reallocate(recycled, 128, 1000);
+  ASSERT_EQ(poison::FindNonPoison(moved, moved + 1024), moved + 1024);
+  allocator.Deallocate(moved, 1000);
+}
+
+TEST(POOL, stacks) {
+  for (size_t round = 0; round < 100; ++round) {
+    SafeStack<uint64_t, IncrementalHash, VerifyParanoid, LogDefault,
+              PoolAllocator> stack;
+    SafeStack<std::string, IncrementalHash, VerifyParanoid, LogDefault,
+              PoolAllocator> strings;
+    for (size_t i = 0; i < round * 10; ++i) {
+      stack.Push(i);
+      strings.Push(std::to_string(i) + std::string(i % 30, 'x'));
+    }
+    stack.Ok(true);
+    strings.Ok(true);
+    for (size_t i = 0; i < round * 5; ++i) {
+      ASSERT_EQ(stack.Pop(), round * 10 - 1 - i);
+      strings.Drop();
+    }
+  }
+
+  SegmentedSafeStack<uint64_t, 100, Wyhash, LogDefault, PoolAllocator>
+      segmented;
+  for (size_t i = 0; i < 1000; ++i) {
+    segmented.Push(i);
+  }
+  segmented.Ok(true);
+}
+
+/**
+ * Counts what goes through it to the default resource.
+ */
+class CountingResource : public std::pmr::memory_resource {
+  public:
+  size_t allocated = 0;
+
+  private:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    allocated += bytes;
+    return std::pmr::get_default_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* ptr, size_t bytes, size_t alignment) override {
+    allocated -= bytes;
+    std::pmr::get_default_resource()->deallocate(ptr, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+};
+
+TEST(POOL, memory_resource) {
+  CountingResource resource;
+  {
+    SafeStack<uint64_t, IncrementalHash, VerifyParanoid, LogDefault,
+              PmrAllocator> stack{PmrAllocator(&resource)};
+    for (size_t i = 0; i < 1000; ++i) {
+      stack.Push(i);
+    }
+    ASSERT_EQ(resource.allocated, stack.GetBufSize() * sizeof(uint64_t) +
+                                      decltype(stack)::BUF_POS +
+                                      decltype(stack)::CANARY_SIZE);
+    stack.Ok(true);
+  }
+  ASSERT_EQ(resource.allocated, 0);
+}
+
+using SegmentedStack = SegmentedSafeStack<uint64_t, 100>;
+
+TEST(SEGMENTED, stress) {
+  SegmentedStack stack;
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  ASSERT_EQ(stack.GetCurSize(), 1000);
+  ASSERT_EQ(stack.GetChunksCount(), 10);
+  ASSERT_EQ(stack.Top(), 999);
+  ASSERT_EQ(stack.Peek(150), 849);
+  EXPECT_THROW(stack.Peek(1000), shush::dump::Dump);
+  stack.Ok(true);
+
+  for (size_t i = 0; i < 1000; ++i) {
+    ASSERT_EQ(stack.Pop(), 999 - i);
+  }
+  ASSERT_EQ(stack.GetChunksCount(), 0);
+  stack.Ok(true);
+  EXPECT_THROW(stack.Pop(), shush::dump::Dump);
+}
+
+TEST(SEGMENTED, stable_addresses) {
+  SegmentedStack stack;
+  stack.Push(42);
+  const uint64_t* first = &stack.Top();
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  ASSERT_EQ(&stack.Peek(1000), first);
+  ASSERT_EQ(*first, 42);
+
+  // Pushing an element of the stack itself across a chunk boundary.
+  while (stack.GetCurSize() % 100 != 0) {
+    stack.Drop();
+  }
+  stack.Push(stack.Peek(stack.GetCurSize() - 1));
+  ASSERT_EQ(stack.Top(), 42);
+}
+
+struct CountingAllocator : HeapAllocator {
+  static size_t allocations;
+
+  char* Allocate(size_t bytes, size_t alignment = DEFAULT_ALIGNMENT) {
+    ++allocations;
+    return HeapAllocator::Allocate(bytes, alignment);
+  }
+};
+
+size_t CountingAllocator::allocations = 0;
+
+TEST(SEGMENTED, spare_chunk) {
+  SegmentedSafeStack<uint64_t, 100, Wyhash, LogDefault, CountingAllocator>
+      stack;
+  for (size_t i = 0; i < 100; ++i) {
+    stack.Push(i);
+  }
+  ASSERT_EQ(CountingAllocator::allocations, 1);
+
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+    stack.Drop();
+  }
+  ASSERT_EQ(CountingAllocator::allocations, 2);
+  stack.Ok(true);
+}
+
+TEST(SMALL, spills_to_heap) {
+  SafeStackSmall<uint64_t, 8, IncrementalHash, VerifyParanoid, LogDefault,
+                 WithCanaries, WithPoison, CountingAllocator> stack;
+  const size_t allocations_before = CountingAllocator::allocations;
+  for (size_t i = 0; i < 8; ++i) {
+    stack.Push(i);
+  }
+  ASSERT_TRUE(stack.IsInline());
+  ASSERT_EQ(CountingAllocator::allocations, allocations_before);
+  stack.Ok(true);
+
+  // The pushed element lives in the inline buffer that is being left.
+  stack.Push(stack.Top());
+  ASSERT_FALSE(stack.IsInline());
+  ASSERT_EQ(CountingAllocator::allocations, allocations_before + 1);
+  for (size_t i = 9; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  stack.Ok(true);
+  for (size_t i = 999; i >= 9; --i) {
+    ASSERT_EQ(stack.Pop(), i);
+  }
+  ASSERT_EQ(stack.Pop(), 7);
+}
+
+TEST(SMALL, non_trivial) {
+  {
+    SafeStackSmall<Tracked, 4, IncrementalHash> stack;
+    for (size_t i = 0; i < 100; ++i) {
+      stack.Emplace();
+    }
+    ASSERT_EQ(Tracked::alive, 100);
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+
+  SafeStackSmall<std::string, 4, IncrementalHash> strings;
+  for (size_t i = 0; i < 50; ++i) {
+    strings.Push(std::to_string(i));
+  }
+  strings.Ok(true);
+  for (size_t i = 0; i < 50; ++i) {
+    ASSERT_EQ(strings.Pop(), std::to_string(49 - i));
+  }
+}
+
+TEST(STATIC, overflow) {
+  SafeStackStatic<uint64_t, 10, IncrementalHash> stack;
+  for (size_t i = 0; i < 10; ++i) {
+    stack.Push(i);
+  }
+  EXPECT_THROW(stack.Push(10), shush::dump::Dump);
+  uint64_t items[2] = {};
+  EXPECT_THROW(stack.PushN(items, 2), shush::dump::Dump);
+  stack.Ok(true);
+  ASSERT_EQ(stack.Pop(), 9);
+
+  {
+    SafeStackStatic<Tracked, 10> tracked;
+    tracked.Emplace();
+    tracked.Emplace();
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+}
+
+TEST(SEGMENTED, intrusion) {
+  SegmentedStack stack;
+  for (size_t i = 0; i < 250; ++i) {
+    stack.Push(i);
+  }
+  stack.Ok();
+
+  // An element of the top chunk is caught by Ok().
+  const uint64_t* top = &stack.Top();
+  const_cast<uint64_t*>(top)[-1] ^= 1;
+  EXPECT_THROW(stack.Ok(), shush::dump::Dump);
+  const_cast<uint64_t*>(top)[-1] ^= 1;
+
+  // An element of a full chunk only by Ok(true).
+  const uint64_t* deep = &stack.Peek(200);
+  const_cast<uint64_t*>(deep)[0] ^= 1;
+  stack.Ok();
+  EXPECT_THROW(stack.Ok(true), shush::dump::Dump);
+  const_cast<uint64_t*>(deep)[0] ^= 1;
+
+  // A poisoned cell of the top chunk.
+  const_cast<uint64_t*>(top)[1] = 0;
+  EXPECT_THROW(stack.Ok(), shush::dump::Dump);
+  EXPECT_THROW(stack.Push(0), shush::dump::Dump);
+}
+
+TEST(SEGMENTED, non_trivial) {
+  {
+    SegmentedSafeStack<Tracked, 16> stack;
+    for (size_t i = 0; i < 100; ++i) {
+      stack.Emplace();
+    }
+    for (size_t i = 0; i < 30; ++i) {
+      stack.Drop();
+    }
+    ASSERT_EQ(Tracked::alive, 70);
+    stack.Ok(true);
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+
+  SegmentedSafeStack<std::string, 4> strings;
+  for (size_t i = 0; i < 50; ++i) {
+    strings.Push(std::to_string(i) + std::string(i, 'x'));
+  }
+  strings.Ok(true);
+  for (size_t i = 0; i < 50; ++i) {
+    ASSERT_EQ(strings.Pop(), std::to_string(49 - i) + std::string(49 - i, 'x'));
+  }
+}
+
+static std::string GetMappedPath(const char* name) {
+  return "/tmp/shush-stack-test-" + std::to_string(getpid()) + "-" + name;
+}
+
+TEST(MAPPED, reopen) {
+  const std::string path = GetMappedPath("reopen");
+  unlink(path.c_str());
+  {
+    MappedSafeStack<uint64_t> stack(path.c_str());
+    for (uint64_t i = 0; i < 1000; ++i) {
+      stack.Push(i * i);
+    }
+  }
+  {
+    MappedSafeStack<uint64_t> stack(path.c_str());
+    ASSERT_EQ(stack.GetCurSize(), 1000);
+    stack.Ok(true);
+    for (uint64_t i = 999; i >= 500; --i) {
+      ASSERT_EQ(stack.Pop(), i * i);
+    }
+  }
+
+  MappedSafeStack<uint64_t, FlushSync> stack(path.c_str());
+  ASSERT_EQ(stack.GetCurSize(), 500);
+  ASSERT_EQ(stack.Top(), 499 * 499);
+  stack.Flush();
+  unlink(path.c_str());
+}
+
+TEST(MAPPED, torn_push) {
+  const std::string path = GetMappedPath("torn-push");
+  for (bool size_written : {false, true}) {
+    unlink(path.c_str());
+    {
+      MappedSafeStack<uint64_t> stack(path.c_str());
+      for (uint64_t i = 0; i < 5; ++i) {
+        stack.Push(i);
+      }
+    }
+
+    // The element is in place, but the hash is still the old one.
+    const int fd = open(path.c_str(), O_RDWR);
+    const uint64_t item = 5;
+    const size_t   size = 6;
+    ASSERT_EQ(pwrite(fd, &item, sizeof(item), BUF_POS + 5 * sizeof(item)),
+              sizeof(item));
+    if (size_written) {
+      ASSERT_EQ(pwrite(fd, &size, sizeof(size), CUR_SIZE_POS), sizeof(size));
+    }
+    close(fd);
+
+    MappedSafeStack<uint64_t> stack(path.c_str());
+    ASSERT_EQ(stack.GetCurSize(), 5);
+    ASSERT_EQ(stack.Top(), 4);
+    stack.Push(5);
+    stack.Ok(true);
+  }
+  unlink(path.c_str());
+}
+
+TEST(MAPPED, broken_file) {
+  const std::string path = GetMappedPath("broken");
+  for (size_t offset : {CUR_SIZE_POS, BUF_POS + 2 * sizeof(uint64_t)}) {
+    unlink(path.c_str());
+    {
+      MappedSafeStack<uint64_t> stack(path.c_str());
+      for (uint64_t i = 0; i < 5; ++i) {
+        stack.Push(i);
+      }
+    }
+
+    // A Pop that did not poison the cell, or a flipped element.
+    const int fd = open(path.c_str(), O_RDWR);
+    uint64_t value = 0;
+    ASSERT_EQ(pread(fd, &value, sizeof(value), offset), sizeof(value));
+    value ^= 1;
+    ASSERT_EQ(pwrite(fd, &value, sizeof(value), offset), sizeof(value));
+    close(fd);
+
+    EXPECT_THROW(MappedSafeStack<uint64_t> stack(path.c_str()),
+                 shush::dump::Dump);
+  }
+  unlink(path.c_str());
+}
+
+TEST(MAPPED, killed_writer) {
+  const std::string path  = GetMappedPath("killed");
+  const uint64_t    items = 1 << 16;
+  std::mt19937      rng(42);
+  for (size_t round = 0; round < 10; ++round) {
+    unlink(path.c_str());
+    int ready[2];
+    ASSERT_EQ(pipe(ready), 0);
+
+    const pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+    if (pid == 0) {
+      // gtest cannot report from the child, so it only exits with 1.
+      try {
+        MappedSafeStack<uint64_t> stack(path.c_str());
+        // Grown up front, so that the kill lands in a Push and not in the
+        // middle of a reallocation.
+        stack.Reserve(items);
+        if (write(ready[1], "", 1) != 1) {
+          _exit(1);
+        }
+        for (uint64_t i = 0; i < items; ++i) {
+          stack.Push(i);
+        }
+      } catch (...) {
+        _exit(1);
+      }
+      _exit(0);
+    }
+
+    // Without the write end a child that failed early reads as the end of
+    // the pipe.
+    close(ready[1]);
+    char byte = 0;
+    if (read(ready[0], &byte, 1) == 1) {
+      usleep(rng() % 2000);
+      kill(pid, SIGKILL);
+    }
+    close(ready[0]);
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    if (WIFEXITED(status)) {
+      ASSERT_EQ(WEXITSTATUS(status), 0);
+    } else {
+      ASSERT_TRUE(WIFSIGNALED(status));
+      ASSERT_EQ(WTERMSIG(status), SIGKILL);
+    }
+
+    MappedSafeStack<uint64_t> stack(path.c_str());
+    stack.Ok(true);
+    for (uint64_t i = stack.GetCurSize(); i-- > 0;) {
+      ASSERT_EQ(stack.Pop(), i);
+    }
+  }
+  unlink(path.c_str());
+}
+
+static std::string GetSharedName(const char* name) {
+  return "/shush-stack-test-" + std::to_string(getpid()) + "-" + name;
+}
+
+class SharedProbe : public SharedSafeStack<uint64_t> {
+  public:
+  using SharedSafeStack<uint64_t>::SharedSafeStack;
+  using SharedSafeStack<uint64_t>::GetControl;
+  using SharedSafeStack<uint64_t>::GetSlot;
+  using SharedSafeStack<uint64_t>::SetCurSizeVal;
+};
+
+TEST(SHARED, attach) {
+  const std::string name = GetSharedName("attach");
+  SharedSafeStack<uint64_t>::Remove(name.c_str());
+  {
+    SharedSafeStack<uint64_t> first(name.c_str(), 100);
+    for (uint64_t i = 0; i < 50; ++i) {
+      first.Push(i);
+    }
+
+    // Mapped at another address, and the capacity is the one it was
+    // created with.
+    SharedSafeStack<uint64_t> second(name.c_str(), 10);
+    ASSERT_EQ(second.GetBufSize(), 100);
+    ASSERT_EQ(second.Pop(), 49);
+    second.Push(100);
+    ASSERT_EQ(first.Pop(), 100);
+    ASSERT_EQ(first.GetCurSize(), 49);
+
+    for (uint64_t i = 49; i < 100; ++i) {
+      ASSERT_TRUE(second.TryPush(i));
+    }
+    ASSERT_FALSE(first.TryPush(0));
+    EXPECT_THROW(first.Push(0), shush::dump::Dump);
+    first.Ok();
+    second.Ok();
+  }
+
+  EXPECT_THROW(SharedSafeStack<uint32_t> stack(name.c_str()),
+               shush::dump::Dump);
+  {
+    SharedProbe stack(name.c_str());
+    for (uint64_t i = 100; i-- > 0;) {
+      ASSERT_EQ(stack.Pop(), i);
+    }
+    uint64_t item = 0;
+    ASSERT_FALSE(stack.TryPop(item));
+    EXPECT_THROW(stack.Pop(), shush::dump::Dump);
+
+    stack.GetSlot(3)[0] = 0;
+    EXPECT_THROW(stack.Ok(), shush::dump::Dump);
+  }
+  EXPECT_THROW(SharedSafeStack<uint64_t> stack(name.c_str()),
+               shush::dump::Dump);
+  SharedSafeStack<uint64_t>::Remove(name.c_str());
+}
+
+TEST(SHARED, processes) {
+  const std::string name          = GetSharedName("processes");
+  const size_t      workers_count = 4;
+  const uint64_t    items         = 10000;
+  SharedSafeStack<uint64_t>::Remove(name.c_str());
+  SharedSafeStack<uint64_t> stack(name.c_str(), 1000);
+
+  std::vector<pid_t> workers;
+  for (size_t worker = 0; worker < workers_count; ++worker) {
+    const pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+    if (pid == 0) {
+      SharedSafeStack<uint64_t> shared(name.c_str());
+      for (uint64_t i = 0; i < items; ++i) {
+        while (!shared.TryPush(worker * items + i)) {
+          std::this_thread::yield();
+        }
+      }
+      _exit(0);
+    }
+    workers.push_back(pid);
+  }
+
+  uint64_t sum = 0;
+  for (uint64_t popped = 0; popped < workers_count * items;) {
+    uint64_t item = 0;
+    if (stack.TryPop(item)) {
+      sum += item;
+      ++popped;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  for (pid_t pid : workers) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    ASSERT_EQ(status, 0);
+  }
+
+  const uint64_t all = workers_count * items;
+  ASSERT_EQ(sum, all * (all - 1) / 2);
+  stack.Ok();
+  SharedSafeStack<uint64_t>::Remove(name.c_str());
+}
+
+TEST(SHARED, torn_push) {
+  const std::string name = GetSharedName("torn-push");
+  for (bool size_written : {false, true}) {
+    SharedSafeStack<uint64_t>::Remove(name.c_str());
+    SharedProbe stack(name.c_str(), 10);
+    for (uint64_t i = 0; i < 5; ++i) {
+      stack.Push(i);
+    }
+
+    // The worker dies with the element in place and the mutex held, but
+    // without the new hash.
+    const pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+    if (pid == 0) {
+      SharedProbe shared(name.c_str());
+      pthread_mutex_lock(&shared.GetControl().mutex);
+      const uint64_t item = 5;
+      memcpy(shared.GetSlot(5), &item, sizeof(item));
+      if (size_written) {
+        shared.SetCurSizeVal(6);
+      }
+      _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+
+    ASSERT_EQ(stack.GetCurSize(), 5);
+    stack.Ok();
+    ASSERT_EQ(stack.Pop(), 4);
+  }
+  SharedSafeStack<uint64_t>::Remove(name.c_str());
+}
+
+TEST(SHARED, killed_worker) {
+  const std::string name  = GetSharedName("killed");
+  const uint64_t    items = 1 << 16;
+  std::mt19937      rng(42);
+  for (size_t round = 0; round < 10; ++round) {
+    SharedSafeStack<uint64_t>::Remove(name.c_str());
+    SharedSafeStack<uint64_t> stack(name.c_str(), items);
+    int ready[2];
+    ASSERT_EQ(pipe(ready), 0);
+
+    const pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+    if (pid == 0) {
+      SharedSafeStack<uint64_t> shared(name.c_str());
+      ASSERT_EQ(write(ready[1], "", 1), 1);
+      for (uint64_t i = 0; i < items; ++i) {
+        shared.Push(i);
+        if (i % 3 == 0) {
+          shared.Pop();
+          shared.Push(i);
+        }
+      }
+      _exit(0);
+    }
+
+    char byte = 0;
+    ASSERT_EQ(read(ready[0], &byte, 1), 1);
+    close(ready[0]);
+    close(ready[1]);
+    usleep(rng() % 2000);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    // The worker may have died holding the mutex, in the middle of a Push
+    // or a Pop.
+    stack.Ok();
+    for (uint64_t i = stack.GetCurSize(); i-- > 0;) {
+      ASSERT_EQ(stack.Pop(), i);
+    }
+  }
+  SharedSafeStack<uint64_t>::Remove(name.c_str());
+}
+
+TEST(CONCURRENT, single_thread) {
+  ConcurrentSafeStack<uint64_t> stack;
+  for (size_t i = 0; i < 1000; ++i) {
+    stack.Push(i);
+  }
+  stack.Ok();
+  ASSERT_EQ(stack.GetCurSize(), 1000);
+  for (size_t i = 0; i < 1000; ++i) {
+    ASSERT_EQ(stack.Pop(), 999 - i);
+  }
+
+  uint64_t item = 0;
+  ASSERT_FALSE(stack.TryPop(item));
+  stack.Ok();
+}
+
+/**
+ * Run under -fsanitize=thread to check the synchronization.
+ */
+TEST(CONCURRENT, stress) {
+  const size_t threads_count = 8;
+  const size_t ops_count     = 20000;
+
+  ConcurrentSafeStack<uint64_t> stack;
+  std::atomic<uint64_t>         popped_sum(0);
+  std::vector<std::thread>      threads;
+  for (size_t t = 0; t < threads_count; ++t) {
+    threads.emplace_back([&stack, &popped_sum, t] {
+      uint64_t sum = 0;
+      for (size_t i = 0; i < ops_count; ++i) {
+        stack.Push(t * ops_count + i);
+        uint64_t item = 0;
+        if (i % 3 != 0 && stack.TryPop(item)) {
+          sum += item;
+        }
+      }
+      popped_sum += sum;
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  stack.Ok();
+
+  uint64_t sum  = popped_sum;
+  uint64_t item = 0;
+  while (stack.TryPop(item)) {
+    sum += item;
+  }
+
+  const uint64_t all = threads_count * ops_count;
+  ASSERT_EQ(sum, all * (all - 1) / 2);
+  stack.Ok();
+}
+
+class ConcurrentProbe : public ConcurrentSafeStack<uint64_t> {
+  public:
+  using ConcurrentSafeStack<uint64_t>::GetNode;
+};
+
+TEST(CONCURRENT, write_after_pop) {
+  ConcurrentProbe stack;
+  stack.Push(1);
+  ASSERT_EQ(stack.Pop(), 1);
+
+  stack.GetNode(0).element[0] = 0;
+  EXPECT_THROW(stack.Ok(), shush::dump::Dump);
+  EXPECT_THROW(stack.Push(2), shush::dump::Dump);
+}
+
+TEST(CONCURRENT, pop_checks_the_node) {
+  ConcurrentProbe stack;
+  stack.Push(1);
+  stack.Push(2);
+
+  stack.GetNode(1).element[0] ^= 1;
+  EXPECT_THROW(stack.Pop(), shush::dump::Dump);
+}
+
+struct ThrowingCopy {
+  ThrowingCopy() = default;
+  ThrowingCopy(ThrowingCopy&&) = default;
+  ThrowingCopy(const ThrowingCopy&) {
+    throw std::runtime_error("copy");
+  }
+  ThrowingCopy& operator=(ThrowingCopy&&) = default;
+};
+
+class ThrowingProbe : public ConcurrentSafeStack<ThrowingCopy> {
+  public:
+  using ConcurrentSafeStack<ThrowingCopy>::next_unused_;
+};
+
+TEST(CONCURRENT, throwing_push) {
+  ThrowingProbe stack;
+  ThrowingCopy  item;
+  for (size_t i = 0; i < 10; ++i) {
+    EXPECT_THROW(stack.Push(item), std::runtime_error);
+  }
+  ASSERT_EQ(stack.GetCurSize(), 0);
+  stack.Ok();
+
+  // The same node went back to the free list every time, poisoned.
+  ASSERT_EQ(stack.next_unused_.load(), 1);
+  stack.Push(ThrowingCopy());
+  stack.Pop();
+  stack.Ok();
+}
+
+TEST(RING, single_thread) {
+  SafeRing<uint64_t> ring(100);
+  ASSERT_EQ(ring.GetBufSize(), 128);
+
+  uint64_t item = 0;
+  ASSERT_FALSE(ring.TryPop(item));
+  // Several laps, so the indices wrap around the buffer.
+  for (uint64_t lap = 0; lap < 5; ++lap) {
+    for (uint64_t i = 0; i < ring.GetBufSize(); ++i) {
+      ring.Push(lap * 1000 + i);
+    }
+    ASSERT_FALSE(ring.TryPush(0));
+    EXPECT_THROW(ring.Push(0), shush::dump::Dump);
+    ring.Ok();
+    ASSERT_EQ(ring.GetCurSize(), ring.GetBufSize());
+    for (uint64_t i = 0; i < ring.GetBufSize(); ++i) {
+      ASSERT_EQ(ring.Pop(), lap * 1000 + i);
+    }
+    ring.Ok();
+  }
+
+  ASSERT_FALSE(ring.TryPop(item));
+  EXPECT_THROW(ring.Pop(), shush::dump::Dump);
+}
+
+TEST(RING, non_trivial) {
+  SafeRing<std::string, Mpmc> ring(4);
+  ring.Push(std::string(100, 'a'));
+  ring.Push("b");
+  ring.Ok();
+  ASSERT_EQ(ring.Pop(), std::string(100, 'a'));
+  // The destructor destroys the one left.
+  ring.Push(std::string(100, 'c'));
+}
+
+template <class Ring>
+static void CheckThrowingRingPush() {
+  {
+    Ring    ring(4);
+    Fragile item;
+    ring.Push(item);
+    Fragile::copies_left = 0;
+    EXPECT_THROW(ring.Push(item), std::runtime_error);
+    Fragile::copies_left = INT_MAX;
+    ring.Ok();
+    ASSERT_EQ(Tracked::alive, 2);
+
+    // Laps over the slot of the failed push.
+    for (size_t i = 0; i < 10; ++i) {
+      ring.Push(item);
+      ring.Pop();
+      ring.Ok();
+    }
+    ring.Push(item);
+    ASSERT_EQ(Tracked::alive, 3);
+  }
+  ASSERT_EQ(Tracked::alive, 0);
+}
+
+TEST(RING, throwing_push) {
+  CheckThrowingRingPush<SafeRing<Fragile, Spsc>>();
+  CheckThrowingRingPush<SafeRing<Fragile, Mpmc>>();
+}
+
+template <class Ring>
+void RunRingStress(size_t producers_count, size_t consumers_count) {
+  const size_t ops_count = 20000;
+
+  Ring                     ring(64);
+  std::atomic<uint64_t>    popped_sum(0);
+  std::atomic<size_t>      popped_count(0);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < producers_count; ++t) {
+    threads.emplace_back([&ring, t] {
+      for (size_t i = 0; i < ops_count; ++i) {
+        while (!ring.TryPush(t * ops_count + i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  const size_t all = producers_count * ops_count;
+  for (size_t t = 0; t < consumers_count; ++t) {
+    threads.emplace_back([&ring, &popped_sum, &popped_count, all] {
+      uint64_t last = 0;
+      uint64_t item = 0;
+      while (popped_count < all) {
+        if (!ring.TryPop(item)) {
+          std::this_thread::yield();
+          continue;
+        }
+        // With one producer and one consumer the order is kept.
+        if (Ring::IS_SPSC) {
+          EXPECT_TRUE(item == 0 || item > last);
+        }
+        last = item;
+        popped_sum += item;
+        ++popped_count;
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  ring.Ok();
+  ASSERT_EQ(ring.GetCurSize(), 0);
+  ASSERT_EQ(popped_sum, all * (all - 1) / 2);
+}
+
+template <class ConcurrencyPolicy>
+class RingProbe : public SafeRing<uint64_t, ConcurrencyPolicy> {
+  public:
+  static constexpr bool IS_SPSC = !ConcurrencyPolicy::MULTI;
+
+  using SafeRing<uint64_t, ConcurrencyPolicy>::SafeRing;
+  using SafeRing<uint64_t, ConcurrencyPolicy>::GetSlot;
+  using SafeRing<uint64_t, ConcurrencyPolicy>::head_;
+  using SafeRing<uint64_t, ConcurrencyPolicy>::tail_;
+};
+
+/**
+ * Run under -fsanitize=thread to check the synchronization.
+ */
+TEST(RING, spsc) {
+  RunRingStress<RingProbe<Spsc>>(1, 1);
+}
+
+TEST(RING, mpmc) {
+  RunRingStress<RingProbe<Mpmc>>(4, 4);
+}
+
+TEST(RING, corruption) {
+  {
+    RingProbe<Spsc> ring(8);
+    ring.Push(1);
+    ring.Push(2);
+    reinterpret_cast<uint64_t&>(ring.GetSlot(1).element) = 3;
+    EXPECT_THROW(ring.Ok(), shush::dump::Dump);
+    ASSERT_EQ(ring.Pop(), 1);
+    EXPECT_THROW(ring.Pop(), shush::dump::Dump);
+  }
+  {
+    // A write to a free slot.
+    RingProbe<Mpmc> ring(8);
+    ring.GetSlot(0).element[0] = 0;
+    EXPECT_THROW(ring.Ok(), shush::dump::Dump);
+    EXPECT_THROW(ring.Push(1), shush::dump::Dump);
+  }
+  {
+    RingProbe<Spsc> ring(8);
+    ring.Push(1);
+    ring.tail_.value = 5;
+    EXPECT_THROW(ring.Ok(), shush::dump::Dump);
+    EXPECT_THROW(ring.Push(2), shush::dump::Dump);
+  }
+  {
+    // Both the index and its check, so only the bounds can tell.
+    RingProbe<Spsc> ring(8);
+    ring.Push(1);
+    ring.head_.value = 2;
+    ring.head_.check = MixHash(2);
+    EXPECT_THROW(ring.Ok(), shush::dump::Dump);
+    EXPECT_THROW(ring.Pop(), shush::dump::Dump);
+  }
+}
+
+TEST(STATS, counters) {
+  using Stack = SafeStack<uint64_t, FullHash, VerifyParanoid, LogNone>;
+  {
+    Stack stack;
+    for (uint64_t i = 0; i < 100; ++i) {
+      stack.Push(i);
+    }
+    for (uint64_t i = 0; i < 40; ++i) {
+      stack.Drop();
+    }
+    stack.Ok(true);
+
+    const stats::Stats stats = stack.GetStats();
+#if SHUSH_STACK_STATS
+    ASSERT_EQ(stats.pushes, 100);
+    ASSERT_EQ(stats.pops, 40);
+    // 10 -> 20 -> 40 -> 80 -> 160.
+    ASSERT_EQ(stats.reallocations, 4);
+    ASSERT_GE(stats.verifications, 141);
+    ASSERT_GE(stats.hash_computations, stats.pushes + stats.pops);
+    ASSERT_GE(stats.bytes_hashed,
+              stats.hash_computations * 10 * sizeof(uint64_t));
+    for (size_t i = 0; i < stats::LAYERS_COUNT; ++i) {
+      ASSERT_GT(stats.ticks[i], 0);
+    }
+#else
+    ASSERT_EQ(stats.pushes, 0);
+    ASSERT_EQ(stats.hash_computations, 0);
+#endif
+  }
+
+  // Folded into the stats of the type on destruction.
+  const stats::Stats type_stats = Stack::GetTypeStats();
+#if SHUSH_STACK_STATS
+  ASSERT_GE(type_stats.pushes, 100);
+  ASSERT_GE(type_stats.pops, 40);
+#else
+  ASSERT_EQ(type_stats.pushes, 0);
+#endif
+}
+
+TEST(BINLOG, records) {
+  const std::string path = GetMappedPath("binlog");
+  binlog::Sink::Get().Start(path.c_str());
+  {
+    auto work = [] {
+      SafeStack<uint64_t, IncrementalHash, VerifySampled<>, LogBinary> stack;
+      for (uint64_t i = 0; i < 100; ++i) {
+        stack.Push(i);
+      }
+      for (uint64_t i = 0; i < 100; ++i) {
+        stack.Drop();
+      }
+      EXPECT_THROW(stack.Drop(), shush::dump::Dump);
+    };
+    std::thread other(work);
+    work();
+    other.join();
+  }
+  binlog::Sink::Get().Stop();
+  ASSERT_FALSE(binlog::Sink::Get().IsRunning());
+
+  FILE* file = fopen(path.c_str(), "rb");
+  ASSERT_NE(file, nullptr);
+  binlog::FileHeader header = {};
+  ASSERT_EQ(fread(&header, sizeof(header), 1, file), 1);
+  ASSERT_EQ(memcmp(header.magic, binlog::FILE_MAGIC, sizeof(header.magic)), 0);
+  ASSERT_EQ(header.version, binlog::FILE_VERSION);
+  ASSERT_EQ(header.record_size, sizeof(binlog::Record));
+
+  size_t counts[static_cast<size_t>(binlog::Event::DROPPED) + 1] = {};
+  binlog::Record record = {};
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    ++counts[static_cast<size_t>(record.event)];
+    if (record.event == binlog::Event::ERROR) {
+      ASSERT_EQ(record.error_code, Errc::POP_ON_0_SIZE);
+      ASSERT_NE(binlog::Format(record).find("Error"), std::string::npos);
+    }
+  }
+  fclose(file);
+  unlink(path.c_str());
+
+  ASSERT_EQ(counts[static_cast<size_t>(binlog::Event::CONSTRUCTED)], 2);
+  ASSERT_EQ(counts[static_cast<size_t>(binlog::Event::DESTROYED)], 2);
+  ASSERT_EQ(counts[static_cast<size_t>(binlog::Event::PUSHED)], 200);
+  ASSERT_EQ(counts[static_cast<size_t>(binlog::Event::POPPED)], 200);
+  ASSERT_EQ(counts[static_cast<size_t>(binlog::Event::ERROR)], 2);
+  ASSERT_GT(counts[static_cast<size_t>(binlog::Event::REALLOCATED)], 0);
+  ASSERT_EQ(counts[static_cast<size_t>(binlog::Event::DROPPED)], 0);
+}
+
+TEST(POISON, kernels) {
+  std::vector<char> buf(300);
+  for (size_t size = 0; size < buf.size(); size += 7) {
+    poison::Fill(buf.data(), buf.data() + size);
+    ASSERT_EQ(
+        poison::FindNonPoison(buf.data(), buf.data() + size),
+        buf.data() + size);
+
+    for (size_t bad = 0; bad < size; bad += 5) {
+      buf[bad] = 0;
+      ASSERT_EQ(
+          poison::FindNonPoison(buf.data(), buf.data() + size),
+          buf.data() + bad);
+      buf[bad] = POISON_VALUE;
+    }
+  }
+}
+
+TEST(HASH, known_vectors) {
+  ASSERT_EQ(Crc32c::Hash("123456789", 9), 0xE3069283);
+  ASSERT_EQ(Crc32c::Hash("", 0), 0);
+
+  char message[15];
+  for (size_t i = 0; i < sizeof(message); ++i) {
+    message[i] = static_cast<char>(i);
+  }
+  const uint64_t key0 = 0x0706050403020100;
+  const uint64_t key1 = 0x0F0E0D0C0B0A0908;
+  ASSERT_EQ(SipHash::Hash(message, 0, key0, key1), 0x726FDB47DD0E0E31);
+  ASSERT_EQ(SipHash::Hash(message, 15, key0, key1), 0xA129CA6149BE45E5);
+}
+
+template <class HashFunction>
+void CheckBitFlips() {
+  std::vector<char> buf(100);
+  for (size_t i = 0; i < buf.size(); ++i) {
+    buf[i] = static_cast<char>(i * 37);
+  }
+  for (size_t size = 1; size < buf.size(); ++size) {
+    const uint64_t hash = HashFunction::Hash(buf.data(), size);
+    for (size_t bit = 0; bit < size * 8; ++bit) {
+      buf[bit / 8] ^= 1 << (bit % 8);
+      ASSERT_NE(HashFunction::Hash(buf.data(), size), hash);
+      buf[bit / 8] ^= 1 << (bit % 8);
+    }
+  }
+}
+
+TEST(HASH, bit_flips) {
+  CheckBitFlips<StdHash>();
+  CheckBitFlips<Wyhash>();
+  CheckBitFlips<Crc32c>();
+  CheckBitFlips<SipHash>();
+}
+
+template <class HashPolicy>
+void CheckIntrusion() {
+  SafeStack<uint64_t, HashPolicy, VerifyHeader> stack;
+  for (size_t i = 0; i < 100; ++i) {
+    stack.Push(i);
+  }
+  stack.Ok(true);
+
+  char* buf = *reinterpret_cast<char**>(&stack);
+  buf[BUF_POS + 3 * sizeof(uint64_t)] ^= 1;
+  EXPECT_THROW(stack.Ok(true), shush::dump::Dump);
+}
+
+TEST(HASH, functions) {
+  CheckIntrusion<FullHashWith<StdHash>>();
+  CheckIntrusion<FullHashWith<Crc32c>>();
+  CheckIntrusion<FullHashWith<SipHash>>();
+  CheckIntrusion<IncrementalHashWith<StdHash>>();
+  CheckIntrusion<IncrementalHashWith<Crc32c>>();
+  CheckIntrusion<IncrementalHashWith<SipHash>>();
+  CheckIntrusion<FullHash>();
+  CheckIntrusion<IncrementalHash>();
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();